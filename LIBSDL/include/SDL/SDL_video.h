@@ -947,6 +947,28 @@ extern DECLSPEC SDL_GrabMode SDLCALL SDL_WM_GrabInput(SDL_GrabMode mode);
 
 /*@}*/
 
+#ifdef __N3DS__
+/** @name N3DS dirty bands
+ *  Dirty tracking of a linear buffer that is transferred to a tiled texture,
+ *  in bands of 8 lines (one row of texture tiles). The bitmap is updated with
+ *  atomic operations, so other threads may report dirty lines while the
+ *  buffer is being transferred.
+ */
+/*@{*/
+#define SDL_N3DS_BAND_HEIGHT	8
+#define SDL_N3DS_MAX_BANDS	(1024 / SDL_N3DS_BAND_HEIGHT)
+/** Mark lines y to y+h-1 of a buffer with the given number of bands dirty */
+extern DECLSPEC void SDLCALL SDL_N3DSSetDirtyBands(Uint32 *dirty, int bands, int y, int h);
+/**
+ * Transfer the runs of dirty bands of a w*h buffer to the texture data and
+ * clear them. The transfer flips vertically, so buffer line y ends up in
+ * texture line h-1-y. Returns 0 if no band was dirty.
+ */
+extern DECLSPEC int SDLCALL SDL_N3DSTransferDirtyBands(Uint32 *dirty, int bands,
+	const void *buffer, void *texture, int w, int h, int bpp, Uint32 flags);
+/*@}*/
+#endif
+
 /** @internal Not in public API at the moment - do not use! */
 extern DECLSPEC int SDLCALL SDL_SoftStretch(SDL_Surface *src, SDL_Rect *srcrect,
                                     SDL_Surface *dst, SDL_Rect *dstrect);
@@ -9,6 +9,7 @@
 #include "../SDL_joystick_c.h"
 
 #include "../../video/n3ds/SDL_n3dsvideo.h"
+#include "../../video/n3ds/SDL_n3dsevents_c.h"
 
 int old_x = 0, old_y = 0;
 int old_cs_x = 0, old_cs_y = 0;
@@ -81,7 +82,7 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		SDL_PrivateJoystickAxis (joystick, 3, - y * 210);
 	}
 
-	key_press = hidKeysDown ();
+	key_press = N3DS_KeysDown ();
 	int dpad_state = old_dpad_state;
 	if ((key_press & KEY_A)) {
 		SDL_PrivateJoystickButton (joystick, 1, SDL_PRESSED);
@@ -126,7 +127,7 @@ void SDL_SYS_JoystickUpdate (SDL_Joystick *joystick) {
 		SDL_PrivateJoystickButton (joystick, 9, SDL_PRESSED);
 	}
 
-	key_release = hidKeysUp ();
+	key_release = N3DS_KeysUp ();
 	if ((key_release & KEY_A)) {
 		SDL_PrivateJoystickButton (joystick, 1, SDL_RELEASED);
 	}
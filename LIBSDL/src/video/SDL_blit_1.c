@@ -248,7 +248,23 @@ static void Blit1to4(SDL_BlitInfo *info)
 	map = (Uint32 *)info->table;
 
 	while ( height-- ) {
-#ifdef USE_DUFFS_LOOP
+#if ( SDL_BYTEORDER == SDL_LIL_ENDIAN )
+		/* Load four source pixels with one word read */
+		int n;
+		for ( n = width; n >= 4; n -= 4 ) {
+			Uint32 pixels;
+			SDL_memcpy(&pixels, src, 4);
+			dst[0] = map[pixels & 0xff];
+			dst[1] = map[(pixels >> 8) & 0xff];
+			dst[2] = map[(pixels >> 16) & 0xff];
+			dst[3] = map[pixels >> 24];
+			src += 4;
+			dst += 4;
+		}
+		for ( ; n; --n ) {
+			*dst++ = map[*src++];
+		}
+#elif defined(USE_DUFFS_LOOP)
 		DUFFS_LOOP(
 			*dst++ = map[*src++];
 		, width);
@@ -384,11 +400,50 @@ static void Blit1to4Key(SDL_BlitInfo *info)
 	int dstskip = info->d_skip;
 	Uint32 *palmap = (Uint32 *)info->table;
 	Uint32 ckey = info->src->colorkey;
+#if ( SDL_BYTEORDER == SDL_LIL_ENDIAN )
+	Uint32 keys = (ckey & 0xff) * 0x01010101;
+#endif
 
 	/* Set up some basic variables */
 	dstskip /= 4;
 
 	while ( height-- ) {
+#if ( SDL_BYTEORDER == SDL_LIL_ENDIAN )
+		/* Four source pixels at a time: font glyphs are mostly runs
+		   that are either all colorkey or all opaque, each told apart
+		   by a single test on the word */
+		int n;
+		for ( n = width; n >= 4; n -= 4 ) {
+			Uint32 pixels, diff;
+			SDL_memcpy(&pixels, src, 4);
+			diff = pixels ^ keys;
+			if ( diff == 0 ) {
+				/* all transparent */
+			} else if ( ((diff - 0x01010101) & ~diff & 0x80808080) == 0 ) {
+				/* no byte matches the key */
+				dstp[0] = palmap[pixels & 0xff];
+				dstp[1] = palmap[(pixels >> 8) & 0xff];
+				dstp[2] = palmap[(pixels >> 16) & 0xff];
+				dstp[3] = palmap[pixels >> 24];
+			} else {
+				int i;
+				for ( i = 0; i < 4; ++i ) {
+					if ( src[i] != ckey ) {
+						dstp[i] = palmap[src[i]];
+					}
+				}
+			}
+			src += 4;
+			dstp += 4;
+		}
+		for ( ; n; --n ) {
+			if ( *src != ckey ) {
+				*dstp = palmap[*src];
+			}
+			src++;
+			dstp++;
+		}
+#else
 		DUFFS_LOOP(
 		{
 			if ( *src != ckey ) {
@@ -398,6 +453,7 @@ static void Blit1to4Key(SDL_BlitInfo *info)
 			dstp++;
 		},
 		width);
+#endif
 		src += srcskip;
 		dstp += dstskip;
 	}
@@ -1573,6 +1573,49 @@ static void BlitRGBtoRGBPixelAlpha(SDL_BlitInfo *info)
 	}
 }
 
+/* ABGR8888 (RGBA bytes, as loaded from PNG) blended onto RGBA8888 (the n3ds
+   screen format) with pixel alpha. Reversing the bytes gives the source the
+   layout of the destination, then red and blue are blended in parallel like
+   in BlitRGBtoRGBPixelAlpha. */
+static void BlitABGRtoRGBAPixelAlpha(SDL_BlitInfo *info)
+{
+	int width = info->d_width;
+	int height = info->d_height;
+	Uint32 *srcp = (Uint32 *)info->s_pixels;
+	int srcskip = info->s_skip >> 2;
+	Uint32 *dstp = (Uint32 *)info->d_pixels;
+	int dstskip = info->d_skip >> 2;
+
+	while(height--) {
+	    DUFFS_LOOP4({
+		Uint32 d;
+		Uint32 s1;
+		Uint32 d1;
+		Uint32 s = *srcp;
+		Uint32 alpha = s >> 24;
+		if(alpha) {
+		  s = SDL_Swap32(s);
+		  if(alpha == SDL_ALPHA_OPAQUE) {
+		    *dstp = (s & 0xffffff00) | (*dstp & 0x000000ff);
+		  } else {
+		    d = *dstp;
+		    s1 = (s >> 8) & 0xff00ff;
+		    d1 = (d >> 8) & 0xff00ff;
+		    d1 = (d1 + ((s1 - d1) * alpha >> 8)) & 0xff00ff;
+		    s = (s >> 8) & 0xff00;
+		    d = (d >> 8) & 0xff00;
+		    d = (d + ((s - d) * alpha >> 8)) & 0xff00;
+		    *dstp = (d1 | d) << 8 | (*dstp & 0x000000ff);
+		  }
+		}
+		++srcp;
+		++dstp;
+	    }, width);
+	    srcp += srcskip;
+	    dstp += dstskip;
+	}
+}
+
 #if GCC_ASMBLIT
 /* fast (as in MMX with prefetch) ARGB888->(A)RGB888 blending with pixel alpha */
 static void BlitRGBtoRGBPixelAlphaMMX3DNOW(SDL_BlitInfo *info)
@@ -2828,6 +2871,11 @@ SDL_loblit SDL_CalculateAlphaBlit(SDL_Surface *surface, int blit_index)
 	    return BlitNtoNPixelAlpha;
 
 	case 4:
+	    if(sf->BytesPerPixel == 4 && sf->Amask == 0xff000000
+	       && sf->Rmask == 0xff && sf->Gmask == 0xff00 && sf->Bmask == 0xff0000
+	       && df->Rmask == 0xff000000 && df->Gmask == 0xff0000
+	       && df->Bmask == 0xff00)
+		return BlitABGRtoRGBAPixelAlpha;
 	    if(sf->Rmask == df->Rmask
 	       && sf->Gmask == df->Gmask
 	       && sf->Bmask == df->Bmask
@@ -2031,6 +2031,36 @@ static void Blit4to4MaskAlpha(SDL_BlitInfo *info)
 	}
 }
 
+/* blits 32 bit pixels with the bytes reversed, like ABGR8888 (RGBA bytes,
+   as loaded from PNG) to RGBA8888 (the n3ds screen format); the swap
+   becomes a single rev instruction on ARMv6 */
+static void Blit4to4Swap(SDL_BlitInfo *info)
+{
+	int width = info->d_width;
+	int height = info->d_height;
+	Uint32 *src = (Uint32 *)info->s_pixels;
+	int srcskip = info->s_skip;
+	Uint32 *dst = (Uint32 *)info->d_pixels;
+	int dstskip = info->d_skip;
+	SDL_PixelFormat *srcfmt = info->src;
+	SDL_PixelFormat *dstfmt = info->dst;
+	/* COPY_ALPHA and NO_ALPHA take the swapped byte, SET_ALPHA replaces it */
+	Uint32 keep = srcfmt->Amask ? 0xffffffff : ~dstfmt->Amask;
+	Uint32 mask = srcfmt->Amask ? 0 : (srcfmt->alpha >> dstfmt->Aloss) << dstfmt->Ashift;
+
+	while ( height-- ) {
+		DUFFS_LOOP4(
+		{
+			*dst = (SDL_Swap32(*src) & keep) | mask;
+			++dst;
+			++src;
+		},
+		width);
+		src = (Uint32*)((Uint8*)src + srcskip);
+		dst = (Uint32*)((Uint8*)dst + dstskip);
+	}
+}
+
 static void BlitNtoN(SDL_BlitInfo *info)
 {
 	int width = info->d_width;
@@ -2361,6 +2391,10 @@ static const struct blit_table normal_blit_4[] = {
     { 0x00FF0000,0x0000FF00,0x000000FF, 2, 0x00007C00,0x000003E0,0x0000001F,
       0, NULL, Blit_RGB888_RGB555, NO_ALPHA },
 #endif
+    { 0x000000FF,0x0000FF00,0x00FF0000, 4, 0xFF000000,0x00FF0000,0x0000FF00,
+      0, NULL, Blit4to4Swap, NO_ALPHA | COPY_ALPHA | SET_ALPHA },
+    { 0xFF000000,0x00FF0000,0x0000FF00, 4, 0x000000FF,0x0000FF00,0x00FF0000,
+      0, NULL, Blit4to4Swap, NO_ALPHA | COPY_ALPHA | SET_ALPHA },
 	/* Default for 32-bit RGB source, used if no other blitter matches */
 	{ 0,0,0, 0, 0,0,0, 0, NULL, BlitNtoN, 0 }
 };
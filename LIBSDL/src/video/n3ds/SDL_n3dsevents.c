@@ -33,6 +33,67 @@
 #include "SDL_n3dsvideo.h"
 #include "SDL_n3dsevents_c.h"
 
+// Another thread may take over hidScanInput (e.g. to sample the controller at
+// a fixed rate). It collects the key edges it sees for the next event pump.
+static LightLock scanLock;
+static volatile int externalScan = 0;
+static u32 scanDown = 0, scanUp = 0;	// edges collected by the other thread
+static u32 keysDown = 0, keysUp = 0;	// edges handled by this event pump
+
+void SDL_N3DSExternalInputScan(int on) {
+	static int isinit = 0;
+	if (!isinit) {
+		LightLock_Init(&scanLock);
+		isinit = 1;
+	}
+	LightLock_Lock(&scanLock);
+	externalScan = on;
+	scanDown = scanUp = 0;
+	LightLock_Unlock(&scanLock);
+}
+
+// call instead of hidScanInput while SDL_N3DSExternalInputScan is on
+void SDL_N3DSScanInput(void) {
+	LightLock_Lock(&scanLock);
+	hidScanInput();
+	scanDown |= hidKeysDown();
+	scanUp |= hidKeysUp();
+	LightLock_Unlock(&scanLock);
+}
+
+u32 N3DS_KeysDown(void) {
+	return keysDown;
+}
+
+u32 N3DS_KeysUp(void) {
+	return keysUp;
+}
+
+static void scanInput(void) {
+	static u32 lastHeld = 0;
+	u32 held, both;
+
+	if (!externalScan) {
+		hidScanInput();
+		keysDown = hidKeysDown();
+		keysUp = hidKeysUp();
+		lastHeld = hidKeysHeld();
+		return;
+	}
+	LightLock_Lock(&scanLock);
+	held = hidKeysHeld();
+	keysDown = scanDown;
+	keysUp = scanUp;
+	scanDown = scanUp = 0;
+	LightLock_Unlock(&scanLock);
+	// keys pressed and released since the last pump: only report the edges
+	// which change the state the application has seen
+	both = keysDown & keysUp;
+	keysDown &= ~(both & lastHeld);
+	keysUp &= ~(both & held);
+	lastHeld = held;
+}
+
 void N3DS_PumpEvents(_THIS)
 {
 	svcSleepThread(100000); // 0.1 ms
@@ -49,7 +110,7 @@ void N3DS_PumpEvents(_THIS)
 		return;
 	}
 
-	hidScanInput();
+	scanInput();
 
 	if (hidKeysHeld() & KEY_TOUCH) {
 		touchPosition touch;
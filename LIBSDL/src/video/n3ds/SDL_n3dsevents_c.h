@@ -29,6 +29,9 @@
 */
 extern void N3DS_InitOSKeymap(_THIS);
 extern void N3DS_PumpEvents(_THIS);
+/* key edges seen by the last N3DS_PumpEvents, use instead of hidKeysDown/Up */
+extern u32 N3DS_KeysDown(void);
+extern u32 N3DS_KeysUp(void);
 
 /* end of SDL_nullevents_c.h ... */
 
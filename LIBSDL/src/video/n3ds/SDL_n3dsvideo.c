@@ -112,6 +112,31 @@ static void videoThread(void* data);
 static void (*addDrawCallback)(void *)=NULL;
 static void *addDrawParam=NULL;
 
+// dirty tracking of the video buffer, see SDL_N3DSSetDirtyBands
+// Note: other threads (e.g. a VNC decoding thread) may report dirty rects while we are flipping
+static int dirtyTracking = 0;
+static u32 dirtyBands[SDL_N3DS_MAX_BANDS / 32];
+static int bufferBands = 0;
+static volatile bool redrawRequested = false;
+
+// frames presented and the time spent transferring them to the texture
+static u32 presentFrames = 0;
+static u64 presentTicks = 0;
+
+// local cursor sprite, drawn over the top screen's video buffer
+// Note: the image may be set from other threads (e.g. a VNC decoding thread),
+// it is converted into the texture by the thread which flips
+#define CURSOR_SIZE 64
+static C3D_Tex cursor_tex;
+static u32 *cursorPixels = NULL;	// CURSOR_SIZE x CURSOR_SIZE in linear RAM
+static LightLock cursorLock;
+static volatile bool cursorChanged = false;
+static volatile bool cursorVisible = false;
+static int cursorW = 0, cursorH = 0, cursorHotX, cursorHotY;
+static float cursorZoom = 1.0f;
+static volatile int cursorX, cursorY;
+static void uploadCursor(void);
+
 /* Initialization/Query functions */
 static int N3DS_VideoInit(_THIS, SDL_PixelFormat *vformat);
 static SDL_Rect **N3DS_ListModes(_THIS, SDL_PixelFormat *format, Uint32 flags);
@@ -221,6 +246,7 @@ int N3DS_VideoInit(_THIS, SDL_PixelFormat *vformat)
 	gfxInitDefault();
 	gfxSet3D(false);
 	C3D_Init(C3D_DEFAULT_CMDBUF_SIZE);
+	LightLock_Init(&cursorLock);
 
 	vformat->BitsPerPixel = 32;
 	vformat->BytesPerPixel = 4;
@@ -409,6 +435,8 @@ SDL_Surface *N3DS_SetVideoMode(_THIS, SDL_Surface *current,
 	current->flags =  SDL_HWSURFACE | SDL_DOUBLEBUF | SDL_HWPALETTE;
 	this->hidden->w = hw;
 	this->hidden->h = hh;
+	bufferBands = hh / SDL_N3DS_BAND_HEIGHT;
+	SDL_N3DSSetDirtyBands(dirtyBands, bufferBands, 0, hh);
 
 	this->hidden->x1 = 0;
 	this->hidden->y1 = 0;
@@ -506,11 +534,146 @@ static int pos_y = INT_MAX;
 void SDL_SetVideoPosition(int x, int y) {
 	pos_x = x;
 	pos_y = y;
+	redrawRequested = true;
 }
 
 void SDL_ResetVideoPosition() {
 	pos_x = INT_MAX;
 	pos_y = INT_MAX;
+	redrawRequested = true;
+}
+
+void SDL_N3DSSetDirtyBands(u32 *dirty, int bands, int y, int h) {
+	int band, last;
+	u32 mask;
+
+	if (y < 0) { h += y; y = 0; }
+	if (h <= 0) return;
+	last = (y + h - 1) / SDL_N3DS_BAND_HEIGHT;
+	if (last >= bands) last = bands - 1;
+	for (band = y / SDL_N3DS_BAND_HEIGHT; band <= last; band = (band | 31) + 1) {
+		mask = ~0u << (band & 31);
+		if ((last | 31) == (band | 31))
+			mask &= ~0u >> (31 - (last & 31));
+		__atomic_fetch_or(&dirty[band / 32], mask, __ATOMIC_RELEASE);
+	}
+}
+
+int SDL_N3DSTransferDirtyBands(u32 *dirty, int bands, const void *buffer, void *texture, int w, int h, int bpp, u32 flags) {
+	u32 d[SDL_N3DS_MAX_BANDS / 32];
+	int i, band = 0, first, y, lines, count = 0;
+	const u8 *src;
+	u8 *dst;
+
+	for (i = 0; i < SDL_N3DS_MAX_BANDS / 32; ++i) {
+		d[i] = __atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQUIRE);
+		count |= d[i];
+	}
+	if (!count) return 0;
+
+#define BAND_DIRTY(b) (d[(b) / 32] & (1u << ((b) & 31)))
+	while (band < bands) {
+		if (!BAND_DIRTY(band)) {
+			++band;
+			continue;
+		}
+		for (first = band; band < bands && BAND_DIRTY(band); ++band);
+		y = first * SDL_N3DS_BAND_HEIGHT;
+		lines = (band - first) * SDL_N3DS_BAND_HEIGHT;
+		src = (const u8*)buffer + y * w * bpp;
+		dst = (u8*)texture + (h - y - lines) * w * bpp;
+		GSPGPU_FlushDataCache(src, lines * w * bpp);
+		C3D_SyncDisplayTransfer ((u32*)src, GX_BUFFER_DIM(w, lines), (u32*)dst, GX_BUFFER_DIM(w, lines), flags);
+		GSPGPU_FlushDataCache(dst, lines * w * bpp);
+	}
+#undef BAND_DIRTY
+	return 1;
+}
+
+static int isDirty() {
+	int i;
+	for (i = 0; i < SDL_N3DS_MAX_BANDS / 32; ++i)
+		if (__atomic_load_n(&dirtyBands[i], __ATOMIC_RELAXED)) return 1;
+	return 0;
+}
+
+// With dirty tracking on, flips only transfer the parts of the video buffer
+// that were reported by SDL_AddDirtyRect (or SDL_UpdateRects) and are
+// skipped completely when nothing changed and no redraw was requested
+void SDL_SetDirtyTracking(int on) {
+	dirtyTracking = on;
+	SDL_N3DSSetDirtyBands(dirtyBands, bufferBands, 0, bufferBands * SDL_N3DS_BAND_HEIGHT);
+}
+
+void SDL_AddDirtyRect(int x, int y, int w, int h) {
+	if (w > 0) SDL_N3DSSetDirtyBands(dirtyBands, bufferBands, y, h);
+}
+
+// present the next frame even if the video buffer did not change (e.g. overlays changed)
+void SDL_RequestRedraw() {
+	redrawRequested = true;
+}
+
+// counters since the start, take the difference of two calls for rates
+void SDL_GetPresentStats(Uint32 *frames, Uint64 *usecs) {
+	*frames = presentFrames;
+	*usecs = presentTicks * 1000 / (SYSCLOCK_ARM11 / 1000);
+}
+
+// Set the cursor sprite from w x h RGBA8 pixels (NULL removes it). The
+// hotspot is in image pixels, zoom scales the image relative to the video
+// buffer. Images larger than 64x64 are cut off.
+void SDL_SetCursorImage(const Uint32 *pixels, int w, int h, int hot_x, int hot_y, float zoom) {
+	int y;
+
+	LightLock_Lock(&cursorLock);
+	if (!pixels) {
+		cursorW = cursorH = 0;
+	} else if (cursorPixels || (cursorPixels = linearAlloc(CURSOR_SIZE * CURSOR_SIZE * 4))) {
+		cursorW = w < CURSOR_SIZE ? w : CURSOR_SIZE;
+		cursorH = h < CURSOR_SIZE ? h : CURSOR_SIZE;
+		SDL_memset(cursorPixels, 0, CURSOR_SIZE * CURSOR_SIZE * 4);
+		for (y = 0; y < cursorH; ++y)
+			SDL_memcpy(cursorPixels + y * CURSOR_SIZE, pixels + y * w, cursorW * 4);
+		cursorHotX = hot_x;
+		cursorHotY = hot_y;
+		cursorZoom = zoom;
+		cursorChanged = true;
+	}
+	LightLock_Unlock(&cursorLock);
+	redrawRequested = true;
+}
+
+// move the cursor sprite's hotspot to x, y of the video buffer
+void SDL_SetCursorPosition(int x, int y) {
+	if (x == cursorX && y == cursorY) return;
+	cursorX = x;
+	cursorY = y;
+	if (cursorVisible) redrawRequested = true;
+}
+
+void SDL_ShowCursorSprite(int on) {
+	if (cursorVisible == (on != 0)) return;
+	cursorVisible = on != 0;
+	redrawRequested = true;
+}
+
+static void uploadCursor(void) {
+	LightLock_Lock(&cursorLock);
+	if (!cursor_tex.data) {
+		C3D_TexInit(&cursor_tex, CURSOR_SIZE, CURSOR_SIZE, GPU_RGBA8);
+		C3D_TexSetFilter(&cursor_tex, GPU_NEAREST, GPU_NEAREST);
+	}
+	GSPGPU_FlushDataCache(cursorPixels, CURSOR_SIZE * CURSOR_SIZE * 4);
+	C3D_SyncDisplayTransfer ((u32*)cursorPixels, GX_BUFFER_DIM(CURSOR_SIZE, CURSOR_SIZE), (u32*)cursor_tex.data, GX_BUFFER_DIM(CURSOR_SIZE, CURSOR_SIZE), TEXTURE_TRANSFER_FLAGS0);
+	GSPGPU_FlushDataCache(cursor_tex.data, CURSOR_SIZE * CURSOR_SIZE * 4);
+	cursorChanged = false;
+	LightLock_Unlock(&cursorLock);
+}
+
+// returns 1 if the next flip will present a frame
+int SDL_VideoDirty() {
+	return !dirtyTracking || redrawRequested || isDirty();
 }
 
 static void videoThread(void* data)
@@ -540,6 +703,20 @@ static void videoThread(void* data)
 						this->hidden->r1,
 						this->hidden->t1,
 						this->hidden->b1);
+					if (cursorVisible && cursorW && cursor_tex.data) {
+						float sx = this->hidden->scalex * cursorZoom;
+						float sy = this->hidden->scaley * cursorZoom;
+						C3D_TexBind(0, &cursor_tex);
+						drawTexture(
+							(pos_x == INT_MAX ? (400-this->hidden->w1*this->hidden->scalex)/2 : pos_x) + cursorX*this->hidden->scalex - cursorHotX*sx,
+							(pos_y == INT_MAX ? (240-this->hidden->h1*this->hidden->scaley)/2 : pos_y) + cursorY*this->hidden->scaley - cursorHotY*sy,
+							cursorW*sx,
+							cursorH*sy,
+							0.0f,
+							(float)cursorW / CURSOR_SIZE,
+							0.0f,
+							(float)cursorH / CURSOR_SIZE);
+					}
 				}
 				if (this->hidden->screens & SDL_BOTTOMSCR) {
 					C3D_FVUnifMtx4x4(GPU_VERTEX_SHADER, uLoc_projection, &projection2);
@@ -564,9 +741,22 @@ static void drawBuffers(_THIS)
 
 		if(!gspHasGpuRight()) return; // Blocking video output if the application is closing
 
-		GSPGPU_FlushDataCache(this->hidden->buffer, this->hidden->w*this->hidden->h*this->hidden->byteperpixel);
-		C3D_SyncDisplayTransfer ((u32*)this->hidden->buffer, GX_BUFFER_DIM(this->hidden->w, this->hidden->h), (u32*)spritesheet_tex.data, GX_BUFFER_DIM(this->hidden->w, this->hidden->h), textureTranferFlags[this->hidden->mode]);
-		GSPGPU_FlushDataCache(spritesheet_tex.data, this->hidden->w*this->hidden->h*this->hidden->byteperpixel);
+		u64 start = svcGetSystemTick();
+		// take the request before looking at what changed, so that one made
+		// by another thread while we transfer is kept for the next frame
+		bool redraw = __atomic_exchange_n(&redrawRequested, false, __ATOMIC_ACQ_REL);
+		if (cursorChanged) uploadCursor();
+		if (dirtyTracking) {
+			if (!SDL_N3DSTransferDirtyBands(dirtyBands, bufferBands, this->hidden->buffer, spritesheet_tex.data,
+				this->hidden->w, this->hidden->h, this->hidden->byteperpixel, textureTranferFlags[this->hidden->mode]) &&
+				!redraw) return; // nothing changed, nothing to present
+		} else {
+			GSPGPU_FlushDataCache(this->hidden->buffer, this->hidden->w*this->hidden->h*this->hidden->byteperpixel);
+			C3D_SyncDisplayTransfer ((u32*)this->hidden->buffer, GX_BUFFER_DIM(this->hidden->w, this->hidden->h), (u32*)spritesheet_tex.data, GX_BUFFER_DIM(this->hidden->w, this->hidden->h), textureTranferFlags[this->hidden->mode]);
+			GSPGPU_FlushDataCache(spritesheet_tex.data, this->hidden->w*this->hidden->h*this->hidden->byteperpixel);
+		}
+		presentTicks += svcGetSystemTick() - start;
+		++presentFrames;
 
 		gspWaitForVBlank();
 		LightEvent_Signal(&privateVideoThreadEvent);
@@ -577,6 +767,12 @@ static void N3DS_UpdateRects(_THIS, int numrects, SDL_Rect *rects)
 {
 	if(!gspHasGpuRight()) return; //Block video output on quitting
 
+	if (dirtyTracking) {
+		int i;
+		for (i = 0; i < numrects; i++)
+			SDL_N3DSSetDirtyBands(dirtyBands, bufferBands, rects[i].y, rects[i].h);
+	}
+
 	if( this->hidden->bpp == 8) {
 /*
 		// update only changed rects
@@ -685,6 +881,12 @@ void N3DS_VideoQuit(_THIS)
 		free(this->hidden->palettedbuffer);
 		this->hidden->palettedbuffer = NULL;
 	}
+	if (cursor_tex.data)
+		C3D_TexDelete(&cursor_tex);
+	if (cursorPixels) {
+		linearFree(cursorPixels);
+		cursorPixels = NULL;
+	}
 	this->hidden->currentVideoSurface->pixels = NULL; // set to buffer or to palettedbuffer, so now pointing to not allocated memory
 
 	sceneExit();
@@ -0,0 +1,284 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * blit_bench.c - check the SDL blitters added for the UI formats against
+ * the generic ones and measure both on the build machine
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+// the blitters are static, so they are compiled right in here
+#include "SDL_blit_1.c"
+#include "SDL_blit_A.c"
+#include "SDL_blit_N.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "hostbench.h"
+
+// asked for while picking a blitter; the 3DS has none of these
+SDL_bool SDL_HasMMX(void) { return SDL_FALSE; }
+SDL_bool SDL_Has3DNow(void) { return SDL_FALSE; }
+SDL_bool SDL_HasAltiVec(void) { return SDL_FALSE; }
+
+#define RGBA8888 0xFF000000, 0x00FF0000, 0x0000FF00, 0x000000FF
+#define ABGR8888 0x000000FF, 0x0000FF00, 0x00FF0000, 0xFF000000
+#define RGBX8888 0xFF000000, 0x00FF0000, 0x0000FF00, 0
+#define XBGR8888 0x000000FF, 0x0000FF00, 0x00FF0000, 0
+
+// the top screen
+#define BENCH_W 400
+#define BENCH_H 240
+#define BENCH_REPS 200
+
+// widths up to this many pixels, plus row padding and source misalignment
+#define MAXW 67
+#define MAXH 9
+#define PITCH_PAD 3
+
+enum blit_kind { BLIT_COPY, BLIT_KEY, BLIT_ALPHA };
+
+struct blit_case {
+	const char *name;
+	int sbpp;
+	Uint32 s[4];			// source masks, red green blue alpha
+	Uint32 d[4];			// destination masks
+	enum blit_kind kind;
+	SDL_loblit fast;		// the blitter SDL has to pick
+	SDL_loblit ref;			// the generic one it replaces
+	int tolerance;			// per channel
+};
+
+static void set_format(SDL_PixelFormat *f, int bpp, const Uint32 *m) {
+	Uint8 *shift[4] = {&f->Rshift, &f->Gshift, &f->Bshift, &f->Ashift};
+	Uint8 *loss[4] = {&f->Rloss, &f->Gloss, &f->Bloss, &f->Aloss};
+	int c;
+
+	SDL_memset(f, 0, sizeof(*f));
+	f->BitsPerPixel = bpp;
+	f->BytesPerPixel = bpp / 8;
+	f->alpha = SDL_ALPHA_OPAQUE;
+	f->colorkey = 3;
+	if (bpp == 8) return;
+	f->Rmask = m[0]; f->Gmask = m[1]; f->Bmask = m[2]; f->Amask = m[3];
+	for (c = 0; c < 4; ++c) {
+		*shift[c] = m[c] ? __builtin_ctz(m[c]) : 0;
+		*loss[c] = 8 - __builtin_popcount(m[c]);
+	}
+}
+
+// the per-pixel loops Blit1to4 and Blit1to4Key ran before
+static void Ref1to4(SDL_BlitInfo *info) {
+	Uint8 *src = info->s_pixels;
+	Uint32 *dst = (Uint32 *)info->d_pixels;
+	Uint32 *map = (Uint32 *)info->table;
+	int x, y;
+
+	for (y = 0; y < info->d_height; ++y) {
+		for (x = 0; x < info->d_width; ++x)
+			*dst++ = map[*src++];
+		src += info->s_skip;
+		dst += info->d_skip / 4;
+	}
+}
+
+static void Ref1to4Key(SDL_BlitInfo *info) {
+	Uint8 *src = info->s_pixels;
+	Uint32 *dst = (Uint32 *)info->d_pixels;
+	Uint32 *map = (Uint32 *)info->table;
+	int x, y;
+
+	for (y = 0; y < info->d_height; ++y) {
+		for (x = 0; x < info->d_width; ++x, ++src, ++dst)
+			if (*src != info->src->colorkey)
+				*dst = map[*src];
+		src += info->s_skip;
+		dst += info->d_skip / 4;
+	}
+}
+
+static const struct blit_case cases[] = {
+	{"ABGR->RGBA copy",   32, {ABGR8888}, {RGBA8888}, BLIT_COPY, Blit4to4Swap, BlitNtoNCopyAlpha, 0},
+	{"RGBA->ABGR copy",   32, {RGBA8888}, {ABGR8888}, BLIT_COPY, Blit4to4Swap, BlitNtoNCopyAlpha, 0},
+	{"XBGR->RGBA copy",   32, {XBGR8888}, {RGBA8888}, BLIT_COPY, Blit4to4Swap, BlitNtoN, 0},
+	{"ABGR->RGBX copy",   32, {ABGR8888}, {RGBX8888}, BLIT_COPY, Blit4to4Swap, BlitNtoN, 0},
+	{"ABGR->RGBA alpha",  32, {ABGR8888}, {RGBA8888}, BLIT_ALPHA, BlitABGRtoRGBAPixelAlpha, BlitNtoNPixelAlpha, 1},
+	{"8->RGBA copy",       8, {0},        {RGBA8888}, BLIT_COPY, Blit1to4, Ref1to4, 0},
+	{"8->RGBA colorkey",   8, {0},        {RGBA8888}, BLIT_KEY, Blit1to4Key, Ref1to4Key, 0},
+};
+#define NCASES (sizeof(cases) / sizeof(cases[0]))
+
+// what SDL_CalculateBlit would choose for the case
+static SDL_loblit pick_blitter(const struct blit_case *c, SDL_PixelFormat *sf, SDL_PixelFormat *df) {
+	SDL_Surface src, dst;
+	SDL_BlitMap map;
+	struct private_swaccel sw;
+	int index = c->kind == BLIT_ALPHA ? 2 : c->kind == BLIT_KEY ? 1 : 0;
+
+	SDL_memset(&src, 0, sizeof(src));
+	SDL_memset(&dst, 0, sizeof(dst));
+	SDL_memset(&map, 0, sizeof(map));
+	src.format = sf;
+	src.map = &map;
+	src.flags = c->kind == BLIT_ALPHA ? SDL_SRCALPHA : c->kind == BLIT_KEY ? SDL_SRCCOLORKEY : 0;
+	dst.format = df;
+	map.dst = &dst;
+	map.sw_data = &sw;
+	return c->sbpp == 8 ? SDL_CalculateBlit1(&src, index) : SDL_CalculateBlitN(&src, index);
+}
+
+static void fill_source(Uint8 *buf, int len, const struct blit_case *c) {
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (c->sbpp == 8) {
+			// glyph-like: mostly key and one colour, some noise
+			int r = rand() % 8;
+			buf[i] = r == 0 ? rand() : r < 4 ? 3 : 7;
+		} else if (i % 4 == 3 && c->kind == BLIT_ALPHA) {
+			// the alpha byte of ABGR: transparent, opaque and in between
+			int r = rand() % 4;
+			buf[i] = r == 0 ? 0 : r == 1 ? 255 : rand();
+		} else {
+			buf[i] = rand();
+		}
+	}
+}
+
+static void setup_info(SDL_BlitInfo *info, SDL_PixelFormat *sf, SDL_PixelFormat *df, Uint32 *map,
+		Uint8 *src, int spitch, Uint8 *dst, int dpitch, int w, int h) {
+	SDL_memset(info, 0, sizeof(*info));
+	info->s_pixels = src;
+	info->s_width = w;
+	info->s_height = h;
+	info->s_skip = spitch - w * sf->BytesPerPixel;
+	info->d_pixels = dst;
+	info->d_width = w;
+	info->d_height = h;
+	info->d_skip = dpitch - w * df->BytesPerPixel;
+	info->src = sf;
+	info->dst = df;
+	info->table = (Uint8 *)map;
+}
+
+// the destination pixels may differ by the tolerance in each channel, the
+// bits outside the masks only when the format has no alpha
+static int compare(const struct blit_case *c, const SDL_PixelFormat *df, Uint32 got, Uint32 want) {
+	Uint32 used = df->Rmask | df->Gmask | df->Bmask | df->Amask;
+	int i;
+
+	if (((got ^ want) & used) == 0)
+		return 0;
+	for (i = 0; i < 32; i += 8) {
+		int d = (int)(got >> i & 0xff) - (int)(want >> i & 0xff);
+		if (!(used >> i & 0xff)) continue;
+		if (d > c->tolerance || d < -c->tolerance)
+			return 1;
+	}
+	return 0;
+}
+
+static int check_case(const struct blit_case *c, SDL_PixelFormat *sf, SDL_PixelFormat *df, Uint32 *map) {
+	static Uint8 src[(MAXW + PITCH_PAD) * MAXH * 4 + 4];
+	static Uint32 dst[(MAXW + PITCH_PAD) * MAXH], ref[(MAXW + PITCH_PAD) * MAXH];
+	SDL_BlitInfo info;
+	int iter, x, y, errors = 0;
+
+	for (iter = 0; iter < 5000 && errors < 5; ++iter) {
+		int w = 1 + rand() % MAXW, h = 1 + rand() % MAXH;
+		int spitch = (w + rand() % (PITCH_PAD + 1)) * sf->BytesPerPixel;
+		int dpitch = (w + rand() % (PITCH_PAD + 1)) * 4;
+		// 8 bit sources start anywhere in a word, like glyphs in a row
+		int off = c->sbpp == 8 ? rand() % 4 : 0;
+
+		fill_source(src, sizeof(src), c);
+		for (x = 0; x < (int)(sizeof(dst) / 4); ++x)
+			dst[x] = ref[x] = rand() * 2654435761u;
+
+		setup_info(&info, sf, df, map, src + off, spitch, (Uint8 *)ref, dpitch, w, h);
+		c->ref(&info);
+		setup_info(&info, sf, df, map, src + off, spitch, (Uint8 *)dst, dpitch, w, h);
+		c->fast(&info);
+
+		for (y = 0; y < h; ++y)
+			for (x = 0; x < dpitch / 4; ++x) {
+				int i = y * dpitch / 4 + x;
+				// the padding has to stay as it was
+				int bad = x < w ? compare(c, df, dst[i], ref[i]) : dst[i] != ref[i];
+				if (bad && errors++ < 5)
+					printf("%s: %dx%d, pixel %d,%d is %08x, expected %08x\n",
+						c->name, w, h, x, y, dst[i], ref[i]);
+			}
+	}
+	return errors != 0;
+}
+
+static double bench_blit(SDL_loblit blit, SDL_PixelFormat *sf, SDL_PixelFormat *df, Uint32 *map,
+		Uint8 *src, Uint32 *dst) {
+	SDL_BlitInfo info;
+	double t;
+	int rep;
+
+	t = hostbench_now();
+	for (rep = 0; rep < BENCH_REPS; ++rep) {
+		setup_info(&info, sf, df, map, src, BENCH_W * sf->BytesPerPixel, (Uint8 *)dst, BENCH_W * 4, BENCH_W, BENCH_H);
+		blit(&info);
+	}
+	t = hostbench_now() - t;
+	return (double)BENCH_W * BENCH_H * BENCH_REPS / t / 1e6;
+}
+
+int main(int argc, char **argv) {
+	int bench = argc > 1 && !strcmp(argv[1], "-b");
+	Uint32 map[256];
+	unsigned int i;
+	int failed = 0;
+
+	srand(1);
+	for (i = 0; i < 256; ++i)
+		map[i] = rand() * 2654435761u;
+
+	for (i = 0; i < NCASES; ++i) {
+		const struct blit_case *c = &cases[i];
+		SDL_PixelFormat sf, df;
+		int bad;
+
+		set_format(&sf, c->sbpp, c->s);
+		set_format(&df, 32, c->d);
+		if (pick_blitter(c, &sf, &df) != c->fast) {
+			printf("%-18s not picked\n", c->name);
+			failed = 1;
+			continue;
+		}
+		bad = check_case(c, &sf, &df, map);
+		printf("%-18s %s\n", c->name, bad ? "FAILED" : "ok");
+		failed |= bad;
+	}
+	if (failed) {
+		printf("blitters: FAILED\n");
+		return 1;
+	}
+	printf("blitters: all match the generic ones\n");
+
+	if (bench) {
+		Uint8 *src = malloc(BENCH_W * BENCH_H * 4);
+		Uint32 *dst = malloc(BENCH_W * BENCH_H * 4);
+
+		for (i = 0; i < NCASES; ++i) {
+			const struct blit_case *c = &cases[i];
+			SDL_PixelFormat sf, df;
+			double fast, ref;
+
+			set_format(&sf, c->sbpp, c->s);
+			set_format(&df, 32, c->d);
+			fill_source(src, BENCH_W * BENCH_H * sf.BytesPerPixel, c);
+			fast = bench_blit(c->fast, &sf, &df, map, src, dst);
+			ref = bench_blit(c->ref, &sf, &df, map, src, dst);
+			printf("%-18s %8.1f Mpixel/s  (generic %8.1f Mpixel/s, %.2fx)\n",
+				c->name, fast, ref, fast / ref);
+		}
+		free(src);
+		free(dst);
+	}
+	return 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * hostbench.h - helpers for the tests and benchmarks built on the host
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _HOSTBENCH_H
+#define _HOSTBENCH_H
+
+#include <time.h>
+
+// seconds from a monotonic clock
+static inline double hostbench_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+#endif // _HOSTBENCH_H
@@ -0,0 +1,35 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * 3ds.h - the libctru types and calls used by code built for the host;
+ * the tests that need the calls define them
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _HOST_3DS_H
+#define _HOST_3DS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+typedef u32 Handle;
+typedef s32 Result;
+#define R_FAILED(res)		((Result)(res) < 0)
+#define R_SUCCEEDED(res)	((Result)(res) >= 0)
+
+extern Result svcWaitSynchronization(Handle handle, s64 nanoseconds);
+extern Result svcWaitSynchronizationN(s32 *out, const Handle *handles, s32 handles_num, bool wait_all, s64 nanoseconds);
+extern void svcSleepThread(s64 ns);
+extern u64 osGetTime(void);
+
+#endif // _HOST_3DS_H
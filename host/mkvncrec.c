@@ -0,0 +1,430 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * mkvncrec.c - write a synthetic vncrec session, to replay without a
+ * capture from a real server
+ *
+ * The session uses the pixel format TinyVNC asks for (32bpp, red shift 24,
+ * green 16, blue 8, little endian) and sends every frame as Raw, Hextile,
+ * ZRLE, Tight and Ultra bands plus a CopyRect. The framebuffer the client
+ * must end up with can be written as well, for replay_bench -c.
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+#include <rfb/rfbproto.h>
+#include "minilzo.h"
+
+#define WIDTH 400
+#define HEIGHT 240
+#define BANDS 4
+#define TIGHT_MIN_TO_COMPRESS 12
+
+struct buf {
+	uint8_t *p;
+	size_t n, size;
+};
+
+static uint32_t fb[WIDTH * HEIGHT];
+static z_stream zrle_stream, tight_stream[4];
+
+static void put(struct buf *b, const void *data, size_t n) {
+	if (b->n + n > b->size) {
+		b->size = (b->n + n) * 2;
+		if (!(b->p = realloc(b->p, b->size))) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	memcpy(b->p + b->n, data, n);
+	b->n += n;
+}
+
+static void put8(struct buf *b, int v) {
+	uint8_t c = v;
+	put(b, &c, 1);
+}
+
+static void put16(struct buf *b, int v) {
+	put8(b, v >> 8);
+	put8(b, v);
+}
+
+static void put32(struct buf *b, uint32_t v) {
+	put16(b, v >> 16);
+	put16(b, v);
+}
+
+// a pixel as the client stores it: little endian, alpha byte 0
+static void put_pixel(struct buf *b, uint32_t p) {
+	put(b, &p, 4);
+}
+
+// ZRLE CPIXEL: the three bytes of the pixel holding the colour
+static void put_cpixel(struct buf *b, uint32_t p) {
+	put8(b, p >> 8);
+	put8(b, p >> 16);
+	put8(b, p >> 24);
+}
+
+// Tight TPIXEL: red, green, blue
+static void put_tpixel(struct buf *b, uint32_t p) {
+	put8(b, p >> 24);
+	put8(b, p >> 16);
+	put8(b, p >> 8);
+}
+
+static uint32_t rgb(int r, int g, int b) {
+	return (uint32_t)(r & 0xff) << 24 | (g & 0xff) << 16 | (b & 0xff) << 8;
+}
+
+static uint32_t hash(uint32_t v) {
+	v ^= v >> 16;
+	v *= 0x7feb352d;
+	v ^= v >> 15;
+	v *= 0x846ca68b;
+	return v ^ v >> 16;
+}
+
+// something like a desktop: solid areas, a window with text, a photo and
+// a gradient, moving a little from frame to frame
+static uint32_t content(int frame, int x, int y) {
+	static const uint32_t desk[] = {0x3a6ea500, 0x2d5a8800, 0x4477aa00};
+	int wx = 40 + frame % 60, wy = 30 + frame % 20;
+
+	if (x >= wx && x < wx + 220 && y >= wy && y < wy + 120) {
+		if (y < wy + 14)
+			return rgb(0x20, 0x40, 0x90);
+		// black text on white, in lines
+		if ((y - wy) % 12 < 9 && hash((x - wx) / 2 + (y - wy) * 131 + frame / 8) % 3 == 0)
+			return rgb(0, 0, 0);
+		return rgb(0xff, 0xff, 0xff);
+	}
+	if (x >= 300 && y >= 150)
+		return hash(x * 977 + y * 31 + frame) & 0xffffff00;
+	if (y >= 200)
+		return rgb(x * 255 / WIDTH, y, frame * 8);
+	return desk[(y / 40 + x / 100) % 3];
+}
+
+static int palette_of(int x, int y, int w, int h, uint32_t *pal, int max) {
+	int i, j, k, n = 0;
+
+	for (j = 0; j < h; ++j)
+		for (i = 0; i < w; ++i) {
+			uint32_t p = fb[(y + j) * WIDTH + x + i];
+			for (k = 0; k < n && pal[k] != p; ++k)
+				;
+			if (k == n) {
+				if (n == max)
+					return max + 1;
+				pal[n++] = p;
+			}
+		}
+	return n;
+}
+
+static int index_of(const uint32_t *pal, uint32_t p) {
+	int k = 0;
+	while (pal[k] != p)
+		++k;
+	return k;
+}
+
+static void deflate_to(z_stream *zs, struct buf *out, const struct buf *in) {
+	uint8_t chunk[16384];
+
+	zs->next_in = in->p;
+	zs->avail_in = in->n;
+	do {
+		zs->next_out = chunk;
+		zs->avail_out = sizeof(chunk);
+		deflate(zs, Z_SYNC_FLUSH);
+		put(out, chunk, sizeof(chunk) - zs->avail_out);
+	} while (zs->avail_out == 0);
+}
+
+static void rect_header(struct buf *b, int x, int y, int w, int h, int encoding) {
+	put16(b, x);
+	put16(b, y);
+	put16(b, w);
+	put16(b, h);
+	put32(b, encoding);
+}
+
+static void encode_raw(struct buf *b, int x, int y, int w, int h) {
+	int j;
+
+	rect_header(b, x, y, w, h, rfbEncodingRaw);
+	for (j = 0; j < h; ++j)
+		put(b, &fb[(y + j) * WIDTH + x], w * 4);
+}
+
+static void encode_hextile(struct buf *b, int x, int y, int w, int h) {
+	int tx, ty, j;
+	uint32_t pal[1];
+
+	rect_header(b, x, y, w, h, rfbEncodingHextile);
+	for (ty = y; ty < y + h; ty += 16)
+		for (tx = x; tx < x + w; tx += 16) {
+			int tw = x + w - tx < 16 ? x + w - tx : 16;
+			int th = y + h - ty < 16 ? y + h - ty : 16;
+			if (palette_of(tx, ty, tw, th, pal, 1) == 1) {
+				put8(b, rfbHextileBackgroundSpecified);
+				put_pixel(b, pal[0]);
+			} else {
+				put8(b, rfbHextileRaw);
+				for (j = 0; j < th; ++j)
+					put(b, &fb[(ty + j) * WIDTH + tx], tw * 4);
+			}
+		}
+}
+
+static void encode_zrle(struct buf *b, int x, int y, int w, int h) {
+	struct buf tiles = {0}, z = {0};
+	uint32_t pal[16];
+	int tx, ty, i, j, n;
+
+	for (ty = y; ty < y + h; ty += 64)
+		for (tx = x; tx < x + w; tx += 64) {
+			int tw = x + w - tx < 64 ? x + w - tx : 64;
+			int th = y + h - ty < 64 ? y + h - ty : 64;
+			n = palette_of(tx, ty, tw, th, pal, 16);
+			if (n == 1) {
+				put8(&tiles, 1);
+				put_cpixel(&tiles, pal[0]);
+			} else if (n <= 16) {
+				int bits = n == 2 ? 1 : n <= 4 ? 2 : 4;
+				put8(&tiles, n);
+				for (i = 0; i < n; ++i)
+					put_cpixel(&tiles, pal[i]);
+				for (j = 0; j < th; ++j) {
+					int byte = 0, used = 0;
+					for (i = 0; i < tw; ++i) {
+						byte = byte << bits | index_of(pal, fb[(ty + j) * WIDTH + tx + i]);
+						if ((used += bits) == 8) {
+							put8(&tiles, byte);
+							byte = used = 0;
+						}
+					}
+					if (used)
+						put8(&tiles, byte << (8 - used));
+				}
+			} else {
+				put8(&tiles, 0);
+				for (j = 0; j < th; ++j)
+					for (i = 0; i < tw; ++i)
+						put_cpixel(&tiles, fb[(ty + j) * WIDTH + tx + i]);
+			}
+		}
+
+	deflate_to(&zrle_stream, &z, &tiles);
+	rect_header(b, x, y, w, h, rfbEncodingZRLE);
+	put32(b, z.n);
+	put(b, z.p, z.n);
+	free(tiles.p);
+	free(z.p);
+}
+
+static void put_compact_len(struct buf *b, int len) {
+	put8(b, (len & 0x7F) | (len > 0x7F ? 0x80 : 0));
+	if (len > 0x7F) {
+		put8(b, ((len >> 7) & 0x7F) | (len > 0x3FFF ? 0x80 : 0));
+		if (len > 0x3FFF)
+			put8(b, len >> 14);
+	}
+}
+
+static void tight_data(struct buf *b, int stream, const struct buf *data) {
+	struct buf z = {0};
+
+	if (data->n < TIGHT_MIN_TO_COMPRESS) {
+		put(b, data->p, data->n);
+		return;
+	}
+	deflate_to(&tight_stream[stream], &z, data);
+	put_compact_len(b, z.n);
+	put(b, z.p, z.n);
+	free(z.p);
+}
+
+static void encode_tight(struct buf *b, int x, int y, int w, int h) {
+	struct buf data = {0};
+	uint32_t pal[16];
+	int i, j, n = palette_of(x, y, w, h, pal, 16);
+
+	rect_header(b, x, y, w, h, rfbEncodingTight);
+	if (n == 1) {
+		put8(b, rfbTightFill << 4);
+		put_tpixel(b, pal[0]);
+		return;
+	}
+	if (n <= 16) {
+		// palette filter on stream 1, two colours as a bitmap
+		put8(b, (1 | rfbTightExplicitFilter) << 4);
+		put8(b, rfbTightFilterPalette);
+		put8(b, n - 1);
+		for (i = 0; i < n; ++i)
+			put_tpixel(b, pal[i]);
+		for (j = 0; j < h; ++j) {
+			int byte = 0, used = 0;
+			for (i = 0; i < w; ++i) {
+				int k = index_of(pal, fb[(y + j) * WIDTH + x + i]);
+				if (n > 2) {
+					put8(&data, k);
+					continue;
+				}
+				byte = byte << 1 | k;
+				if (++used == 8) {
+					put8(&data, byte);
+					byte = used = 0;
+				}
+			}
+			if (used)
+				put8(&data, byte << (8 - used));
+		}
+		tight_data(b, 1, &data);
+	} else {
+		// basic compression on stream 0 without a filter
+		put8(b, 0);
+		for (j = 0; j < h; ++j)
+			for (i = 0; i < w; ++i)
+				put_tpixel(&data, fb[(y + j) * WIDTH + x + i]);
+		tight_data(b, 0, &data);
+	}
+	free(data.p);
+}
+
+static void encode_ultra(struct buf *b, int x, int y, int w, int h) {
+	static lzo_align_t wrkmem[(LZO1X_1_MEM_COMPRESS + sizeof(lzo_align_t) - 1) / sizeof(lzo_align_t)];
+	struct buf raw = {0};
+	lzo_uint len;
+	uint8_t *out;
+	int j;
+
+	for (j = 0; j < h; ++j)
+		put(&raw, &fb[(y + j) * WIDTH + x], w * 4);
+	out = malloc(raw.n + raw.n / 16 + 64 + 3);
+	lzo1x_1_compress(raw.p, raw.n, out, &len, wrkmem);
+	rect_header(b, x, y, w, h, rfbEncodingUltra);
+	put32(b, len);
+	put(b, out, len);
+	free(out);
+	free(raw.p);
+}
+
+static void copy_rect(struct buf *b, int sx, int sy, int w, int h, int dx, int dy) {
+	static uint32_t tmp[WIDTH * HEIGHT];
+	int j;
+
+	for (j = 0; j < h; ++j)
+		memcpy(&tmp[j * w], &fb[(sy + j) * WIDTH + sx], w * 4);
+	for (j = 0; j < h; ++j)
+		memcpy(&fb[(dy + j) * WIDTH + dx], &tmp[j * w], w * 4);
+	rect_header(b, dx, dy, w, h, rfbEncodingCopyRect);
+	put16(b, sx);
+	put16(b, sy);
+}
+
+static void (* const encoders[])(struct buf *b, int x, int y, int w, int h) = {
+	encode_raw, encode_hextile, encode_zrle, encode_tight, encode_ultra
+};
+#define NENCODERS (sizeof(encoders) / sizeof(encoders[0]))
+
+static void write_frame(struct buf *b, int frame) {
+	struct buf rects = {0};
+	int band, x, y, n = 0, bh = HEIGHT / BANDS;
+
+	for (y = 0; y < HEIGHT; ++y)
+		for (x = 0; x < WIDTH; ++x)
+			fb[y * WIDTH + x] = content(frame, x, y);
+
+	for (band = 0; band < BANDS; ++band) {
+		int e = (frame + band) % NENCODERS;
+		if (encoders[e] == encode_tight) {
+			// in four rects, to get fills and palettes too
+			for (x = 0; x < WIDTH; x += WIDTH / 4, ++n)
+				encode_tight(&rects, x, band * bh, WIDTH / 4, bh);
+		} else {
+			encoders[e](&rects, 0, band * bh, WIDTH, bh);
+			++n;
+		}
+	}
+	copy_rect(&rects, frame % 64, 100, 64, 48, 200 - frame % 64, 120);
+	++n;
+
+	// the timestamp, 30 frames per second
+	put32(b, frame / 30);
+	put32(b, frame % 30 * 33333);
+	put8(b, rfbFramebufferUpdate);
+	put8(b, 0);
+	put16(b, n);
+	put(b, rects.p, rects.n);
+	free(rects.p);
+}
+
+int main(int argc, char **argv) {
+	struct buf b = {0};
+	const char *fbfile = NULL;
+	int frames = 100, frame, i, c;
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "n:f:")) != -1) {
+		switch (c) {
+		case 'n': frames = atoi(optarg); break;
+		case 'f': fbfile = optarg; break;
+		default: argc = 0; break;
+		}
+	}
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: mkvncrec [-n frames] [-f final framebuffer] out.vncrec\n");
+		return 2;
+	}
+
+	deflateInit(&zrle_stream, 6);
+	for (i = 0; i < 4; ++i)
+		deflateInit(&tight_stream[i], 6);
+	lzo_init();
+
+	// handshake: no authentication, then ServerInit in the client's format
+	put(&b, "vncLog0.0", 9);
+	put(&b, "RFB 003.008\n", 12);
+	put8(&b, 1);
+	put8(&b, rfbNoAuth);
+	put32(&b, rfbVncAuthOK);
+	put16(&b, WIDTH);
+	put16(&b, HEIGHT);
+	put8(&b, 32);
+	put8(&b, 24);
+	put8(&b, 0);
+	put8(&b, 1);
+	put16(&b, 255);
+	put16(&b, 255);
+	put16(&b, 255);
+	put8(&b, 24);
+	put8(&b, 16);
+	put8(&b, 8);
+	put8(&b, 0);
+	put16(&b, 0);
+	put32(&b, 8);
+	put(&b, "mkvncrec", 8);
+
+	for (frame = 0; frame < frames; ++frame)
+		write_frame(&b, frame);
+
+	if (!(f = fopen(argv[optind], "wb")) || fwrite(b.p, 1, b.n, f) != b.n || fclose(f)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	if (fbfile && (!(f = fopen(fbfile, "wb")) || fwrite(fb, 4, WIDTH * HEIGHT, f) != WIDTH * HEIGHT || fclose(f))) {
+		perror(fbfile);
+		return 1;
+	}
+	free(b.p);
+	return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * pixconv_test.c - check pixconv against libvncclient's conversion and
+ * measure its throughput on the build machine
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/pixconv.h>
+#include "hostbench.h"
+
+// how libvncclient converted RGB24 before pixconv, for any format
+#define RGB24_TO_PIXEL(f,r,g,b) \
+	((uint32_t)(((r) & 0xFF) * (f)->rmax + 127) / 255 << (f)->rshift | \
+	 (uint32_t)(((g) & 0xFF) * (f)->gmax + 127) / 255 << (f)->gshift | \
+	 (uint32_t)(((b) & 0xFF) * (f)->bmax + 127) / 255 << (f)->bshift)
+
+struct format {
+	const char *name;
+	int bpp, rmax, gmax, bmax, rshift, gshift, bshift;
+	enum pixconv_order order;	// what pixconv_init() has to pick
+};
+
+static const struct format formats[] = {
+	{"xbgr",     32, 255, 255, 255, 24, 16,  8, PIXCONV_XBGR},
+	{"bgrx",     32, 255, 255, 255, 16,  8,  0, PIXCONV_BGRX},
+	{"rgbx",     32, 255, 255, 255,  0,  8, 16, PIXCONV_RGBX},
+	{"xrgb",     32, 255, 255, 255,  8, 16, 24, PIXCONV_XRGB},
+	{"rgb30",    32, 1023, 1023, 1023, 20, 10, 0, PIXCONV_OTHER},
+	{"bgr32-6",  32,  63,  63,  63,  0,  6, 12, PIXCONV_OTHER},
+	{"rgb565",   16,  31,  63,  31, 11,  5,  0, PIXCONV_OTHER},
+	{"bgr555",   16,  31,  31,  31,  0,  5, 10, PIXCONV_OTHER},
+	{"bgr233",    8,   7,   7,   3,  0,  3,  6, PIXCONV_OTHER},
+};
+#define NFORMATS (sizeof(formats) / sizeof(formats[0]))
+
+#define MAXPIX 131
+#define BENCH_PIXELS (1024 * 1024)
+
+static uint32_t get_pixel(const void *buf, int bpp, int i) {
+	switch (bpp) {
+	case 32: return ((const uint32_t *)buf)[i];
+	case 16: return ((const uint16_t *)buf)[i];
+	default: return ((const uint8_t *)buf)[i];
+	}
+}
+
+// every length up to MAXPIX at every source alignment, and every channel
+// value through the single pixel call
+static int check_format(const struct format *f) {
+	static uint8_t src[3 * MAXPIX + 4];
+	uint32_t dst[MAXPIX + 1];
+	struct pixconv pc;
+	int off, n, i, v, errors = 0;
+
+	pixconv_init(&pc, f->bpp, f->rmax, f->gmax, f->bmax, f->rshift, f->gshift, f->bshift);
+	if (pc.order != f->order) {
+		printf("%s: order %d, expected %d\n", f->name, pc.order, f->order);
+		return 1;
+	}
+
+	for (i = 0; i < (int)sizeof(src); ++i)
+		src[i] = rand();
+	for (off = 0; off < 4; ++off) {
+		for (n = 0; n <= MAXPIX; ++n) {
+			memset(dst, 0xA5, sizeof(dst));
+			pixconv_rgb24(&pc, dst, src + off, n);
+			for (i = 0; i < n; ++i) {
+				const uint8_t *s = src + off + 3 * i;
+				uint32_t want = RGB24_TO_PIXEL(f, s[0], s[1], s[2]);
+				uint32_t got = get_pixel(dst, f->bpp, i);
+				if (got != want && errors++ < 5)
+					printf("%s: offset %d, %d pixels, pixel %d is %08x, expected %08x\n",
+						f->name, off, n, i, got, want);
+			}
+			// nothing written past the end
+			if (((uint8_t *)dst)[n * f->bpp / 8] != 0xA5 && errors++ < 5)
+				printf("%s: %d pixels, wrote past the end\n", f->name, n);
+		}
+	}
+
+	for (v = 0; v < 256; ++v) {
+		uint8_t r = v, g = v * 7, b = 255 - v;
+		if (pixconv_rgb24_pixel(&pc, r, g, b) != RGB24_TO_PIXEL(f, r, g, b) && errors++ < 5)
+			printf("%s: single pixel %02x%02x%02x is %08x, expected %08x\n", f->name, r, g, b,
+				pixconv_rgb24_pixel(&pc, r, g, b), RGB24_TO_PIXEL(f, r, g, b));
+	}
+
+	return errors != 0;
+}
+
+static int check_bswap32(void) {
+	uint32_t a[MAXPIX], b[MAXPIX];
+	int n, i, errors = 0;
+
+	for (n = 0; n <= MAXPIX; ++n) {
+		for (i = 0; i < n; ++i)
+			a[i] = rand() * 2654435761u;
+		pixconv_bswap32(b, a, n);
+		for (i = 0; i < n; ++i)
+			if (b[i] != __builtin_bswap32(a[i]) && errors++ < 5)
+				printf("bswap32: %d pixels, pixel %d is %08x\n", n, i, b[i]);
+		// in place
+		pixconv_bswap32(b, b, n);
+		for (i = 0; i < n; ++i)
+			if (b[i] != a[i] && errors++ < 5)
+				printf("bswap32 in place: %d pixels, pixel %d is %08x\n", n, i, b[i]);
+	}
+	return errors != 0;
+}
+
+static void bench_format(const struct format *f, const uint8_t *src, uint32_t *dst) {
+	struct pixconv pc;
+	double t, tref;
+	int i, rep;
+
+	pixconv_init(&pc, f->bpp, f->rmax, f->gmax, f->bmax, f->rshift, f->gshift, f->bshift);
+
+	t = hostbench_now();
+	for (rep = 0; rep < 10; ++rep)
+		pixconv_rgb24(&pc, dst, src, BENCH_PIXELS);
+	t = (hostbench_now() - t) / 10;
+
+	tref = hostbench_now();
+	for (rep = 0; rep < 10; ++rep)
+		for (i = 0; i < BENCH_PIXELS; ++i) {
+			const uint8_t *s = src + 3 * i;
+			uint32_t p = RGB24_TO_PIXEL(f, s[0], s[1], s[2]);
+			if (f->bpp == 32) dst[i] = p;
+			else if (f->bpp == 16) ((uint16_t *)dst)[i] = p;
+			else ((uint8_t *)dst)[i] = p;
+		}
+	tref = (hostbench_now() - tref) / 10;
+
+	printf("%-8s %8.1f Mpixel/s  (macro %8.1f Mpixel/s)\n", f->name,
+		BENCH_PIXELS / t / 1e6, BENCH_PIXELS / tref / 1e6);
+}
+
+int main(int argc, char **argv) {
+	int bench = argc > 1 && !strcmp(argv[1], "-b");
+	unsigned int i;
+	int failed = 0;
+
+	srand(1);
+	for (i = 0; i < NFORMATS; ++i) {
+		int bad = check_format(&formats[i]);
+		printf("%-8s %s\n", formats[i].name, bad ? "FAILED" : "ok");
+		failed |= bad;
+	}
+	failed |= check_bswap32();
+	if (failed) {
+		printf("pixconv: FAILED\n");
+		return 1;
+	}
+	printf("pixconv: all conversions match\n");
+
+	if (bench) {
+		uint8_t *src = malloc(3 * BENCH_PIXELS);
+		uint32_t *dst = malloc(4 * BENCH_PIXELS);
+		double t;
+		int rep;
+
+		for (i = 0; i < 3 * BENCH_PIXELS; ++i)
+			src[i] = rand();
+		for (i = 0; i < NFORMATS; ++i)
+			bench_format(&formats[i], src, dst);
+
+		t = hostbench_now();
+		for (rep = 0; rep < 10; ++rep)
+			pixconv_bswap32(dst, dst, BENCH_PIXELS);
+		t = (hostbench_now() - t) / 10;
+		printf("%-8s %8.1f Mpixel/s\n", "bswap32", BENCH_PIXELS / t / 1e6);
+		free(src);
+		free(dst);
+	}
+	return 0;
+}
@@ -0,0 +1,168 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * reactor_test.c - check the main loop's reactor against a simulated kernel
+ *
+ * The svc calls below keep a fake clock instead of sleeping, so the test
+ * sees how long the reactor would have blocked and how often it woke up.
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <3ds.h>
+#include "reactor.h"
+
+#define TIMEOUT_RESULT ((Result)0x09401BFE)
+#define NHANDLES 4
+#define MS 1000000LL
+
+static s64 clock_ns;
+static bool signalled[NHANDLES + 1];	// by handle, handles are 1 to NHANDLES
+static s64 signal_at[NHANDLES + 1];		// signal the handle at this time, 0 if never
+static int timed_waits;
+
+static void advance(s64 ns) {
+	int h;
+
+	clock_ns += ns;
+	for (h = 1; h <= NHANDLES; ++h)
+		if (signal_at[h] && clock_ns >= signal_at[h]) {
+			signalled[h] = true;
+			signal_at[h] = 0;
+		}
+}
+
+// time until the next scheduled signal, or ns if there is none before it
+static s64 until_signal(s64 ns) {
+	int h;
+
+	for (h = 1; h <= NHANDLES; ++h)
+		if (signal_at[h] && signal_at[h] - clock_ns < ns)
+			ns = signal_at[h] - clock_ns;
+	return ns;
+}
+
+// events are RESET_ONESHOT, a successful wait consumes the signal
+Result svcWaitSynchronizationN(s32 *out, const Handle *handles, s32 handles_num, bool wait_all, s64 nanoseconds) {
+	s32 i;
+
+	if (nanoseconds > 0) {
+		timed_waits++;
+		advance(until_signal(nanoseconds));
+	}
+	for (i = 0; i < handles_num; ++i)
+		if (signalled[handles[i]]) {
+			signalled[handles[i]] = false;
+			*out = i;
+			return 0;
+		}
+	return TIMEOUT_RESULT;
+}
+
+Result svcWaitSynchronization(Handle handle, s64 nanoseconds) {
+	s32 index;
+	return svcWaitSynchronizationN(&index, &handle, 1, false, nanoseconds);
+}
+
+void svcSleepThread(s64 ns) {
+	advance(ns);
+}
+
+u64 osGetTime(void) {
+	return clock_ns / MS;
+}
+
+static void reset(void) {
+	clock_ns = 1000 * MS;
+	memset(signalled, 0, sizeof(signalled));
+	memset(signal_at, 0, sizeof(signal_at));
+	timed_waits = 0;
+}
+
+static int check(const char *name, int ok) {
+	if (!ok) printf("reactor: %s FAILED\n", name);
+	return !ok;
+}
+
+int main(int argc, char **argv) {
+	struct reactor r;
+	int p[2], n, failed = 0;
+	s64 start;
+
+	if (pipe(p)) {
+		perror("pipe");
+		return 1;
+	}
+
+	// nothing signalled, the wait has to time out in one blocking call
+	reset();
+	start = clock_ns;
+	reactor_begin(&r, 20);
+	reactor_add_handle(&r, 1, 2);
+	n = reactor_wait(&r);
+	failed |= check("timed out wait", n == 0 && r.ready == 0 &&
+		clock_ns - start >= 20 * MS && timed_waits <= 2);
+
+	// with a socket as well, the handles are waited for in slices
+	reset();
+	start = clock_ns;
+	reactor_begin(&r, 5);
+	reactor_add_fd(&r, p[0], POLLIN, 0);
+	reactor_add_handle(&r, 1, 2);
+	reactor_add_handle(&r, 2, 3);
+	n = reactor_wait(&r);
+	failed |= check("timed out wait with a socket", n == 0 && r.ready == 0 &&
+		clock_ns - start >= 5 * MS && timed_waits <= 6);
+
+	// only the signalled handle is ready, and all signalled ones are found
+	reset();
+	signalled[2] = signalled[4] = true;
+	reactor_begin(&r, -1);
+	reactor_add_handle(&r, 1, 1);
+	reactor_add_handle(&r, 2, 3);
+	reactor_add_handle(&r, 3, 5);
+	reactor_add_handle(&r, 4, 6);
+	n = reactor_wait(&r);
+	failed |= check("signalled handles", n == 2 && r.ready == ((1 << 3) | (1 << 6)) &&
+		!signalled[2] && !signalled[4]);
+
+	// a handle signalled while waiting without a timeout
+	reset();
+	start = clock_ns;
+	signal_at[3] = clock_ns + 30 * MS;
+	reactor_begin(&r, -1);
+	reactor_add_handle(&r, 1, 1);
+	reactor_add_handle(&r, 3, 4);
+	n = reactor_wait(&r);
+	failed |= check("handle signalled later", n == 1 && r.ready == 1 << 4 &&
+		clock_ns - start == 30 * MS);
+
+	// a readable socket ends the wait, the handles stay unsignalled
+	reset();
+	if (write(p[1], "x", 1) != 1) {
+		perror("write");
+		return 1;
+	}
+	reactor_begin(&r, 100);
+	reactor_add_fd(&r, p[0], POLLIN, 0);
+	reactor_add_handle(&r, 1, 2);
+	n = reactor_wait(&r);
+	failed |= check("readable socket", n == 1 && r.ready == 1 && clock_ns == 1000 * MS);
+
+	// sources with buffered data do not wait
+	reset();
+	reactor_begin(&r, 100);
+	reactor_add_handle(&r, 1, 2);
+	reactor_set_ready(&r, 7);
+	n = reactor_wait(&r);
+	failed |= check("buffered data", n == 1 && r.ready == 1 << 7 && timed_waits == 0);
+
+	close(p[0]);
+	close(p[1]);
+	if (!failed)
+		printf("reactor: ok\n");
+	return failed;
+}
@@ -0,0 +1,189 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * replay_bench.c - replay recorded sessions through libvncclient's decoders
+ * as fast as possible and report how fast they went
+ *
+ * Sessions are recorded on the 3DS with "Record top screen session" or
+ * written by mkvncrec. The framebuffer has the format of the 3DS screen, so
+ * the server data is decoded exactly as on the device.
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <rfb/rfbclient.h>
+#include "hostbench.h"
+
+static const char * const encoding_names[rfbStatsEncodings] = {
+	"Raw", "CopyRect", "RRE", "CoRRE", "Hextile", "Ultra", "TRLE", "Zlib",
+	"Tight", "ZRLE", "other"
+};
+
+// what the SDL surface of the top screen would be
+static rfbBool resize(rfbClient *client) {
+	free(client->frameBuffer);
+	client->frameBuffer = malloc(client->width * client->height * 4);
+	if (!client->frameBuffer)
+		return FALSE;
+	memset(client->frameBuffer, 0, client->width * client->height * 4);
+
+	client->format.bitsPerPixel = 32;
+	client->format.redShift = 24;
+	client->format.greenShift = 16;
+	client->format.blueShift = 8;
+	client->format.redMax = client->format.greenMax = client->format.blueMax = 255;
+	return TRUE;
+}
+
+static char *get_password(rfbClient *client) {
+	return strdup("");
+}
+
+static void quiet_log(const char *format, ...) {
+}
+
+// The playback file is unbuffered, so that every timestamp and every header
+// would be a system call. Read the rest of it into memory instead; the
+// returned buffer is freed after the file.
+static char *load_recording(rfbClient *client) {
+	FILE *f = client->vncRec->file;
+	long start = ftell(f), size;
+	char *data;
+
+	fseek(f, 0, SEEK_END);
+	size = ftell(f) - start;
+	fseek(f, start, SEEK_SET);
+	if (!(data = malloc(size ? size : 1)) || fread(data, 1, size, f) != (size_t)size ||
+		!(client->vncRec->file = fmemopen(data, size ? size : 1, "rb"))) {
+		free(data);
+		return NULL;
+	}
+	fclose(f);
+	client->vncRec->doNotSleep = TRUE;
+	return data;
+}
+
+static int compare_framebuffer(rfbClient *client, const char *name) {
+	size_t size = client->width * client->height * 4;
+	uint8_t *want = malloc(size);
+	FILE *f = fopen(name, "rb");
+	size_t i;
+	int ok;
+
+	ok = f && want && fread(want, 1, size, f) == size && fgetc(f) == EOF;
+	if (f) fclose(f);
+	if (!ok) {
+		printf("%s: not a %dx%d framebuffer\n", name, client->width, client->height);
+		free(want);
+		return 1;
+	}
+	for (i = 0; i < size && client->frameBuffer[i] == want[i]; ++i)
+		;
+	if (i < size)
+		printf("framebuffer differs from %s at %d,%d\n", name,
+			(int)(i / 4 % client->width), (int)(i / 4 / client->width));
+	free(want);
+	return i < size;
+}
+
+static int replay(const char *file, int times, const char *check) {
+	rfbClientStats total;
+	double seconds = 0;
+	unsigned int messages = 0, rects = 0;
+	int i, run, failed = 0;
+
+	memset(&total, 0, sizeof(total));
+	for (run = 0; run < times && !failed; ++run) {
+		rfbClient *client = rfbGetClient(8, 3, 4);
+		char *recording;
+		double t;
+
+		client->serverHost = strdup(file);
+		client->serverPort = -1;
+		client->MallocFrameBuffer = resize;
+		client->GetPassword = get_password;
+		client->canHandleNewFBSize = TRUE;
+		if (!rfbInitClient(client, NULL, NULL)) {
+			printf("%s: could not start the playback\n", file);
+			return 1;
+		}
+		if (!(recording = load_recording(client))) {
+			printf("%s: could not read the recording\n", file);
+			rfbClientCleanup(client);
+			return 1;
+		}
+
+		t = hostbench_now();
+		while (HandleRFBServerMessage(client))
+			messages++;
+		seconds += hostbench_now() - t;
+
+		if (!feof(client->vncRec->file)) {
+			printf("%s: replay failed after %u messages\n", file, messages);
+			failed = 1;
+		} else if (check && run == 0) {
+			failed = compare_framebuffer(client, check);
+		}
+
+		total.bytesReceived += client->stats.bytesReceived;
+		for (i = 0; i < rfbStatsEncodings; ++i) {
+			rfbEncodingStats *e = &total.encoding[i], *s = &client->stats.encoding[i];
+			e->rects += s->rects;
+			e->pixels += s->pixels;
+			e->bytes += s->bytes;
+			e->decodeUsecs += s->decodeUsecs;
+			rects += s->rects;
+		}
+		fclose(client->vncRec->file);
+		free(recording);
+		free(client->frameBuffer);
+		rfbClientCleanup(client);
+	}
+	if (failed)
+		return 1;
+
+	printf("%s: %u messages, %u rects, %.1f MB in %.3f s\n", file, messages, rects,
+		total.bytesReceived / 1e6, seconds);
+	printf("  %.1f MB/s, %.0f rects/s, %.1f updates/s\n", total.bytesReceived / 1e6 / seconds,
+		rects / seconds, messages / seconds);
+	printf("  %-9s %8s %10s %9s %10s %9s %9s\n", "encoding", "rects", "Mpixels", "MB",
+		"decode ms", "us/rect", "Mpixel/s");
+	for (i = 0; i < rfbStatsEncodings; ++i) {
+		rfbEncodingStats *e = &total.encoding[i];
+		if (!e->rects)
+			continue;
+		printf("  %-9s %8u %10.2f %9.2f %10.1f %9.1f %9.1f\n", encoding_names[i], e->rects,
+			e->pixels / 1e6, e->bytes / 1e6, e->decodeUsecs / 1e3,
+			(double)e->decodeUsecs / e->rects,
+			e->decodeUsecs ? (double)e->pixels / e->decodeUsecs : 0);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	const char *check = NULL;
+	int times = 1, verbose = 0, failed = 0, c;
+
+	while ((c = getopt(argc, argv, "n:c:v")) != -1) {
+		switch (c) {
+		case 'n': times = atoi(optarg); break;
+		case 'c': check = optarg; break;
+		case 'v': verbose = 1; break;
+		default: argc = 0; break;
+		}
+	}
+	if (optind >= argc || times < 1) {
+		fprintf(stderr, "usage: replay_bench [-n times] [-c framebuffer] [-v] session.vncrec...\n");
+		return 2;
+	}
+	if (!verbose)
+		rfbClientLog = quiet_log;
+
+	for (; optind < argc; ++optind)
+		failed |= replay(argv[optind], times, check);
+	return failed;
+}
@@ -0,0 +1,145 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * scale_bench.c - check the box filter scaler against the fastscale it
+ * replaced and measure both on the build machine
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <3ds.h>
+#include "scaler.h"
+#include "hostbench.h"
+
+#define MAXFACTOR 20
+#define MAXW 43
+#define MAXH 7
+#define BENCH_W 1920
+#define BENCH_H 1080
+#define BENCH_REPS 20
+
+// fastscale as it was in utilities.c, averaging one channel at a time
+static int fastscale(unsigned char *dst, int dst_pitch, unsigned char *src, int src_width, int src_height, int src_pitch, int factor)
+{
+	if (factor < 2) return -1;
+
+	int temp_r, temp_g, temp_b;
+	int i1, i2, x, y;
+
+	int dst_width = src_width / factor;
+	int dst_height = src_height / factor;
+	if (!dst_height || !dst_width) return -1;
+	int factor_pow2 = factor * factor;
+	int factor_mul4 = factor << 2;
+	int src_skip1 = src_pitch - factor_mul4;
+	int src_skip2 = factor_mul4 - factor * src_pitch;
+	int src_skip3 = src_pitch * factor - dst_width * factor_mul4;
+	int dst_skip = dst_pitch - (dst_width << 2);
+
+	for (i1 = 0; i1 < dst_height; ++i1)
+	{
+		for (i2 = 0; i2 < dst_width; ++i2)
+		{
+			temp_r = temp_g = temp_b = 0;
+			for (y = 0; y < factor; ++y) {
+				for (x = 0; x < factor; ++x) {
+					src++; // alpha
+					temp_r += *(src++);
+					temp_g += *(src++);
+					temp_b += *(src++);
+				}
+				src += src_skip1;
+			}
+			*(dst++) = 255; // alpha
+			*(dst++) = temp_r / factor_pow2;
+			*(dst++) = temp_g / factor_pow2;
+			*(dst++) = temp_b / factor_pow2;
+			src += src_skip2;
+		}
+		dst += dst_skip;
+		src += src_skip3;
+	}
+	return 0;
+}
+
+// scale_box rounds differently for some factors, by at most one
+static int check_factor(int factor) {
+	static u8 src[(MAXW * MAXFACTOR + 3) * 4 * MAXH * MAXFACTOR];
+	static u8 dst[(MAXW + 2) * 4 * MAXH], ref[(MAXW + 2) * 4 * MAXH];
+	int iter, i, errors = 0;
+
+	for (i = 0; i < (int)sizeof(src); ++i)
+		src[i] = rand();
+	for (iter = 0; iter < 200 && errors < 5; ++iter) {
+		int w = 1 + rand() % MAXW, h = 1 + rand() % MAXH;
+		int src_pitch = (w * factor + rand() % 4) * 4;
+		int dst_pitch = (w + rand() % 3) * 4;
+
+		memset(dst, 0xA5, sizeof(dst));
+		memset(ref, 0xA5, sizeof(ref));
+		fastscale(ref, dst_pitch, src, w * factor, h * factor, src_pitch, factor);
+		scale_box(dst, dst_pitch, src, w * factor, h * factor, src_pitch, factor);
+		for (i = 0; i < (int)sizeof(dst); ++i) {
+			int d = dst[i] - ref[i];
+			if ((d > 1 || d < -1) && errors++ < 5)
+				printf("factor %d, %dx%d: byte %d is %02x, expected %02x\n",
+					factor, w, h, i, dst[i], ref[i]);
+		}
+	}
+	return errors != 0;
+}
+
+static double bench(int (*scale)(u8 *, int, u8 *, int, int, int, int), u8 *dst, u8 *src, int factor) {
+	double t = hostbench_now();
+	int rep;
+
+	for (rep = 0; rep < BENCH_REPS; ++rep)
+		scale(dst, BENCH_W / factor * 4, src, BENCH_W, BENCH_H, BENCH_W * 4, factor);
+	t = hostbench_now() - t;
+	// source megapixels
+	return (double)BENCH_W * BENCH_H * BENCH_REPS / t / 1e6;
+}
+
+static int box(u8 *dst, int dst_pitch, u8 *src, int src_width, int src_height, int src_pitch, int factor) {
+	return scale_box(dst, dst_pitch, src, src_width, src_height, src_pitch, factor);
+}
+
+int main(int argc, char **argv) {
+	static const int bench_factors[] = {2, 3, 4, 5, 8};
+	int bench_mode = argc > 1 && !strcmp(argv[1], "-b");
+	int factor, failed = 0;
+	unsigned int i;
+
+	srand(1);
+	for (factor = 2; factor <= MAXFACTOR; ++factor)
+		if (check_factor(factor)) {
+			printf("factor %d FAILED\n", factor);
+			failed = 1;
+		}
+	if (failed) {
+		printf("scaler: FAILED\n");
+		return 1;
+	}
+	printf("scaler: factors 2 to %d within one of fastscale\n", MAXFACTOR);
+
+	if (bench_mode) {
+		u8 *src = malloc(BENCH_W * BENCH_H * 4);
+		u8 *dst = malloc(BENCH_W * BENCH_H * 4);
+
+		for (i = 0; i < BENCH_W * BENCH_H * 4; ++i)
+			src[i] = rand();
+		for (i = 0; i < sizeof(bench_factors) / sizeof(bench_factors[0]); ++i) {
+			double fast, old;
+			factor = bench_factors[i];
+			fast = bench(box, dst, src, factor);
+			old = bench(fastscale, dst, src, factor);
+			printf("factor %d  %8.1f MP/s  (fastscale %8.1f MP/s, %.2fx)\n", factor, fast, old, fast / old);
+		}
+		free(src);
+		free(dst);
+	}
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * adaptive.c - adjust encoding, JPEG quality and compression to the connection
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "adaptive.h"
+
+#define INTERVAL 1000000		// microseconds between decisions
+#define REPEAT_LOWER 2			// intervals with the same verdict before lowering the quality
+#define REPEAT_RAISE 3			// ... and before raising it again
+#define ZRLE_BACKOFF 30			// intervals before ZRLE is tried again after it did not help
+
+enum { V_IDLE, V_HEALTHY, V_NETWORK, V_DECODE };
+
+// from best looking to fastest, the middle entry matches the libvncclient defaults
+static const struct { int quality, compress; } ladder[] = {
+	{9, 1}, {8, 1}, {7, 2}, {6, 2}, {5, 3}, {4, 4}, {3, 6}, {2, 7}, {1, 8}, {0, 9}
+};
+#define LEVELS ((int)(sizeof(ladder) / sizeof(ladder[0])))
+
+// the JPEG qualities TurboVNC uses for the coarse levels 0-9
+static const int fine_quality[10] = {15, 29, 41, 42, 62, 77, 79, 86, 92, 100};
+
+static const char *tight_encodings = "tight zrle ultra copyrect hextile zlib corre rre raw";
+static const char *zrle_encodings = "zrle tight ultra copyrect hextile zlib corre rre raw";
+
+static void snapshot(struct adaptive *a, u64 now) {
+	a->time = now;
+	a->last = a->client->stats;
+	a->updates = a->client->updatesReceived;
+}
+
+void adaptive_init(struct adaptive *a, rfbClient *client, int fps) {
+	memset(a, 0, sizeof(*a));
+	a->client = client;
+	a->fps = fps;
+	a->fineQuality = client->appData.fineQualityLevel;
+	while (a->level < LEVELS - 1 && ladder[a->level].quality > client->appData.qualityLevel)
+		++a->level;
+	snapshot(a, rfbClientMicroTime());
+}
+
+// what held the updates back during the last interval
+static int classify(struct adaptive *a, u64 dt) {
+	rfbClientStats *s = &a->client->stats;
+	u64 decode = 0, read, bytes;
+	unsigned int updates, frame;
+	int i;
+
+	for (i = 0; i < rfbStatsEncodings; ++i)
+		decode += s->encoding[i].decodeUsecs - a->last.encoding[i].decodeUsecs;
+	read = s->readUsecs - a->last.readUsecs;
+	bytes = s->bytesReceived - a->last.bytesReceived;
+	updates = a->client->updatesReceived - a->updates;
+	frame = 1000000 / a->fps;
+
+	if (updates == 0 && bytes < 1024) return V_IDLE;
+	if (updates * 1000000ULL >= (u64)a->fps * dt) return V_HEALTHY;
+	// waiting for the rest of an update, or for the next one while a lot is sent
+	if (read * 100 >= dt * 35 || (read * 100 >= dt * 15 && s->roundTripUsecs > 3 * frame))
+		return V_NETWORK;
+	if (decode * 100 >= dt * 60) return V_DECODE;
+	// the screen just does not change that often
+	if (read + decode < dt / 2) return V_HEALTHY;
+	return read >= decode ? V_NETWORK : V_DECODE;
+}
+
+static void apply(struct adaptive *a) {
+	rfbClient *c = a->client;
+
+	c->appData.encodingsString = a->zrle ? zrle_encodings : tight_encodings;
+	c->appData.qualityLevel = ladder[a->level].quality;
+	c->appData.compressLevel = ladder[a->level].compress;
+	// a fine quality overrides the coarse level on TurboVNC servers
+	if (a->fineQuality > 0) {
+		int q = fine_quality[ladder[a->level].quality];
+		c->appData.fineQualityLevel = q < a->fineQuality ? q : a->fineQuality;
+	}
+	SetEncodings(c);
+	// updates already on the way still use the old settings
+	a->hold = 1;
+}
+
+void adaptive_run(struct adaptive *a) {
+	u64 now = rfbClientMicroTime();
+	u64 dt = now - a->time;
+	int v, changed = 0;
+
+	if (!a->fps || dt < INTERVAL) return;
+	v = classify(a, dt);
+	snapshot(a, now);
+	if (a->noZrle) --a->noZrle;
+	if (a->hold) {
+		--a->hold;
+		return;
+	}
+	a->repeated = v == a->verdict ? a->repeated + 1 : 1;
+	a->verdict = v;
+
+	switch (v) {
+	case V_NETWORK:
+		if (a->repeated < REPEAT_LOWER) break;
+		if (a->zrle) {
+			// ZRLE is lossless, Tight can trade quality for size
+			a->zrle = 0;
+			a->noZrle = ZRLE_BACKOFF;
+			changed = 1;
+		} else if (a->level < LEVELS - 1) {
+			a->level = a->level + 2 < LEVELS ? a->level + 2 : LEVELS - 1;
+			changed = 1;
+		}
+		break;
+	case V_DECODE:
+		if (a->repeated < REPEAT_LOWER) break;
+		if (!a->zrle && !a->noZrle) {
+			// JPEG is the expensive part of Tight, ZRLE needs more bandwidth instead
+			a->zrle = 1;
+			changed = 1;
+		} else if (a->zrle) {
+			a->zrle = 0;
+			a->noZrle = ZRLE_BACKOFF;
+			changed = 1;
+		} else if (a->level < LEVELS - 1) {
+			++a->level;
+			changed = 1;
+		}
+		break;
+	case V_HEALTHY:
+		if (a->repeated < REPEAT_RAISE || a->level == 0) break;
+		--a->level;
+		a->repeated = 0;
+		changed = 1;
+		break;
+	}
+	if (changed) apply(a);
+}
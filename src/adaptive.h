@@ -0,0 +1,36 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * adaptive.h - adjust encoding, JPEG quality and compression to the connection
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _ADAPTIVE_H
+#define _ADAPTIVE_H
+
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+struct adaptive {
+	rfbClient *client;
+	int fps;				// target updates per second, 0 if not adapting
+	int level;				// index into the quality ladder, higher is faster
+	int fineQuality;		// configured TurboVNC JPEG quality, the ladder stays below it
+	int zrle;				// prefer ZRLE over Tight (decoding bound, bandwidth to spare)
+	int noZrle;				// intervals until ZRLE may be tried again
+	int verdict;			// of the last interval, and how often it was repeated
+	int repeated;
+	int hold;				// intervals to wait for the server to follow a change
+	u64 time;				// start of the current interval
+	rfbClientStats last;
+	unsigned int updates;
+};
+
+// start with the client's current settings, fps 0 leaves them alone
+extern void adaptive_init(struct adaptive *a, rfbClient *client, int fps);
+// call from the main loop, looks at the statistics about once a second and
+// sends new encodings to the server when needed
+extern void adaptive_run(struct adaptive *a);
+
+#endif // _ADAPTIVE_H
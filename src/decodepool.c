@@ -0,0 +1,160 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * decodepool.c - decode Tight rectangles on a pool of threads
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include <stdlib.h>
+#include <string.h>
+#include <rfb/rfbclient.h>
+#include "turbojpeg.h"
+#include "decodepool.h"
+
+#define STACKSIZE (64 * 1024)
+#define PREVROW_SIZE (2048 * 3 * sizeof(uint16_t))
+
+static void *decode_pool_tag = &decode_pool_tag;
+
+// The first queued job which may run now. Jobs on a zlib stream have to wait
+// while an earlier one on the same stream is being decoded; as the queue is
+// in order, the first job found for a stream is always its earliest.
+static int next_job(struct decode_pool *p) {
+	int i, s;
+
+	for (i = 0; i < p->queued; ++i) {
+		s = p->queue[i]->stream;
+		if (s < 0 || !(p->busyStreams & BIT(s)))
+			return i;
+	}
+	return -1;
+}
+
+static void decode_worker_main(void *arg) {
+	struct decode_worker *w = (struct decode_worker *)arg;
+	struct decode_pool *p = w->pool;
+	rfbDecodeJob *job;
+	int i;
+
+	LightLock_Lock(&p->lock);
+	while (!p->stop) {
+		if ((i = next_job(p)) < 0) {
+			CondVar_Wait(&p->work, &p->lock);
+			continue;
+		}
+		job = p->queue[i];
+		memmove(&p->queue[i], &p->queue[i + 1], (p->queued - i - 1) * sizeof(job));
+		p->queued--;
+		p->running++;
+		if (job->stream >= 0)
+			p->busyStreams |= BIT(job->stream);
+		LightLock_Unlock(&p->lock);
+
+		rfbClientDecodeJob(p->client, job, &w->scratch);
+
+		LightLock_Lock(&p->lock);
+		p->running--;
+		if (job->stream >= 0) {
+			// the next job on the stream may run now
+			p->busyStreams &= ~BIT(job->stream);
+			CondVar_Broadcast(&p->work);
+		}
+		CondVar_Broadcast(&p->done);
+	}
+	LightLock_Unlock(&p->lock);
+}
+
+static rfbBool queueDecodeJob(rfbClient *client, rfbDecodeJob *job) {
+	struct decode_pool *p = rfbClientGetClientData(client, decode_pool_tag);
+
+	LightLock_Lock(&p->lock);
+	while (p->queued == DECODE_POOL_JOBS)
+		CondVar_Wait(&p->done, &p->lock);
+	p->queue[p->queued++] = job;
+	CondVar_Signal(&p->work);
+	LightLock_Unlock(&p->lock);
+	return TRUE;
+}
+
+static void waitDecodeJobs(rfbClient *client) {
+	struct decode_pool *p = rfbClientGetClientData(client, decode_pool_tag);
+
+	LightLock_Lock(&p->lock);
+	while (p->queued || p->running)
+		CondVar_Wait(&p->done, &p->lock);
+	LightLock_Unlock(&p->lock);
+}
+
+int decode_pool_start(struct decode_pool *p, rfbClient *client, int nthreads) {
+	// the New 3DS has the extra core 2; the system core 1 would need
+	// APT_SetAppCpuTimeLimit(), so the rest share the application core
+	static const int cores_new[DECODE_POOL_THREADS] = {2, 0, 0};
+	static const int cores_old[DECODE_POOL_THREADS] = {0, 0, 0};
+	const int *cores;
+	bool isNew3DS = false;
+	s32 prio = 0x30;
+	int i;
+
+	memset(p, 0, sizeof(*p));
+	if (nthreads <= 0) return -1;
+	if (nthreads > DECODE_POOL_THREADS) nthreads = DECODE_POOL_THREADS;
+	p->client = client;
+	LightLock_Init(&p->lock);
+	CondVar_Init(&p->work);
+	CondVar_Init(&p->done);
+
+	APT_CheckNew3DS(&isNew3DS);
+	cores = isNew3DS ? cores_new : cores_old;
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	for (i = 0; i < nthreads; ++i) {
+		struct decode_worker *w = &p->workers[p->nthreads];
+		w->pool = p;
+		w->scratch.buffer = malloc(RFB_BUFFER_SIZE);
+		w->scratch.prevRow = malloc(PREVROW_SIZE);
+		w->scratch.tjhnd = NULL;
+		if (w->scratch.buffer && w->scratch.prevRow) {
+			// below the main thread, like the VNC thread
+			w->thread = threadCreate(decode_worker_main, w, STACKSIZE, prio < 0x3F ? prio + 1 : prio, cores[i], false);
+			if (!w->thread)
+				w->thread = threadCreate(decode_worker_main, w, STACKSIZE, prio < 0x3F ? prio + 1 : prio, -2, false);
+		}
+		if (!w->thread) {
+			free(w->scratch.buffer);
+			free(w->scratch.prevRow);
+			break;
+		}
+		p->nthreads++;
+	}
+	if (!p->nthreads) return -1;
+
+	rfbClientSetClientData(client, decode_pool_tag, p);
+	client->QueueDecodeJob = queueDecodeJob;
+	client->WaitDecodeJobs = waitDecodeJobs;
+	return 0;
+}
+
+void decode_pool_stop(struct decode_pool *p) {
+	int i;
+
+	if (!p->nthreads) return;
+	p->client->QueueDecodeJob = NULL;
+	p->client->WaitDecodeJobs = NULL;
+
+	LightLock_Lock(&p->lock);
+	p->stop = 1;
+	CondVar_Broadcast(&p->work);
+	LightLock_Unlock(&p->lock);
+
+	for (i = 0; i < p->nthreads; ++i) {
+		struct decode_worker *w = &p->workers[i];
+		threadJoin(w->thread, U64_MAX);
+		threadFree(w->thread);
+		free(w->scratch.buffer);
+		free(w->scratch.prevRow);
+		if (w->scratch.tjhnd)
+			tjDestroy(w->scratch.tjhnd);
+	}
+	p->nthreads = 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * decodepool.h - decode Tight rectangles on a pool of threads
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _DECODEPOOL_H
+#define _DECODEPOOL_H
+
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+#define DECODE_POOL_THREADS 3
+#define DECODE_POOL_JOBS 64
+
+struct decode_pool;
+
+struct decode_worker {
+	struct decode_pool *pool;
+	Thread thread;
+	rfbDecodeScratch scratch;	// buffers of this thread
+};
+
+struct decode_pool {
+	rfbClient *client;
+	int nthreads;
+	struct decode_worker workers[DECODE_POOL_THREADS];
+	volatile int stop;		// set by decode_pool_stop to end the threads
+	LightLock lock;			// guards everything below
+	CondVar work;			// signalled when a job may have become runnable
+	CondVar done;			// signalled when a job has been decoded
+	// jobs not yet started, in the order they were queued
+	rfbDecodeJob *queue[DECODE_POOL_JOBS];
+	int queued;
+	int running;
+	u32 busyStreams;		// bit per zlib stream with a job being decoded
+};
+
+// let up to nthreads threads decode the Tight rectangles of the client,
+// returns -1 if no thread could be started
+extern int decode_pool_start(struct decode_pool *p, rfbClient *client, int nthreads);
+// call after the client has stopped handling server messages
+extern void decode_pool_stop(struct decode_pool *p);
+
+#endif // _DECODEPOOL_H
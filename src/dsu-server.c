@@ -357,7 +357,7 @@ static u32 dsu_server_transform(int a, int dead, int max, u32 thresh)
 }
 
 // all parameters can be NULL except server
-int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp, circlePosition *posStk, touchPosition *touch, accelVector *accel, angularRate *gyro)
+int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp, circlePosition *posStk, touchPosition *touch, accelVector *accel, angularRate *gyro, u64 timestamp)
 {
 	static u64 lastupdate = 0;
 	static int count = 0;
@@ -421,6 +421,7 @@ int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp,
 	++count;
 
 	u64 now = getmicrotime();
+	if (!timestamp) timestamp = now;
 	if (!lastupdate) lastupdate = now;
 	if (now - lastupdate > server->interval) { // done collecting data - now send!
 		lastupdate = now;
@@ -522,7 +523,7 @@ int dsu_server_update(struct dsu_server *server, u32 but, circlePosition *posCp,
 			// Motion data timestamp in microseconds, update only with accelerometer (but not gyro only) changes
 			if (memcmp(oldacc, sbuf+76, 12)) {
 				memcpy(oldacc, sbuf+76, 12);
-				accts = now;
+				accts = timestamp;
 			}
 			*((u64*)(sbuf+68)) = accts;
 		}
@@ -58,4 +58,5 @@ extern int dsu_server_update(	// all parameters can be NULL except server
 	circlePosition *posStk,
 	touchPosition *touch,
 	accelVector *accel,
-	angularRate *gyro);
+	angularRate *gyro,
+	u64 timestamp);	// of the HID read in microseconds, 0 for now
@@ -0,0 +1,96 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * inputthread.c - sample the controls at a fixed rate for vJoy-UDP-feeder and Cemuhook
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "vjoy-udp-feeder-client.h"
+#include "dsu-server.h"
+#include "inputthread.h"
+#include "utilities.h"
+
+#define STACKSIZE (32 * 1024)
+
+// SDL n3ds driver, scans HID for the event pump while the thread runs
+extern void SDL_N3DSExternalInputScan(int on);
+extern void SDL_N3DSScanInput(void);
+
+void input_read(struct input_sample *s, int motion, int slider) {
+	s->kHeld = hidKeysHeld();
+	hidCircleRead(&s->posCp);
+	irrstCstickRead(&s->posStk);
+	hidTouchRead(&s->touch);
+	if (slider) s->slider3d = osGet3DSliderState();
+	if (motion) {
+		hidAccelRead(&s->accel);
+		hidGyroRead(&s->gyro);
+	}
+	s->timestamp = getmicrotime();
+}
+
+static void input_thread_main(void *arg) {
+	struct input_thread *t = (struct input_thread *)arg;
+	int motion = (t->udpclient && t->udp_motion) || t->dsuserver;
+	u64 period = 1000000 / t->rate;
+	u64 next = getmicrotime();
+	struct input_sample s = {0};
+	u64 now;
+
+	while (!t->stop) {
+		SDL_N3DSScanInput();
+		input_read(&s, motion, t->udpclient != NULL);
+
+		if (t->udpclient)
+			vjoy_udp_client_update(t->udpclient, s.kHeld, &s.posCp, &s.posStk, &s.touch,
+				t->udp_motion ? &s.accel : NULL, t->udp_motion ? &s.gyro : NULL, s.slider3d);
+		if (t->dsuserver && !t->dsu_error &&
+			(dsu_server_run(t->dsuserver) ||
+			dsu_server_update(t->dsuserver, s.kHeld, &s.posCp, &s.posStk, &s.touch, &s.accel, &s.gyro, s.timestamp)))
+			t->dsu_error = 1;
+
+		// keep the rate, but don't try to catch up after a long stall
+		next += period;
+		now = getmicrotime();
+		if (next > now)
+			svcSleepThread((next - now) * 1000LL);
+		else if (now - next > period)
+			next = now;
+	}
+}
+
+int input_thread_start(struct input_thread *t, int rate,
+	struct vjoy_udp_client *udpclient, int udp_motion, struct dsu_server *dsuserver)
+{
+	s32 prio = 0x30;
+
+	memset(t, 0, sizeof(*t));
+	if (rate <= 0 || (!udpclient && !dsuserver)) return -1;
+	t->rate = rate;
+	t->udpclient = udpclient;
+	t->udp_motion = udp_motion;
+	t->dsuserver = dsuserver;
+
+	// run above the main thread, so that big VNC updates do not delay sampling
+	SDL_N3DSExternalInputScan(1);
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	t->thread = threadCreate(input_thread_main, t, STACKSIZE, prio > 0x18 ? prio - 1 : prio, -2, false);
+	if (!t->thread) {
+		SDL_N3DSExternalInputScan(0);
+		return -1;
+	}
+	return 0;
+}
+
+void input_thread_stop(struct input_thread *t) {
+	if (!t->thread) return;
+	t->stop = 1;
+	threadJoin(t->thread, U64_MAX);
+	threadFree(t->thread);
+	t->thread = NULL;
+	SDL_N3DSExternalInputScan(0);
+}
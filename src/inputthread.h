@@ -0,0 +1,45 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * inputthread.h - sample the controls at a fixed rate for vJoy-UDP-feeder and Cemuhook
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _INPUTTHREAD_H
+#define _INPUTTHREAD_H
+
+#include <3ds.h>
+
+struct vjoy_udp_client;
+struct dsu_server;
+
+struct input_sample {
+	u64 timestamp;			// of the HID read in microseconds
+	u32 kHeld;
+	circlePosition posCp;
+	circlePosition posStk;
+	touchPosition touch;
+	accelVector accel;
+	angularRate gyro;
+	float slider3d;
+};
+
+struct input_thread {
+	Thread thread;
+	volatile int stop;		// set by the main thread to end the thread
+	int rate;				// samples per second
+	struct vjoy_udp_client *udpclient;	// NULL if not used
+	int udp_motion;
+	struct dsu_server *dsuserver;		// NULL if not used
+	volatile int dsu_error;	// set by the thread if the Cemuhook server failed
+};
+
+// read the controls, call instead of the thread when sampling in the main loop
+extern void input_read(struct input_sample *s, int motion, int slider);
+// once started, the thread does the HID scanning for SDL as well
+extern int input_thread_start(struct input_thread *t, int rate,
+	struct vjoy_udp_client *udpclient, int udp_motion, struct dsu_server *dsuserver);
+extern void input_thread_stop(struct input_thread *t);
+
+#endif // _INPUTTHREAD_H
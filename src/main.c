@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 #include <3ds.h>
 #include <SDL/SDL.h>
 #include <rfb/rfbclient.h>
@@ -17,8 +18,15 @@
 #include "streamclient.h"
 #include "uibottom.h"
 #include "utilities.h"
+#include "scaler.h"
+#include "turbojpeg.h"
 #include "vjoy-udp-feeder-client.h"
 #include "dsu-server.h"
+#include "vncthread.h"
+#include "decodepool.h"
+#include "inputthread.h"
+#include "reactor.h"
+#include "adaptive.h"
 
 #define SOC_ALIGN       0x1000
 #define SOC_BUFFERSIZE  0x100000
@@ -53,6 +61,16 @@ typedef struct {
 	int ctr_dsu_enable;
 	int ctr_dsu_port;
 	int ctr_udp_motion_port;
+	int threaded; // receive and decode VNC messages in separate threads
+	int update_requests; // number of framebuffer update requests kept outstanding
+	int ctr_rate; // controller samples per second for vJoy/Cemuhook, 0: sample in the main loop
+	int record; // write the top screen session to a vncrec file on the SD card
+	int adaptive_fps; // 0: fixed encoding settings, else adapt quality to reach this update rate
+	int jpeg_quality; // 1-100 for TurboVNC compatible servers, 0: coarse quality level only
+	int jpeg_subsampling; // index into jpeg_subsampling_names, 0: server default
+	int server_scaling; // let the server shrink the desktop to the scaled screen size
+	int desktop_size; // ask for a desktop of this many times the screen size, 0: keep the server's
+	int decode_threads; // threads per screen decoding Tight rectangles, 0: decode in order
 } vnc_config;
 
 static vnc_config default_config = {
@@ -81,9 +99,24 @@ static vnc_config default_config = {
 	.ctr_udp_motion = 0,
 	.ctr_dsu_enable = 0,
 	.ctr_dsu_port = 26760,
-	.ctr_udp_motion_port = 1609
+	.ctr_udp_motion_port = 1609,
+	.threaded = 0,
+	.update_requests = 1,
+	.ctr_rate = 250,
+	.record = 0,
+	.adaptive_fps = 0,
+	.jpeg_quality = 0,
+	.jpeg_subsampling = 0,
+	.server_scaling = 0,
+	.desktop_size = 0,
+	.decode_threads = 0
 };
 
+// JPEG chroma subsampling choices and the matching rfbEncodingSubsamp offsets
+static const char *jpeg_subsampling_names[] = {"default", "4:4:4", "4:2:2", "4:2:0", "grayscale"};
+static const int jpeg_subsampling_levels[] = {-1, 0, 2, 1, 3};
+#define JPEG_SUBSAMPLINGS (sizeof(jpeg_subsampling_levels) / sizeof(int))
+
 typedef struct {
 	char name[128];
 	char host[128];
@@ -114,6 +147,7 @@ struct { int sdl; int rfb; } buttonMapping[]={
 
 const char *config_filename = "/3ds/TinyVNC/vnc.cfg";
 const char *keymap_filename = "/3ds/TinyVNC/keymap";
+static char record_filename[128];
 #define BUFSIZE 1024
 static vnc_config conf[NUMCONF] = {0};
 static int cpy = -1;
@@ -123,10 +157,28 @@ static int viewOnly=0, buttonMask=0;
 int x=0,y=0;
 rfbClient* cl;
 rfbClient* cl2;
+static struct vnc_thread cl_thread;
+static struct vnc_thread cl2_thread;
+static struct decode_pool cl_pool;
+static struct decode_pool cl2_pool;
+static struct input_thread input_thr;
+static struct reactor reactor;
+static struct adaptive adapt_top, adapt_bot;
+
+// sources the main loop waits for
+enum {
+	SRC_VNC = 0,
+	SRC_VNC2,
+	SRC_STREAM,
+	SRC_DSU,
+};
+
 static SDL_Surface *bgimg;
 SDL_Surface* sdl=NULL;
 SDL_Surface* sdl_big=NULL; // unscaled
 int scaling_factor_top = 1;
+static struct jpegscale jpeg_top;
+static int jpeg_scaled_top = 0; // the last rect went straight to sdl
 static int sdl_pos_x, sdl_pos_y;
 static vnc_config config;
 static int have_scrollbars=0;
@@ -135,6 +187,19 @@ static int recalc_event_target = 0;
 
 extern void SDL_SetVideoPosition(int x, int y);
 extern void SDL_ResetVideoPosition();
+extern void SDL_SetDirtyTracking(int on);
+extern void SDL_AddDirtyRect(int x, int y, int w, int h);
+extern int SDL_VideoDirty();
+extern void SDL_SetCursorImage(const Uint32 *pixels, int w, int h, int hot_x, int hot_y, float zoom);
+extern void SDL_SetCursorPosition(int x, int y);
+extern void SDL_ShowCursorSprite(int on);
+extern void SDL_GetPresentStats(Uint32 *frames, Uint64 *usecs);
+
+#define STATS_TEXT_SIZE 1024
+
+// VNC threads may log, too
+static LightLock log_lock;
+static volatile int log_pending = 0;
 
 static void vwrite_log(const char *format, va_list arg, int channel)
 {
@@ -146,8 +211,11 @@ static void vwrite_log(const char *format, va_list arg, int channel)
 		if (channel & 2) svcOutputDebugString(buf, i);
 		if (channel & 1) {
 			uib_printf("%s\n",buf);
-			uib_update(UIB_RECALC_MENU);
-			SDL_Flip(sdl);
+			if (threadGetCurrent() == NULL) { // main thread
+				uib_update(UIB_RECALC_MENU);
+				SDL_Flip(sdl);
+			} else
+				log_pending = 1; // picked up by the main loop
 		}
 		free(buf);
 	}
@@ -164,7 +232,9 @@ void log_msg(const char *format, ...)
 {
     va_list argptr;
     va_start(argptr, format);
+	LightLock_Lock(&log_lock);
 	vwrite_log(format, argptr, 3);
+	LightLock_Unlock(&log_lock);
     va_end(argptr);
 }
 
@@ -172,9 +242,11 @@ void log_color(SDL_Color front, SDL_Color back, const char *format, ...)
 {
 	va_list argptr;
     va_start(argptr, format);
+	LightLock_Lock(&log_lock);
 	uib_set_colors(front, back);
 	vwrite_log(format, argptr, 3);
 	uib_reset_colors();
+	LightLock_Unlock(&log_lock);
     va_end(argptr);
 }
 
@@ -182,12 +254,34 @@ void log_err(const char *format, ...)
 {
 	va_list argptr;
     va_start(argptr, format);
+	LightLock_Lock(&log_lock);
 	uib_set_colors(COL_RED, COL_BLACK);
 	vwrite_log(format, argptr, 3);
 	uib_reset_colors();
+	LightLock_Unlock(&log_lock);
     va_end(argptr);
 }
 
+// decode Tight JPEG rects at the scaled size instead of scaling them afterwards
+static rfbBool handleJpegTop(struct _rfbClient *client, const uint8_t *buffer, int length, int x, int y, int w, int h)
+{
+	int f = scaling_factor_top;
+	int xa = x / f;
+	int ya = y / f;
+
+	// the scaled IDCT only lines up with the scaled framebuffer at block boundaries
+	if (x % f || y % f) f = 1;
+	if (jpegscale(&jpeg_top, buffer, length, w, h, f,
+		sdl->pixels + xa * 4 + ya * sdl->pitch, sdl->pitch, sdl->w - xa, sdl->h - ya,
+		sdl_big->pixels + x * 4 + y * sdl_big->pitch, sdl_big->pitch))
+	{
+		rfbClientLog("TurboJPEG error: %s", tjGetErrorStr());
+		return FALSE;
+	}
+	jpeg_scaled_top = (f > 1);
+	return TRUE;
+}
+
 static void handleFrameBufferUpdateTop (struct _rfbClient *client, int x, int y, int w, int h)
 {
 	if (sdl_big) {
@@ -197,7 +291,9 @@ static void handleFrameBufferUpdateTop (struct _rfbClient *client, int x, int y,
 		int ha = (h + scaling_factor_top - 1) / scaling_factor_top;
 		if (xa + wa > sdl->w) wa = sdl->w - xa;
 		if (ya + ha > sdl->h) ha = sdl->h - ya;
-		fastscale(
+		if (jpeg_scaled_top)
+			jpeg_scaled_top = 0;
+		else scale_box(
 			sdl->pixels + xa * 4 + ya * sdl->pitch,
 			sdl->pitch,
 			sdl_big->pixels + xa * scaling_factor_top * 4 + ya * scaling_factor_top * sdl_big->pitch,
@@ -205,58 +301,69 @@ static void handleFrameBufferUpdateTop (struct _rfbClient *client, int x, int y,
 			ha * scaling_factor_top,
 			sdl_big->pitch,
 			scaling_factor_top);
+		SDL_AddDirtyRect(xa, ya, wa, ha);
+	} else {
+		SDL_AddDirtyRect(x, y, w, h);
 	}
 }
 
+// the top screen draws the cursor itself, so moving it needs no server round trip
+static void handleCursorShape(rfbClient* client, int xhot, int yhot, int width, int height, int bytesPerPixel)
+{
+	if (bytesPerPixel != 4 || !client->rcSource || !client->rcMask) return;
+	u32 *pixels = malloc(width * height * 4);
+	if (!pixels) return;
+	for (int i = 0; i < width * height; ++i)
+		pixels[i] = client->rcMask[i] ? ((u32 *)client->rcSource)[i] | 0xff : 0;
+	SDL_SetCursorImage(pixels, width, height, xhot, yhot, 1.0 / scaling_factor_top);
+	free(pixels);
+}
+
+static rfbBool handleCursorPos(rfbClient* client, int x, int y)
+{
+	SDL_SetCursorPosition(x / scaling_factor_top, y / scaling_factor_top);
+	return TRUE;
+}
+
 static rfbBool resize(rfbClient* client) {
 	int width=client->width;
 	int height=client->height;
 	int depth=32;
-	static void *oldGotFrameBufferUpdate=NULL;
 
 	if (sdl_big) {
 		SDL_FreeSurface(sdl_big);
 		sdl_big = NULL;
 	}
-	client->appData.scaleSetting = scaling_factor_top = 1;
-	if (oldGotFrameBufferUpdate)
-		client->GotFrameBufferUpdate = oldGotFrameBufferUpdate;
-	if (width > 1024 || height > 1024) {
-		if (SupportsClient2Server(client, rfbSetScale) || SupportsClient2Server(client, rfbPalmVNCSetScaleFactor)) {
-			// set server side scaling
-			client->appData.scaleSetting = (MAX(width, height) + 1024) / 1024;
-			if (!SendScaleSetting(client, client->appData.scaleSetting))
-			{
-				rfbClientErr("%s: SendScaleSetting failed", __func__);
-				return FALSE;
-			}
-			width = MIN(width, 1024); height = MIN(height, 1024);
-			rfbClientLog("req size >1024px, set server scale 1/%d", client->appData.scaleSetting);
-		} else {
-			// set client side scaling
-			scaling_factor_top = (MAX(width,height) + 1024) / 1024;
-			if ((sdl_big=
-				SDL_CreateRGBSurface(
-					SDL_SWSURFACE,
-					width,
-					height,
-					32,
-					sdl->format->Rmask,
-					sdl->format->Gmask,
-					sdl->format->Bmask,
-					sdl->format->Amask)) == NULL)
-			{
-				rfbClientErr("%s: SDL_CreateRGBSurface %s", __func__, SDL_GetError());
-				return FALSE;
-			}
-			SDL_FillRect(sdl_big,NULL, 0x00000000);
-			if (client->GotFrameBufferUpdate != handleFrameBufferUpdateTop) {
-				oldGotFrameBufferUpdate = client->GotFrameBufferUpdate;
-				client->GotFrameBufferUpdate = handleFrameBufferUpdateTop;
-			}
-			rfbClientLog("req size >1024px, set client scale 1/%d", scaling_factor_top);
+	scaling_factor_top = 1;
+	if (!uibvnc_server_scale(client, 400, 240, config.scaling && config.server_scaling))
+		return FALSE;
+	if (client->appData.scaleSetting > 1) {
+		// until the new size arrives, stay within the texture size
+		width = MIN(width, 1024); height = MIN(height, 1024);
+	} else if (width > 1024 || height > 1024) {
+		// set client side scaling
+		scaling_factor_top = (MAX(width,height) + 1024) / 1024;
+		if ((sdl_big=
+			SDL_CreateRGBSurface(
+				SDL_SWSURFACE,
+				width,
+				height,
+				32,
+				sdl->format->Rmask,
+				sdl->format->Gmask,
+				sdl->format->Bmask,
+				sdl->format->Amask)) == NULL)
+		{
+			rfbClientErr("%s: SDL_CreateRGBSurface %s", __func__, SDL_GetError());
+			return FALSE;
 		}
+		SDL_FillRect(sdl_big,NULL, 0x00000000);
+		rfbClientLog("req size >1024px, set client scale 1/%d", scaling_factor_top);
 	}
+	// libjpeg can only scale by 1/2, 1/4 and 1/8 while decoding
+	jpeg_scaled_top = 0;
+	client->GotJpeg = sdl_big && (scaling_factor_top & (scaling_factor_top - 1)) == 0 && scaling_factor_top <= 8 ?
+		handleJpegTop : NULL;
 	client->updateRect.x = client->updateRect.y = 0;
 	client->updateRect.w = width;
 	client->updateRect.h = height;
@@ -311,16 +418,25 @@ static rfbBool resize(rfbClient* client) {
 
 static void cleanup()
 {
+	input_thread_stop(&input_thr);
+	vnc_thread_stop(&cl_thread);
+	decode_pool_stop(&cl_pool);
 	if(cl)
 		rfbClientCleanup(cl);
 	cl = NULL;
+	vnc_thread_stop(&cl2_thread);
+	decode_pool_stop(&cl2_pool);
 	if (cl2)
 		rfbClientCleanup(cl2);
 	cl2 = NULL;
 	if (sdl_big)
 		SDL_FreeSurface(sdl_big);
 	sdl_big = NULL;
+	jpegscale_free(&jpeg_top);
+	SDL_ShowCursorSprite(0);
+	SDL_SetCursorImage(NULL, 0, 0, 0, 0, 1.0);
 	SDL_ResetVideoPosition();
+	uib_show_stats(NULL);
 
 	uibvnc_cleanup();
 }
@@ -388,6 +504,7 @@ enum commands {
 	COM_TOGGLEKEYBOARD,
 	COM_KEYSTOVNC,
 	COM_TOUCHTOVNC,
+	COM_STATS,
 	COM_MOUSELEFT = 16,
 	COM_MOUSEMID,
 	COM_MOUSERIGHT,
@@ -562,6 +679,95 @@ extern int uibvnc_w, uibvnc_h, uibvnc_x, uibvnc_y;
 #define SCROLL_SIZE 20 // size of the scrolling arean in px
 #define SCROLL_SPEED 200 // max scrolling speed in px/sec
 
+// statistics overlay, updated once a second from the difference of the counters
+static int show_stats = 0;
+static u64 stats_time;
+static struct stats_snapshot {
+	rfbClient *client;
+	rfbClientStats stats;
+	unsigned int updates;
+} stats_top, stats_bot;
+static Uint32 stats_frames;
+static Uint64 stats_present;
+
+static const char *stats_names[rfbStatsEncodings] = {
+	"Raw", "CopyRect", "RRE", "CoRRE", "Hextile", "Ultra", "TRLE", "Zlib", "Tight", "ZRLE", "Other"
+};
+
+static void snapshot_stats(struct stats_snapshot *last, rfbClient *c) {
+	last->client = c;
+	if (!c) return;
+	last->stats = c->stats;
+	last->updates = c->updatesReceived;
+}
+
+static int format_stats(char *buf, int size, const char *name, rfbClient *c, struct stats_snapshot *last, u64 dt) {
+	rfbClientStats *s = &c->stats;
+	rfbEncodingStats *e, *l;
+	int n, i;
+
+	if (last->client != c) {
+		// new connection, start counting now
+		snapshot_stats(last, c);
+		return snprintf(buf, size, "%s: collecting\n", name);
+	}
+	// bytes and pixels per microsecond are MB/s and MP/s
+	n = snprintf(buf, size, "%-6s %5.2f MB/s %3u upd/s rtt %4u ms\n", name,
+		(s->bytesReceived - last->stats.bytesReceived) / (double)dt,
+		(unsigned)((c->updatesReceived - last->updates) * 1000000ULL / dt),
+		s->roundTripUsecs / 1000);
+	for (i = 0; i < rfbStatsEncodings && n < size; ++i) {
+		e = &s->encoding[i];
+		l = &last->stats.encoding[i];
+		if (e->rects == l->rects) continue;
+		n += snprintf(buf + n, size - n, " %-8s %5u r/s %6.2f MP/s %3u%%\n", stats_names[i],
+			(unsigned)((e->rects - l->rects) * 1000000ULL / dt),
+			(e->pixels - l->pixels) / (double)dt,
+			(unsigned)((e->decodeUsecs - l->decodeUsecs) * 100 / dt));
+	}
+	if (n < size)
+		n += snprintf(buf + n, size - n, " %-8s %3u%%\n", "network",
+			(unsigned)((s->readUsecs - last->stats.readUsecs) * 100 / dt));
+	snapshot_stats(last, c);
+	return n < size ? n : size - 1;
+}
+
+static void update_stats() {
+	char buf[STATS_TEXT_SIZE];
+	u64 now = rfbClientMicroTime();
+	u64 dt = now - stats_time;
+	Uint32 frames;
+	Uint64 present;
+	int n = 0;
+
+	if (now < stats_time + 1000000) return;
+	SDL_GetPresentStats(&frames, &present);
+	if (cl) n += format_stats(buf + n, sizeof(buf) - n, "Top", cl, &stats_top, dt);
+	if (cl2) n += format_stats(buf + n, sizeof(buf) - n, "Bottom", cl2, &stats_bot, dt);
+	if (frames != stats_frames)
+		snprintf(buf + n, sizeof(buf) - n, "Present %3u f/s %5.2f ms/f\n",
+			(unsigned)((frames - stats_frames) * 1000000ULL / dt),
+			(present - stats_present) / 1000.0 / (frames - stats_frames));
+	else
+		snprintf(buf + n, sizeof(buf) - n, "Present   0 f/s\n");
+	stats_time = now;
+	stats_frames = frames;
+	stats_present = present;
+	uib_show_stats(buf);
+}
+
+static void toggle_stats() {
+	show_stats = !show_stats;
+	if (show_stats) {
+		stats_time = rfbClientMicroTime();
+		snapshot_stats(&stats_top, cl);
+		snapshot_stats(&stats_bot, cl2);
+		SDL_GetPresentStats(&stats_frames, &stats_present);
+		uib_show_stats("Collecting statistics");
+	} else
+		uib_show_stats(NULL);
+}
+
 // event handler while VNC is running
 static rfbBool handleSDLEvent(SDL_Event *e)
 {
@@ -679,7 +885,10 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 			record_mousebutton_event(e->button.button, e->type == SDL_MOUSEBUTTONDOWN?1:0);
 		}
 		//log_citra("pointer event: x %d, y %d, mask %p",x, y, buttonMask);
-		if (config.ctr_vnc_touch) SendPointerEvent(tcl, x, y, buttonMask);
+		if (config.ctr_vnc_touch) {
+			SendPointerEvent(tcl, x, y, buttonMask);
+			if (tcl == cl) SDL_SetCursorPosition(x / scaling_factor_top, y / scaling_factor_top);
+		}
 		buttonMask &= ~(rfbButton4Mask | rfbButton5Mask); // clear wheel up and wheel down state
 		break;
 	}
@@ -710,6 +919,8 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 						s = COM_KEYSTOVNC; break;
 					case BUT_R:
 						s = COM_TOUCHTOVNC; break;
+					case BUT_START:
+						s = COM_STATS; break;
 					default:
 						break;
 				}
@@ -749,7 +960,12 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 			if (e->type == SDL_KEYDOWN) {
 				config.scaling = !config.scaling;
 				if (cl) {
+					vnc_thread_lock(&cl_thread);
+					// client->width is the surface pitch by now
+					cl->width = cl->updateRect.w;
+					cl->height = cl->updateRect.h;
 					resize(cl);
+					vnc_thread_unlock(&cl_thread);
 					SendFramebufferUpdateRequest(cl, 0, 0, cl->updateRect.w, cl->updateRect.h, FALSE);
 					uib_show_message(3000,"Top screen scaling %s",config.scaling?"on":"off");
 				}
@@ -759,8 +975,12 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 			if (e->type == SDL_KEYDOWN) {
 				config.scaling2 = !config.scaling2;
 				if (cl2) {
-					uibvnc_setScaling(config.scaling2);
+					uibvnc_setScaling(config.scaling2, config.server_scaling);
+					vnc_thread_lock(&cl2_thread);
+					cl2->width = cl2->updateRect.w;
+					cl2->height = cl2->updateRect.h;
 					uibvnc_resize(cl2);
+					vnc_thread_unlock(&cl2_thread);
 					SendFramebufferUpdateRequest(cl2, 0, 0, cl2->updateRect.w, cl2->updateRect.h, FALSE);
 					uib_show_message(3000,"Bottom screen scaling %s",config.scaling2?"on":"off");
 				}
@@ -807,6 +1027,10 @@ static rfbBool handleSDLEvent(SDL_Event *e)
 				uib_show_message(3000,"Mouse to VNC connection %s",config.ctr_vnc_touch?"on":"off");
 			}
 			break;
+		case COM_STATS:
+			if (e->type == SDL_KEYDOWN)
+				toggle_stats();
+			break;
 		default:
 			if (viewOnly) break;
 			if (s>=COM_MOUSELEFT && s<=COM_MOUSEWHEELDOWN) {			// mouse button 1-5: COM_MOUSELEFT-COM_MOUSEWHEELDOWN
@@ -988,6 +1212,16 @@ enum {
 	EDITCONF_CTRUDPMOTIONPORT,
 	EDITCONF_CTRDSUENABLE,
 	EDITCONF_CTRDSUPORT,
+	EDITCONF_THREADED,
+	EDITCONF_UPDATEREQUESTS,
+	EDITCONF_CTRRATE,
+	EDITCONF_RECORD,
+	EDITCONF_ADAPTIVE,
+	EDITCONF_JPEGQUALITY,
+	EDITCONF_JPEGSUBSAMPLING,
+	EDITCONF_SERVERSCALING,
+	EDITCONF_DESKTOPSIZE,
+	EDITCONF_DECODETHREADS,
 	EDITCONF_END
 };
 
@@ -1041,6 +1275,9 @@ static int editconfig(vnc_config *c) {
 			uib_set_colors(COL_BLACK, page==1?COL_WHITE:COL_GRAY);
 			uib_set_position(14,l);
 			uib_printf( " Audio/Ctrl " );
+			uib_set_colors(COL_BLACK, page==2?COL_WHITE:COL_GRAY);
+			uib_set_position(27,l);
+			uib_printf( " Performance" );
 			uib_reset_colors();
 			++l;
 
@@ -1214,6 +1451,77 @@ static int editconfig(vnc_config *c) {
 					if (sel == EDITCONF_CTRDSUPORT) uib_reset_colors();
 				} else l+=2;
 			}
+			else if (page == 2) {
+				uib_set_colors(HEADERCOL, COL_BLACK);
+				uib_set_position(0,++l);
+				uib_printf(	"--------- Performance ------------------" );
+				uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(nc.threaded?"\x91 ":"\x90 ");
+				if (sel == EDITCONF_THREADED) uib_invert_colors();
+				uib_printf(	"Decode VNC updates in threads" );
+				if (sel == EDITCONF_THREADED) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"Pending update requests: ");
+				if (sel == EDITCONF_UPDATEREQUESTS) uib_invert_colors();
+				uib_printf(	"%-15d", nc.update_requests);
+				if (sel == EDITCONF_UPDATEREQUESTS) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"Controller sample rate:  ");
+				if (sel == EDITCONF_CTRRATE) uib_invert_colors();
+				if (nc.ctr_rate)
+					uib_printf(	"%-4d Hz        ", nc.ctr_rate);
+				else
+					uib_printf(	"%-15s", "main loop");
+				if (sel == EDITCONF_CTRRATE) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(nc.record?"\x91 ":"\x90 ");
+				if (sel == EDITCONF_RECORD) uib_invert_colors();
+				uib_printf(	"Record top screen session" );
+				if (sel == EDITCONF_RECORD) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"Adapt quality for:       ");
+				if (sel == EDITCONF_ADAPTIVE) uib_invert_colors();
+				if (nc.adaptive_fps)
+					uib_printf(	"%-2d updates/s   ", nc.adaptive_fps);
+				else
+					uib_printf(	"%-15s", "off");
+				if (sel == EDITCONF_ADAPTIVE) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"JPEG quality:            ");
+				if (sel == EDITCONF_JPEGQUALITY) uib_invert_colors();
+				if (nc.jpeg_quality)
+					uib_printf(	"%-15d", nc.jpeg_quality);
+				else
+					uib_printf(	"%-15s", "default");
+				if (sel == EDITCONF_JPEGQUALITY) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"JPEG subsampling:        ");
+				if (sel == EDITCONF_JPEGSUBSAMPLING) uib_invert_colors();
+				uib_printf(	"%-15s", jpeg_subsampling_names[nc.jpeg_subsampling % JPEG_SUBSAMPLINGS]);
+				if (sel == EDITCONF_JPEGSUBSAMPLING) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(nc.server_scaling?"\x91 ":"\x90 ");
+				if (sel == EDITCONF_SERVERSCALING) uib_invert_colors();
+				uib_printf(	"Server side scaling to screen size" );
+				if (sel == EDITCONF_SERVERSCALING) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"Remote desktop size:     ");
+				if (sel == EDITCONF_DESKTOPSIZE) uib_invert_colors();
+				if (nc.desktop_size)
+					uib_printf(	"%dx screen      ", nc.desktop_size);
+				else
+					uib_printf(	"%-15s", "keep");
+				if (sel == EDITCONF_DESKTOPSIZE) uib_reset_colors();
+				uib_set_position(0,++l);
+				uib_printf(	"Tight decoding threads:  ");
+				if (sel == EDITCONF_DECODETHREADS) uib_invert_colors();
+				if (nc.decode_threads)
+					uib_printf(	"%-15d", nc.decode_threads);
+				else
+					uib_printf(	"%-15s", "off");
+				if (sel == EDITCONF_DECODETHREADS) uib_reset_colors();
+			}
 			if (msg && showmsg) {
 				uib_invert_colors();
 				uib_set_position(40-strlen(msg),28);
@@ -1237,11 +1545,13 @@ static int editconfig(vnc_config *c) {
 				switch ((enum buttons)e.key.keysym.sym) {
 				case BUT_L:
 				case BUT_R:
-					page = (page + 1) % 2;
+					page = (page + ((enum buttons)e.key.keysym.sym == BUT_L ? 2 : 1)) % 3;
 					if (page == 0 && sel != EDITCONF_NAME)
 						sel = EDITCONF_HOST;
 					if (page == 1 && sel != EDITCONF_NAME)
 						sel = EDITCONF_ENABLEAUDIO;
+					if (page == 2 && sel != EDITCONF_NAME)
+						sel = EDITCONF_THREADED;
 					upd = 1; break;
 				case BUT_B:
 					ret=-1; break;
@@ -1276,6 +1586,9 @@ static int editconfig(vnc_config *c) {
 						if (!nc.ctr_udp_enable && sel==EDITCONF_CTRUDPPORT) sel=EDITCONF_CTRDSUENABLE;
 						if (!nc.ctr_dsu_enable && sel==EDITCONF_CTRDSUPORT) sel=0;
 						if (!nc.ctr_udp_motion && sel==EDITCONF_CTRUDPMOTIONPORT) sel=EDITCONF_CTRDSUENABLE;
+						if (sel >= EDITCONF_THREADED) sel=0;
+					} else if (page == 2) {
+						if (sel != 0 && sel < EDITCONF_THREADED) sel=EDITCONF_THREADED;
 					}
 					upd = 1;
 					break;
@@ -1292,10 +1605,13 @@ static int editconfig(vnc_config *c) {
 						if (!nc.eventtarget && sel==EDITCONF_NOTAPHANDLING) sel=EDITCONF_EVENTTARGET;
 					} else if (page == 1) {
 						if (sel < EDITCONF_ENABLEAUDIO) sel = 0;
+						if (sel >= EDITCONF_THREADED) sel = EDITCONF_CTRDSUPORT;
 						if (!nc.enableaudio && sel==EDITCONF_AUDIOPATH) sel=EDITCONF_ENABLEAUDIO;
 						if (!nc.ctr_udp_enable && sel==EDITCONF_CTRUDPMOTIONPORT) sel=EDITCONF_CTRUDPENABLE;
 						if (!nc.ctr_dsu_enable && sel==EDITCONF_CTRDSUPORT) sel=EDITCONF_CTRDSUENABLE;
 						if (!nc.ctr_udp_motion && sel==EDITCONF_CTRUDPMOTIONPORT) sel=EDITCONF_CTRUDPMOTION;
+					} else if (page == 2) {
+						if (sel < EDITCONF_THREADED) sel = 0;
 					}
 					upd = 1;
 					break;
@@ -1484,6 +1800,49 @@ static int editconfig(vnc_config *c) {
 							nc.ctr_dsu_port = po;
 						}
 						break;
+					case EDITCONF_THREADED:
+						nc.threaded = !nc.threaded;
+						break;
+					case EDITCONF_UPDATEREQUESTS:
+						nc.update_requests = nc.update_requests % 4 + 1;
+						break;
+					case EDITCONF_CTRRATE:
+						// main loop, 125, 250, 500 Hz
+						nc.ctr_rate = nc.ctr_rate >= 500 ? 0 : (nc.ctr_rate ? nc.ctr_rate * 2 : 125);
+						break;
+					case EDITCONF_RECORD:
+						nc.record = !nc.record;
+						break;
+					case EDITCONF_ADAPTIVE:
+						// off, 10, 20, 30 updates per second
+						nc.adaptive_fps = nc.adaptive_fps >= 30 ? 0 : nc.adaptive_fps + 10;
+						break;
+					case EDITCONF_JPEGQUALITY:
+						swkbdInit(&swkbd, SWKBD_TYPE_NUMPAD, 2, 3);
+						swkbdSetHintText(&swkbd, "JPEG quality 1-100, 0 for default");
+						sprintf(input, "%d", nc.jpeg_quality);
+						swkbdSetInitialText(&swkbd, input);
+						button = swkbdInputText(&swkbd, input, 4);
+						if(button != SWKBD_BUTTON_LEFT) {
+							int q = atoi(input);
+							if (q < 0) q=0;
+							if (q > 100) q=100;
+							nc.jpeg_quality = q;
+						}
+						break;
+					case EDITCONF_JPEGSUBSAMPLING:
+						nc.jpeg_subsampling = (nc.jpeg_subsampling + 1) % JPEG_SUBSAMPLINGS;
+						break;
+					case EDITCONF_SERVERSCALING:
+						nc.server_scaling = !nc.server_scaling;
+						break;
+					case EDITCONF_DESKTOPSIZE:
+						// keep, 400x240 / 320x240, 800x480 / 640x480
+						nc.desktop_size = (nc.desktop_size + 1) % 3;
+						break;
+					case EDITCONF_DECODETHREADS:
+						nc.decode_threads = (nc.decode_threads + 1) % (DECODE_POOL_THREADS + 1);
+						break;
 					}
 					break;
 				default:
@@ -1541,6 +1900,10 @@ static void readconfig() {
 					strcpy(conf[i].pass, c[i].pass);
 					conf[i].scaling = c[i].scaling;
 				}
+			} else if (sz % NUMCONF == 0 && sz / NUMCONF > sizeof(vnc_config_1_0) && sz / NUMCONF < sizeof(vnc_config)) {
+				// config of an older version, new fields are appended at the end and keep their defaults
+				for(int i=0; i<NUMCONF; ++i)
+					fread((void*)&conf[i], sz / NUMCONF, 1, f);
 			} else {
 				// read current config
 				fread((void*)conf, sizeof(vnc_config), NUMCONF, f);
@@ -1748,12 +2111,7 @@ int main() {
 	char buf[512];
 	struct vjoy_udp_client udpclient;
 	struct dsu_server dsuserver;
-	u32 kHeld;
-	circlePosition posCp, posStk;
-	touchPosition touch;
-	accelVector accel;
-	angularRate gyro;
-	float slider3d = 0.0;
+	struct input_sample in = {0};
 
 	osSetSpeedupEnable(1);
 
@@ -1773,6 +2131,7 @@ int main() {
 	SOC_buffer = (u32*)memalign(SOC_ALIGN, SOC_BUFFERSIZE);
 	socInit(SOC_buffer, SOC_BUFFERSIZE);
 
+	LightLock_Init(&log_lock);
 	rfbClientLog=log_msg;
 	rfbClientErr=log_err;
 
@@ -1812,30 +2171,57 @@ int main() {
 		if (!config.vncoff) {
 			cl=rfbGetClient(8,3,4); // int bitsPerSample, int samplesPerPixel, int bytesPerPixel
 			cl->MallocFrameBuffer = resize;
+			cl->GotFrameBufferUpdate = handleFrameBufferUpdateTop;
+			cl->GotCursorShape = handleCursorShape;
+			cl->HandleCursorPos = handleCursorPos;
+			cl->appData.useRemoteCursor = TRUE;
 			cl->canHandleNewFBSize = TRUE;
+			cl->appData.updateRequests = config.update_requests;
+			cl->appData.fineQualityLevel = config.jpeg_quality ? config.jpeg_quality : -1;
+			cl->appData.subsampLevel = jpeg_subsampling_levels[config.jpeg_subsampling % JPEG_SUBSAMPLINGS];
+			cl->appData.desktopWidth = 400 * config.desktop_size;
+			cl->appData.desktopHeight = 240 * config.desktop_size;
 			cl->GetCredential = get_credential;
 			cl->GetPassword = get_password;
+			if (config.record) {
+				// e.g. /3ds/TinyVNC/20200521-183012.vncrec, replayable with serverPort -1
+				time_t now = time(NULL);
+				strftime(record_filename, sizeof(record_filename),
+					"/3ds/TinyVNC/%Y%m%d-%H%M%S.vncrec", localtime(&now));
+				cl->recordFile = record_filename;
+			}
 			snprintf(buf, sizeof(buf),"%s:%d",config.host, config.port);
 			rfbClientLog("Connecting to %s", buf);
 			if(!rfbInitClient(cl, &argc, argv))
 			{
 				cl = NULL; // rfbInitClient has already freed the client struct
-			} else ++active;
+			} else {
+				adaptive_init(&adapt_top, cl, config.adaptive_fps);
+				++active;
+			}
 		}
 		// bottom screen VNC
 		if (config.enablevnc2) {
 			cl2=rfbGetClient(8,3,4); // int bitsPerSample, int samplesPerPixel, int bytesPerPixel
 			cl2->MallocFrameBuffer = uibvnc_resize;
 			cl2->canHandleNewFBSize = TRUE;
+			cl2->appData.updateRequests = config.update_requests;
+			cl2->appData.fineQualityLevel = config.jpeg_quality ? config.jpeg_quality : -1;
+			cl2->appData.subsampLevel = jpeg_subsampling_levels[config.jpeg_subsampling % JPEG_SUBSAMPLINGS];
+			cl2->appData.desktopWidth = 320 * config.desktop_size;
+			cl2->appData.desktopHeight = 240 * config.desktop_size;
 			cl2->GetCredential = get_credential;
 			cl2->GetPassword = get_password;
-			uibvnc_setScaling(config.scaling2);
+			uibvnc_setScaling(config.scaling2, config.server_scaling);
 			snprintf(buf, sizeof(buf),"%s:%d",config.host, config.port2);
 			rfbClientLog("Connecting2 to %s", buf);
 			if(!rfbInitClient(cl2, &argc, argv))
 			{
 				cl2 = NULL; // rfbInitClient has already freed the client struct
-			} else ++active;
+			} else {
+				adaptive_init(&adapt_bot, cl2, config.adaptive_fps);
+				++active;
+			}
 		}
 
 		if (config.enableaudio) {
@@ -1870,6 +2256,12 @@ int main() {
 			HIDUSER_EnableAccelerometer();
 			HIDUSER_EnableGyroscope();
 		}
+		// sample the controls at a fixed rate, independent of the VNC traffic
+		if ((config.ctr_udp_enable || config.ctr_dsu_enable) && config.ctr_rate &&
+			input_thread_start(&input_thr, config.ctr_rate,
+				config.ctr_udp_enable ? &udpclient : NULL, config.ctr_udp_motion,
+				config.ctr_dsu_enable ? &dsuserver : NULL))
+			rfbClientErr("Controller: could not start thread, sampling in main loop");
 		checkconfig();
 
 		// clear mouse state
@@ -1903,21 +2295,36 @@ int main() {
 				log_color(HEADERCOL, COL_BLACK, "Press HOME to exit");
 		}
 		recalc_event_target=1;
+		// only present the top screen when the VNC framebuffer changed
+		SDL_SetDirtyTracking(cl != NULL);
+		// the pool hooks into the client, so it has to be there before
+		// the VNC thread handles the first message
+		if (config.decode_threads) {
+			if (cl && decode_pool_start(&cl_pool, cl, config.decode_threads))
+				rfbClientErr("VNC: could not start decoding threads");
+			if (cl2 && decode_pool_start(&cl2_pool, cl2, config.decode_threads))
+				rfbClientErr("BottomVNC: could not start decoding threads");
+		}
+		if (config.threaded) {
+			if (cl && vnc_thread_start(&cl_thread, cl))
+				rfbClientErr("VNC: could not start thread, decoding in main loop");
+			if (cl2 && vnc_thread_start(&cl2_thread, cl2))
+				rfbClientErr("BottomVNC: could not start thread, decoding in main loop");
+		}
 
 		while(active) {
 			// set up event handling
 			if (recalc_event_target) {
 				evtarget = (cl2!=NULL && config.eventtarget!=0);
 				taphandling = evtarget ? !config.notaphandling : 1;
-				int i = evtarget;
-				if (cl && cl->appData.useRemoteCursor != i) {
-					cl->appData.useRemoteCursor = i;
-					SetFormatAndEncodings(cl);
-				}
-				i = !(evtarget && taphandling);
+				// the top screen always gets the cursor shape and only shows
+				// it while it receives the pointer events
+				SDL_ShowCursorSprite(!evtarget);
+				int i = !(evtarget && taphandling);
 				if (cl2 && cl2->appData.useRemoteCursor != i) {
 					cl2->appData.useRemoteCursor = i;
-					SetFormatAndEncodings(cl2);
+					// the pixel format is unchanged, leave the decoders alone
+					SetEncodings(cl2);
 				}
 				//if (cl) cl->appData.useRemoteCursor = evtarget;
 				recalc_event_target = 0;
@@ -1926,6 +2333,8 @@ int main() {
 			if (taphandling)
 				// must be called once per frame to expire mouse button presses
 				uib_handle_tap_processing(NULL);
+			// if there is nothing to present, spend the frame waiting for data instead
+			reactor_begin(&reactor, SDL_VideoDirty() ? 0 : 16);
 			SDL_Flip(sdl);
 			checkKeyRepeat();
 			while (SDL_PollEvent(&e)) {
@@ -1942,34 +2351,61 @@ int main() {
 
 			if (ext) break;
 			push_scheduled_event();
-			// vjoy udp feeder && cemuhook server
-			if (config.ctr_udp_enable || config.ctr_dsu_enable) {
-				kHeld = hidKeysHeld();
-				hidCircleRead(&posCp);
-				irrstCstickRead(&posStk);
-				hidTouchRead(&touch);
-				if (config.ctr_udp_enable) slider3d = osGet3DSliderState();
-				if ((config.ctr_udp_enable && config.ctr_udp_motion) || config.ctr_dsu_enable) {
-					hidAccelRead(&accel);
-					hidGyroRead(&gyro);
-				}
+
+			// wait for whatever comes first
+			if (taphandling)
+				reactor_deadline(&reactor, uib_tap_deadline());
+			if (cl) {
+				if (cl_thread.thread)
+					reactor_add_handle(&reactor, cl_thread.event, SRC_VNC);
+				else if (cl->buffered > 0 || cl->serverPort == -1)
+					reactor_set_ready(&reactor, SRC_VNC);
+				else
+					reactor_add_fd(&reactor, cl->sock, POLLIN, SRC_VNC);
 			}
-			if (config.ctr_udp_enable) {
-				if (config.ctr_udp_motion)
-					vjoy_udp_client_update(&udpclient, kHeld, &posCp, &posStk, &touch, &accel, &gyro, slider3d);
+			if (cl2) {
+				if (cl2_thread.thread)
+					reactor_add_handle(&reactor, cl2_thread.event, SRC_VNC2);
+				else if (cl2->buffered > 0 || cl2->serverPort == -1)
+					reactor_set_ready(&reactor, SRC_VNC2);
 				else
-					vjoy_udp_client_update(&udpclient, kHeld, &posCp, &posStk, &touch, NULL, NULL, slider3d);
+					reactor_add_fd(&reactor, cl2->sock, POLLIN, SRC_VNC2);
+			}
+			if (config.enableaudio)
+				stream_poll_fds(&reactor, SRC_STREAM);
+			if (!input_thr.thread && config.ctr_dsu_enable)
+				reactor_add_fd(&reactor, dsuserver.socket, POLLIN, SRC_DSU);
+			if (reactor_wait(&reactor) < 0)
+				rfbClientLog("Waiting for network data failed: %d (%s)\n", errno, strerror(errno));
+
+			// vjoy udp feeder && cemuhook server
+			if (input_thr.thread) {
+				// the thread no longer touches the server once it reported an error
+				if (config.ctr_dsu_enable && input_thr.dsu_error) {
+					dsu_server_shutdown(&dsuserver);
+					config.ctr_dsu_enable = 0;
+					--active;
+				}
+			} else {
+				if (config.ctr_udp_enable || config.ctr_dsu_enable)
+					input_read(&in, (config.ctr_udp_enable && config.ctr_udp_motion) || config.ctr_dsu_enable, config.ctr_udp_enable);
+				if (config.ctr_udp_enable) {
+					if (config.ctr_udp_motion)
+						vjoy_udp_client_update(&udpclient, in.kHeld, &in.posCp, &in.posStk, &in.touch, &in.accel, &in.gyro, in.slider3d);
+					else
+						vjoy_udp_client_update(&udpclient, in.kHeld, &in.posCp, &in.posStk, &in.touch, NULL, NULL, in.slider3d);
+				}
 			}
-			if (config.ctr_dsu_enable &&
+			if (!input_thr.thread && config.ctr_dsu_enable &&
 				(dsu_server_run(&dsuserver) ||
-				dsu_server_update(&dsuserver, kHeld, &posCp, &posStk, &touch, &accel, &gyro)))
+				dsu_server_update(&dsuserver, in.kHeld, &in.posCp, &in.posStk, &in.touch, &in.accel, &in.gyro, in.timestamp)))
 			{
 				dsu_server_shutdown(&dsuserver);
 				config.ctr_dsu_enable = 0;
 				--active;
 			}
 
-			// audio stream
+			// audio stream, also refills the sound buffers when nothing arrived
 			if (config.enableaudio && run_stream()) {
 				stop_stream();
 				config.enableaudio = 0;
@@ -1977,20 +2413,33 @@ int main() {
 			}
 			// vnc integration
 			if (cl) {
-				i=WaitForMessage(cl,10);
-				if(i<0 || (i>0 && !HandleRFBServerMessage(cl))) {
+				i = reactor_is_ready(&reactor, SRC_VNC);
+				if (cl_thread.thread)
+					i=vnc_thread_check(&cl_thread, i);
+				else if (i && !HandleRFBServerMessage(cl))
+					i=-1;
+				if(i<0) {
 					rfbClientErr("VNC: error waiting for or processing messages");				
+					vnc_thread_stop(&cl_thread);
+					decode_pool_stop(&cl_pool);
 					rfbClientCleanup(cl);
 					cl=NULL;
+					SDL_SetDirtyTracking(0);
 					recalc_event_target = 1;
 					--active;
 					checkconfig();
 				}
 			}
 			if (cl2) {
-				i=WaitForMessage(cl2,10);
-				if(i<0 || (i>0 && !HandleRFBServerMessage(cl2))) {
+				i = reactor_is_ready(&reactor, SRC_VNC2);
+				if (cl2_thread.thread)
+					i=vnc_thread_check(&cl2_thread, i);
+				else if (i && !HandleRFBServerMessage(cl2))
+					i=-1;
+				if(i<0) {
 					rfbClientErr("BottomVNC: error waiting for or processing messages");
+					vnc_thread_stop(&cl2_thread);
+					decode_pool_stop(&cl2_pool);
 					rfbClientCleanup(cl2);
 					cl2=NULL;
 					recalc_event_target = 1;
@@ -1998,8 +2447,17 @@ int main() {
 					checkconfig();
 				} else if (i>0) uib_update(UIB_RECALC_VNC);
 			}
+			if (log_pending) {
+				log_pending = 0;
+				uib_update(UIB_RECALC_MENU);
+			}
+			if (show_stats)
+				update_stats();
+			if (cl) adaptive_run(&adapt_top);
+			if (cl2) adaptive_run(&adapt_bot);
 		}
 		// cleanup udp client / dsu server
+		input_thread_stop(&input_thr);
 		if (config.ctr_dsu_enable)
 			dsu_server_shutdown(&dsuserver);
 		if (config.ctr_udp_enable)
@@ -2011,6 +2469,7 @@ int main() {
 		if (config.enableaudio)
 			stop_stream();
 		// clean up VNC clients
+		SDL_SetDirtyTracking(0);
 		cleanup();
 
 		uib_enable_keyboard(0);
@@ -0,0 +1,108 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * reactor.c - wait for all sockets and thread events of the main loop at once
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include <poll.h>
+#include "reactor.h"
+
+// sockets and kernel events can not be waited for in one call, so while
+// both are used the sockets are checked again after each slice
+#define HANDLE_SLICE_MS 1
+
+void reactor_begin(struct reactor *r, int timeout) {
+	r->nfds = 0;
+	r->nhandles = 0;
+	r->timeout = timeout;
+	r->ready = 0;
+}
+
+void reactor_deadline(struct reactor *r, int timeout) {
+	if (timeout < 0) return;
+	if (r->timeout < 0 || timeout < r->timeout)
+		r->timeout = timeout;
+}
+
+int reactor_add_fd(struct reactor *r, int fd, short events, int source) {
+	if (fd < 0 || r->nfds >= REACTOR_MAX_FDS) return -1;
+	r->fds[r->nfds].fd = fd;
+	r->fds[r->nfds].events = events;
+	r->fds[r->nfds].revents = 0;
+	r->fd_source[r->nfds++] = source;
+	return 0;
+}
+
+int reactor_add_handle(struct reactor *r, Handle handle, int source) {
+	if (!handle || r->nhandles >= REACTOR_MAX_HANDLES) return -1;
+	r->handles[r->nhandles] = handle;
+	r->handle_source[r->nhandles++] = source;
+	return 0;
+}
+
+void reactor_set_ready(struct reactor *r, int source) {
+	r->ready |= 1 << source;
+	r->timeout = 0;
+}
+
+static int count(u32 ready) {
+	return __builtin_popcount(ready);
+}
+
+static int pollFds(struct reactor *r, int timeout) {
+	int i, n;
+
+	if (!r->nfds) {
+		if (timeout > 0) svcSleepThread(timeout * 1000000LL);
+		return 0;
+	}
+	n = poll(r->fds, r->nfds, timeout);
+	if (n <= 0) return n;
+	for (i = 0; i < r->nfds; ++i)
+		if (r->fds[i].revents)
+			r->ready |= 1 << r->fd_source[i];
+	return n;
+}
+
+// waiting consumes the signal, so check all of them once one fired
+// Note: a timeout is not an error code, only 0 means signalled
+static int checkHandles(struct reactor *r, s64 ns) {
+	s32 index;
+	int i;
+
+	if (svcWaitSynchronizationN(&index, r->handles, r->nhandles, false, ns))
+		return 0;
+	r->ready |= 1 << r->handle_source[index];
+	for (i = 0; i < r->nhandles; ++i)
+		if (i != index && !svcWaitSynchronization(r->handles[i], 0))
+			r->ready |= 1 << r->handle_source[i];
+	return 1;
+}
+
+int reactor_wait(struct reactor *r) {
+	u64 end;
+	s64 left;
+
+	if (!r->nhandles) {
+		if (pollFds(r, r->ready ? 0 : r->timeout) < 0) return -1;
+		return count(r->ready);
+	}
+
+	end = osGetTime() + (r->timeout < 0 ? 0 : r->timeout);
+	while (1) {
+		if (pollFds(r, 0) < 0) return -1;
+		checkHandles(r, 0);
+		if (r->ready) break;
+		left = r->timeout < 0 ? HANDLE_SLICE_MS : (s64)(end - osGetTime());
+		if (left <= 0) break;
+		if (r->nfds && left > HANDLE_SLICE_MS) left = HANDLE_SLICE_MS;
+		if (checkHandles(r, left * 1000000LL)) {
+			pollFds(r, 0);
+			break;
+		}
+	}
+	return count(r->ready);
+}
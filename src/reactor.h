@@ -0,0 +1,46 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * reactor.h - wait for all sockets and thread events of the main loop at once
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _REACTOR_H
+#define _REACTOR_H
+
+#include <3ds.h>
+#include <poll.h>
+
+#define REACTOR_MAX_FDS		16
+#define REACTOR_MAX_HANDLES	4
+
+// Sources are small numbers chosen by the caller, several fds may share one.
+struct reactor {
+	struct pollfd fds[REACTOR_MAX_FDS];
+	int fd_source[REACTOR_MAX_FDS];
+	int nfds;
+	Handle handles[REACTOR_MAX_HANDLES];
+	int handle_source[REACTOR_MAX_HANDLES];
+	int nhandles;
+	int timeout;			// milliseconds, -1 waits until something is ready
+	u32 ready;				// bit mask of the sources which are ready
+};
+
+// start a new round, waiting at most timeout milliseconds
+extern void reactor_begin(struct reactor *r, int timeout);
+// wake up no later than timeout milliseconds from now
+extern void reactor_deadline(struct reactor *r, int timeout);
+extern int reactor_add_fd(struct reactor *r, int fd, short events, int source);
+// an event which is signalled by another thread (must be RESET_ONESHOT)
+extern int reactor_add_handle(struct reactor *r, Handle handle, int source);
+// for sources with data already buffered, do not wait at all
+extern void reactor_set_ready(struct reactor *r, int source);
+// returns the number of ready sources, 0 on timeout, -1 on error
+extern int reactor_wait(struct reactor *r);
+
+static inline int reactor_is_ready(struct reactor *r, int source) {
+	return (r->ready >> source) & 1;
+}
+
+#endif // _REACTOR_H
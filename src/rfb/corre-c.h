@@ -53,6 +53,23 @@ HandleCoRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 
     ptr = (uint8_t *)client->buffer;
 
+#if BPP==32
+    if (CanFill32(client, rx, ry, rw, rh)) {
+	for (i = 0; i < hdr.nSubrects; i++, ptr += 8) {
+	    memcpy(&pix, ptr, 4);
+	    x = ptr[4];
+	    y = ptr[5];
+	    w = ptr[6];
+	    h = ptr[7];
+	    if (x + w <= rw && y + h <= rh)
+		Fill32(client, rx+x, ry+y, w, h, pix);
+	    else
+		client->GotFillRect(client, rx+x, ry+y, w, h, pix);
+	}
+	return TRUE;
+    }
+#endif
+
     for (i = 0; i < hdr.nSubrects; i++) {
 	pix = *(CARDBPP *)ptr;
 	ptr += BPP/8;
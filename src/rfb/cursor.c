@@ -30,14 +30,6 @@
 
 #define MAX_CURSOR_SIZE 1024
 
-#define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
-   ((((uint##bpp##_t)(r) & 0xFF) * client->format.redMax + 127) / 255             \
-    << client->format.redShift |                                              \
-    (((uint##bpp##_t)(g) & 0xFF) * client->format.greenMax + 127) / 255           \
-    << client->format.greenShift |                                            \
-    (((uint##bpp##_t)(b) & 0xFF) * client->format.blueMax + 127) / 255            \
-    << client->format.blueShift)
-
 
 rfbBool HandleCursorShape(rfbClient* client,int xhot, int yhot, int width, int height, uint32_t enc)
 {
@@ -84,8 +76,8 @@ rfbBool HandleCursorShape(rfbClient* client,int xhot, int yhot, int width, int h
       free(buf);
       return FALSE;
     }
-    colors[0] = RGB24_TO_PIXEL(32, rgb.backRed, rgb.backGreen, rgb.backBlue);
-    colors[1] = RGB24_TO_PIXEL(32, rgb.foreRed, rgb.foreGreen, rgb.foreBlue);
+    colors[0] = pixconv_rgb24_pixel(&client->pixconv, rgb.backRed, rgb.backGreen, rgb.backBlue);
+    colors[1] = pixconv_rgb24_pixel(&client->pixconv, rgb.foreRed, rgb.foreGreen, rgb.foreBlue);
 
     /* Read 1bpp pixel data into a temporary buffer. */
     if (!ReadFromRFBServer(client, buf, bytesMaskData)) {
@@ -29,6 +29,101 @@
 #define HandleHextileBPP CONCAT2E(HandleHextile,BPP)
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 
+#if BPP==32
+/* Each tile is parsed from the receive buffer: peek at the header to learn
+   the tile's size, then peek at the whole tile and consume it at once. */
+static rfbBool
+HandleHextile32Direct (rfbClient* client, int rx, int ry, int rw, int rh)
+{
+  uint32_t bg = 0, fg = 0;
+  const uint8_t *ptr;
+  unsigned int len, hdrLen, subrectLen;
+  int i;
+  int x, y, w, h;
+  int sx, sy, sw, sh;
+  uint8_t subencoding;
+  uint8_t nSubrects;
+
+  for (y = ry; y < ry+rh; y += 16) {
+    for (x = rx; x < rx+rw; x += 16) {
+      w = h = 16;
+      if (rx+rw - x < 16)
+	w = rx+rw - x;
+      if (ry+rh - y < 16)
+	h = ry+rh - y;
+
+      if (!(ptr = (const uint8_t *)PeekFromRFBServer(client, 1)))
+	return FALSE;
+      subencoding = *ptr;
+
+      if (subencoding & rfbHextileRaw) {
+	len = 1 + w * h * 4;
+	if (!(ptr = (const uint8_t *)PeekFromRFBServer(client, len)))
+	  return FALSE;
+	CopyRectangle(client, ptr + 1, x, y, w, h);
+	ConsumeFromRFBServer(client, len);
+	continue;
+      }
+
+      hdrLen = 1;
+      if (subencoding & rfbHextileBackgroundSpecified)
+	hdrLen += 4;
+      if (subencoding & rfbHextileForegroundSpecified)
+	hdrLen += 4;
+      if (subencoding & rfbHextileAnySubrects)
+	hdrLen += 1;
+      if (!(ptr = (const uint8_t *)PeekFromRFBServer(client, hdrLen)))
+	return FALSE;
+      ptr++;
+
+      if (subencoding & rfbHextileBackgroundSpecified) {
+	memcpy(&bg, ptr, 4);
+	ptr += 4;
+      }
+      Fill32(client, x, y, w, h, bg);
+
+      if (subencoding & rfbHextileForegroundSpecified) {
+	memcpy(&fg, ptr, 4);
+	ptr += 4;
+      }
+
+      if (!(subencoding & rfbHextileAnySubrects)) {
+	ConsumeFromRFBServer(client, hdrLen);
+	continue;
+      }
+
+      nSubrects = *ptr;
+      subrectLen = (subencoding & rfbHextileSubrectsColoured) ? 6 : 2;
+      len = hdrLen + nSubrects * subrectLen;
+      if (!(ptr = (const uint8_t *)PeekFromRFBServer(client, len)))
+	return FALSE;
+      ptr += hdrLen;
+
+      for (i = 0; i < nSubrects; i++) {
+	if (subencoding & rfbHextileSubrectsColoured) {
+	  memcpy(&fg, ptr, 4);
+	  ptr += 4;
+	}
+	sx = rfbHextileExtractX(*ptr);
+	sy = rfbHextileExtractY(*ptr);
+	ptr++;
+	sw = rfbHextileExtractW(*ptr);
+	sh = rfbHextileExtractH(*ptr);
+	ptr++;
+
+	if (sx + sw <= w && sy + sh <= h)
+	  Fill32(client, x+sx, y+sy, sw, sh, fg);
+	else
+	  client->GotFillRect(client, x+sx, y+sy, sw, sh, fg);
+      }
+      ConsumeFromRFBServer(client, len);
+    }
+  }
+
+  return TRUE;
+}
+#endif
+
 static rfbBool
 HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
@@ -40,6 +135,11 @@ HandleHextileBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   uint8_t subencoding;
   uint8_t nSubrects;
 
+#if BPP==32
+  if (CanFill32(client, rx, ry, rw, rh))
+    return HandleHextile32Direct(client, rx, ry, rw, rh);
+#endif
+
   for (y = ry; y < ry+rh; y += 16) {
     for (x = rx; x < rx+rw; x += 16) {
       w = h = 16;
@@ -0,0 +1,131 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * pixconv.c - convert pixels to the format of the framebuffer and textures
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <string.h>
+#include "pixconv.h"
+
+// Move the r, g, b bytes in the low 24 bits of v (red lowest, as loaded from
+// memory) to their place; the byte swaps become a single rev instruction.
+static inline uint32_t place(uint32_t v, enum pixconv_order order)
+{
+	switch (order) {
+	case PIXCONV_XBGR:
+		return __builtin_bswap32(v) & 0xffffff00;
+	case PIXCONV_BGRX:
+		return __builtin_bswap32(v) >> 8;
+	case PIXCONV_RGBX:
+		return v & 0x00ffffff;
+	default:
+		return v << 8;
+	}
+}
+
+// four pixels out of three words, the rest one by one
+static inline __attribute__((always_inline))
+void rgb24_words(uint32_t *d, const uint8_t *s, int n, enum pixconv_order order)
+{
+	for (; n >= 4; n -= 4, s += 12, d += 4) {
+		uint32_t w0, w1, w2;
+		memcpy(&w0, s, 4);
+		memcpy(&w1, s + 4, 4);
+		memcpy(&w2, s + 8, 4);
+		d[0] = place(w0, order);
+		d[1] = place(w0 >> 24 | w1 << 8, order);
+		d[2] = place(w1 >> 16 | w2 << 16, order);
+		d[3] = place(w2 >> 8, order);
+	}
+	for (; n > 0; --n, s += 3)
+		*d++ = place(s[0] | s[1] << 8 | s[2] << 16, order);
+}
+
+static void rgb24_xbgr(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	rgb24_words((uint32_t *)dst, src, n, PIXCONV_XBGR);
+}
+
+static void rgb24_bgrx(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	rgb24_words((uint32_t *)dst, src, n, PIXCONV_BGRX);
+}
+
+static void rgb24_rgbx(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	rgb24_words((uint32_t *)dst, src, n, PIXCONV_RGBX);
+}
+
+static void rgb24_xrgb(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	rgb24_words((uint32_t *)dst, src, n, PIXCONV_XRGB);
+}
+
+static void rgb24_lut32(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	uint32_t *d = (uint32_t *)dst;
+	for (; n > 0; --n, src += 3)
+		*d++ = pc->lut[0][src[0]] | pc->lut[1][src[1]] | pc->lut[2][src[2]];
+}
+
+static void rgb24_lut16(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	uint16_t *d = (uint16_t *)dst;
+	for (; n > 0; --n, src += 3)
+		*d++ = pc->lut[0][src[0]] | pc->lut[1][src[1]] | pc->lut[2][src[2]];
+}
+
+static void rgb24_lut8(const struct pixconv *pc, void *dst, const uint8_t *src, int n)
+{
+	uint8_t *d = (uint8_t *)dst;
+	for (; n > 0; --n, src += 3)
+		*d++ = pc->lut[0][src[0]] | pc->lut[1][src[1]] | pc->lut[2][src[2]];
+}
+
+void pixconv_init(struct pixconv *pc, int bpp,
+	int rmax, int gmax, int bmax, int rshift, int gshift, int bshift)
+{
+	const int max[3] = {rmax, gmax, bmax};
+	const int shift[3] = {rshift, gshift, bshift};
+	int c, v;
+
+	pc->bpp = bpp;
+	// rounded like libvncclient's RGB24_TO_PIXEL, just c << shift for 8 bits
+	for (c = 0; c < 3; ++c)
+		for (v = 0; v < 256; ++v)
+			pc->lut[c][v] = (uint32_t)((v * max[c] + 127) / 255) << shift[c];
+
+	pc->order = PIXCONV_OTHER;
+	if (bpp == 32 && rmax == 255 && gmax == 255 && bmax == 255 && gshift == 16) {
+		if (rshift == 24 && bshift == 8) pc->order = PIXCONV_XBGR;
+		else if (rshift == 8 && bshift == 24) pc->order = PIXCONV_XRGB;
+	} else if (bpp == 32 && rmax == 255 && gmax == 255 && bmax == 255 && gshift == 8) {
+		if (rshift == 16 && bshift == 0) pc->order = PIXCONV_BGRX;
+		else if (rshift == 0 && bshift == 16) pc->order = PIXCONV_RGBX;
+	}
+
+	switch (pc->order) {
+	case PIXCONV_XBGR: pc->rgb24 = rgb24_xbgr; break;
+	case PIXCONV_BGRX: pc->rgb24 = rgb24_bgrx; break;
+	case PIXCONV_RGBX: pc->rgb24 = rgb24_rgbx; break;
+	case PIXCONV_XRGB: pc->rgb24 = rgb24_xrgb; break;
+	default:
+		pc->rgb24 = bpp == 32 ? rgb24_lut32 : bpp == 16 ? rgb24_lut16 : rgb24_lut8;
+		break;
+	}
+}
+
+void pixconv_bswap32(uint32_t *dst, const uint32_t *src, int n)
+{
+	for (; n >= 4; n -= 4, src += 4, dst += 4) {
+		uint32_t a = src[0], b = src[1], c = src[2], d = src[3];
+		dst[0] = __builtin_bswap32(a);
+		dst[1] = __builtin_bswap32(b);
+		dst[2] = __builtin_bswap32(c);
+		dst[3] = __builtin_bswap32(d);
+	}
+	for (; n > 0; --n)
+		*dst++ = __builtin_bswap32(*src++);
+}
@@ -0,0 +1,50 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * pixconv.h - convert pixels to the format of the framebuffer and textures
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _PIXCONV_H
+#define _PIXCONV_H
+
+#include <stdint.h>
+
+// The byte order of 32bpp pixels with 8 bit channels, as stored in memory by
+// this (little endian) machine. The unused byte is written as 0.
+enum pixconv_order {
+	PIXCONV_OTHER,			// any other format, converted through tables
+	PIXCONV_XBGR,			// red shift 24, green 16, blue 8 (the SDL and 3DS texture format)
+	PIXCONV_BGRX,			// red shift 16, green 8, blue 0
+	PIXCONV_RGBX,			// red shift 0, green 8, blue 16
+	PIXCONV_XRGB,			// red shift 8, green 16, blue 24
+};
+
+struct pixconv {
+	int bpp;				// 8, 16 or 32
+	enum pixconv_order order;
+	uint32_t lut[3][256];	// every red, green and blue value as a pixel
+	// the kernel for the format, picked by pixconv_init()
+	void (*rgb24)(const struct pixconv *pc, void *dst, const uint8_t *src, int n);
+};
+
+// pick the conversions for a pixel format, given like in rfbPixelFormat
+extern void pixconv_init(struct pixconv *pc, int bpp,
+	int rmax, int gmax, int bmax, int rshift, int gshift, int bshift);
+
+// convert n pixels given as r, g, b bytes; channels are scaled to the
+// maximum of the format
+static inline void pixconv_rgb24(const struct pixconv *pc, void *dst, const uint8_t *src, int n) {
+	pc->rgb24(pc, dst, src, n);
+}
+
+// a single pixel, e.g. a fill or cursor colour
+static inline uint32_t pixconv_rgb24_pixel(const struct pixconv *pc, uint8_t r, uint8_t g, uint8_t b) {
+	return pc->lut[0][r] | pc->lut[1][g] | pc->lut[2][b];
+}
+
+// reverse the bytes of n 32bpp pixels, e.g. RGBA to ABGR; dst may be src
+extern void pixconv_bswap32(uint32_t *dst, const uint32_t *src, int n);
+
+#endif // _PIXCONV_H
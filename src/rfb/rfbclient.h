@@ -56,6 +56,7 @@
 #include <rfb/rfbproto.h>
 #include <rfb/keysym.h>
 #include <rfb/threading.h>
+#include <rfb/pixconv.h>
 
 #ifdef LIBVNCSERVER_HAVE_SASL
 #include <sasl/sasl.h>
@@ -108,6 +109,44 @@ typedef struct {
   rfbBool doNotSleep;
 } rfbVNCRec;
 
+/** decode statistics */
+
+/** Encodings counted separately in rfbClientStats, all others go to rfbStatsOther. */
+enum {
+  rfbStatsRaw,
+  rfbStatsCopyRect,
+  rfbStatsRRE,
+  rfbStatsCoRRE,
+  rfbStatsHextile,
+  rfbStatsUltra,
+  rfbStatsTRLE,
+  rfbStatsZlib,
+  rfbStatsTight,
+  rfbStatsZRLE,
+  rfbStatsOther,
+  rfbStatsEncodings
+};
+
+typedef struct {
+  unsigned int rects;
+  uint64_t pixels;
+  uint64_t bytes;        /**< including the rect headers */
+  uint64_t decodeUsecs;  /**< time spent in the decoder, without waiting for data */
+} rfbEncodingStats;
+
+/**
+ * Counters kept while handling server messages, never reset by the library.
+ * Take the difference of two snapshots to get rates. Times are in
+ * microseconds, as returned by gettimeofday().
+ */
+typedef struct {
+  uint64_t bytesReceived;   /**< handed to the decoders */
+  uint64_t readUsecs;       /**< spent waiting for and reading data from the server */
+  rfbEncodingStats encoding[rfbStatsEncodings];
+  uint64_t requestSent;     /**< when the oldest unanswered update request was sent, 0 if none */
+  unsigned int roundTripUsecs; /**< from that request to the last FramebufferUpdate */
+} rfbClientStats;
+
 /** client data */
 
 typedef struct rfbClientData {
@@ -132,10 +171,15 @@ typedef struct {
 
   int compressLevel;
   int qualityLevel;
+  int fineQualityLevel; /**< JPEG quality 1-100 for TurboVNC compatible servers, -1 to only send qualityLevel */
+  int subsampLevel; /**< JPEG chroma subsampling as rfbEncodingSubsamp1X + n, -1 for the server's default */
   rfbBool enableJPEG;
   rfbBool useRemoteCursor;
   rfbBool palmVNC;  /**< use palmvnc specific SetScale (vs ultravnc) */
   int scaleSetting; /**< 0 means no scale set, else 1/scaleSetting */
+  int updateRequests; /**< number of incremental FramebufferUpdateRequests kept outstanding */
+  int desktopWidth; /**< desktop size to ask ExtendedDesktopSize servers for, 0 to keep theirs */
+  int desktopHeight;
 } AppData;
 
 /** For GetCredentialProc callback function to return */
@@ -232,6 +276,48 @@ typedef void (*GotBitmapProc)(struct _rfbClient* client, const uint8_t* buffer,
 typedef rfbBool (*GotJpegProc)(struct _rfbClient* client, const uint8_t* buffer, int length, int x, int y, int w, int h);
 typedef rfbBool (*LockWriteToTLSProc)(struct _rfbClient* client);   /** @deprecated */
 typedef rfbBool (*UnlockWriteToTLSProc)(struct _rfbClient* client); /** @deprecated */
+typedef void (*LockWriteToServerProc)(struct _rfbClient* client);
+typedef void (*UnlockWriteToServerProc)(struct _rfbClient* client);
+
+/**
+ * Buffers for decoding Tight rectangles, one set per decoding thread. buffer
+ * holds RFB_BUFFER_SIZE and prevRow 2048*3*sizeof(uint16_t) bytes. tjhnd
+ * starts out NULL, is created on first use and must be freed with tjDestroy().
+ */
+typedef struct {
+	char* buffer;
+	uint8_t* prevRow;
+	void* tjhnd;
+} rfbDecodeScratch;
+
+/**
+ * A Tight rectangle whose data has been read from the server, to be decoded
+ * by rfbClientDecodeJob(), possibly on another thread. Jobs on the same zlib
+ * stream must be decoded in the order they were queued, jobs with stream -1
+ * (JPEG) in any order.
+ */
+typedef struct _rfbDecodeJob {
+	struct _rfbDecodeJob* next;
+	int x, y, w, h;
+	int stream;
+	rfbBool (*decode)(struct _rfbClient* client, struct _rfbDecodeJob* job, rfbDecodeScratch* scratch);
+	rfbBool result;
+	/* filter state, set up while reading the rectangle */
+	int filter;
+	rfbBool cutZeros;
+	int rectColors, bitsPixel, rowSize;
+	char palette[256*4];
+	int length;
+	uint8_t data[];
+} rfbDecodeJob;
+
+/**
+ * Takes over a job to decode it later, e.g. on a pool of threads.
+ * @return false if the job could not be queued
+ */
+typedef rfbBool (*QueueDecodeJobProc)(struct _rfbClient* client, rfbDecodeJob* job);
+/** Returns once all queued jobs have been decoded. */
+typedef void (*WaitDecodeJobsProc)(struct _rfbClient* client);
 
 #ifdef LIBVNCSERVER_HAVE_SASL
 typedef char* (*GetUserProc)(struct _rfbClient* client);
@@ -271,10 +357,12 @@ typedef struct _rfbClient {
 	rfbBool canUseHextile;
 	char *desktopName;
 	rfbPixelFormat format;
+	/** Pixel conversions for format, set up by SetFormatAndEncodings(). */
+	struct pixconv pixconv;
 	rfbServerInitMsg si;
 
 	/* sockets.c */
-#define RFB_BUF_SIZE 8192
+#define RFB_BUF_SIZE 65536
 	char buf[RFB_BUF_SIZE];
 	char *bufoutptr;
 	unsigned int buffered;
@@ -296,6 +384,8 @@ typedef struct _rfbClient {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
 	z_stream decompStream;
 	rfbBool decompStreamInited;
+	/** The ZRLE decoder for the pixel format, picked by SetFormatAndEncodings(). */
+	rfbBool (*zrleDecoder)(struct _rfbClient* client, int rx, int ry, int rw, int rh);
 #endif
 
 
@@ -456,6 +546,9 @@ typedef struct _rfbClient {
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	/** JPEG decoder state. */
 	void *tjhnd;
+	/** JPEG data too large to be decoded in the receive buffer, reused for every rect. */
+	uint8_t *jpegBuffer;
+	int jpegBufferSize;
 
 #endif
 #endif
@@ -471,6 +564,77 @@ typedef struct _rfbClient {
 	 * For internal use only.
 	 */
 	MUTEX(tlsRwMutex);
+
+	/**
+	 * Optional hooks called around every WriteToRFBServer(). Set these when
+	 * messages are sent from more than one thread, e.g. input events from the
+	 * main thread while server messages are handled in a separate thread.
+	 */
+	LockWriteToServerProc LockWriteToServer;
+	UnlockWriteToServerProc UnlockWriteToServer;
+
+	/**
+	 * Continuous updates and fence extension state, set when the server
+	 * announced support. While continuousUpdates is set, the server sends
+	 * updates for updateRect without being asked and no incremental
+	 * FramebufferUpdateRequests are sent. For internal use only.
+	 */
+	rfbBool supportsContinuousUpdates;
+	rfbBool continuousUpdates;
+	rfbBool supportsFence;
+
+	/**
+	 * ExtendedDesktopSize state, set when the server announced it can be
+	 * resized with SetDesktopSize. screen is the first screen of the last
+	 * layout the server sent, requestedResize is set once
+	 * appData.desktopWidth/desktopHeight was asked for. For internal use only.
+	 */
+	rfbBool supportsExtDesktopSize;
+	rfbBool requestedResize;
+	rfbExtDesktopScreen screen;
+
+	/**
+	 * If set, Tight rectangles are handed to QueueDecodeJob once their data
+	 * has been read, instead of being decoded right away. WaitDecodeJobs is
+	 * called before anything else touches the framebuffer and at the end of
+	 * every FramebufferUpdate; GotFrameBufferUpdate for the queued rectangles
+	 * follows then, on the thread handling the server messages.
+	 */
+	QueueDecodeJobProc QueueDecodeJob;
+	WaitDecodeJobsProc WaitDecodeJobs;
+	/** Jobs queued since the last wait, in order. For internal use only. */
+	rfbDecodeJob* decodeJobs;
+	rfbDecodeJob* decodeJobsTail;
+	unsigned int decodeJobsQueued;
+	/** Bounding box of the queued jobs. For internal use only. */
+	int decodeJobsX1, decodeJobsY1, decodeJobsX2, decodeJobsY2;
+
+	/**
+	 * Estimated number of FramebufferUpdateRequests the server has not yet
+	 * answered. For internal use only.
+	 */
+	int pendingUpdateRequests;
+	/**
+	 * Number of FramebufferUpdates received, and how often no further data
+	 * from the server was waiting once one had been handled. If the latter is
+	 * high while the screen changes continuously, appData.updateRequests
+	 * should be raised.
+	 */
+	unsigned int updatesReceived;
+	unsigned int updatePipelineDry;
+	/** Decode statistics, for showing where the time goes. */
+	rfbClientStats stats;
+
+	/**
+	 * If set before connecting, everything received from the server is
+	 * written to this file in the vncrec format, with a timestamp in front of
+	 * every server message. The session can be played back by connecting
+	 * with serverPort -1 and the file as serverHost. The string is not copied.
+	 */
+	const char* recordFile;
+	/** The recording while it is written. For internal use only. */
+	FILE* vncRecord;
+	rfbBool recordTimestamp;
 } rfbClient;
 
 /* cursor.c */
@@ -514,6 +678,15 @@ extern rfbBool InitialiseRFBConnection(rfbClient* client);
  * false otherwise
  */
 extern rfbBool SetFormatAndEncodings(rfbClient* client);
+/**
+ * Like SetFormatAndEncodings(), but only sends the encodings, e.g. after
+ * changing appData.encodingsString, compressLevel or qualityLevel during a
+ * session. Unlike a new pixel format, this does not make the server resend
+ * the whole framebuffer.
+ * @param client The client in which the encodings have been changed
+ * @return true if the encodings were sent to the server successfully
+ */
+extern rfbBool SetEncodings(rfbClient* client);
 extern rfbBool SendIncrementalFramebufferUpdateRequest(rfbClient* client);
 /**
  * Sends a framebuffer update request to the server. A VNC client may request an
@@ -539,6 +712,51 @@ extern rfbBool SendFramebufferUpdateRequest(rfbClient* client,
 					 int x, int y, int w, int h,
 					 rfbBool incremental);
 extern rfbBool SendScaleSetting(rfbClient* client,int scaleSetting);
+/**
+ * Asks the server to start or stop sending updates for the given area without
+ * waiting for FramebufferUpdateRequests. Only has an effect if the server
+ * supports the continuous updates extension.
+ * @param client The client through which to send the message
+ * @param enable true to enable continuous updates, false to stop them
+ * @param x The horizontal position of the area
+ * @param y The vertical position of the area
+ * @param w The width of the area
+ * @param h The height of the area
+ * @return true if the message was sent successfully, false otherwise
+ */
+extern rfbBool SendEnableContinuousUpdates(rfbClient* client, rfbBool enable,
+					 int x, int y, int w, int h);
+/**
+ * Sends a fence message to the server. Only has an effect if the server
+ * supports the fence extension.
+ * @param client The client through which to send the message
+ * @param flags Combination of the rfbFenceFlag* flags
+ * @param length Length of the data, at most rfbFenceMaxLength bytes
+ * @param data Data the server should send back with its response
+ * @return true if the message was sent successfully, false otherwise
+ */
+extern rfbBool SendFence(rfbClient* client, uint32_t flags, int length, const char *data);
+/**
+ * Asks the server to change the size of the remote desktop, keeping a single
+ * screen covering all of it. Only has an effect if the server supports the
+ * ExtendedDesktopSize extension. If the server accepts, the new size arrives
+ * like any other framebuffer resize.
+ * @param client The client through which to send the message
+ * @param width The requested width of the desktop
+ * @param height The requested height of the desktop
+ * @return true if the message was sent successfully, false otherwise
+ */
+extern rfbBool SendExtDesktopSize(rfbClient* client, int width, int height);
+/**
+ * Decodes a job handed to client->QueueDecodeJob into the framebuffer. Jobs
+ * on different streams may be decoded at the same time, each thread using
+ * its own scratch buffers.
+ * @param client The client the job belongs to
+ * @param job The job, which stays owned by the client
+ * @param scratch Buffers of the calling thread
+ * @return true if the rectangle was decoded successfully
+ */
+extern rfbBool rfbClientDecodeJob(rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch);
 /**
  * Sends a pointer event to the server. A pointer event includes a cursor
  * location and a button mask. The button mask indicates which buttons on the
@@ -683,6 +901,36 @@ void rfbClientRegisterExtension(rfbClientProtocolExtension* e);
 extern rfbBool errorMessageOnReadFailure;
 
 extern rfbBool ReadFromRFBServer(rfbClient* client, char *out, unsigned int n);
+/** The clock of rfbClientStats, in microseconds. */
+extern uint64_t rfbClientMicroTime(void);
+/**
+ * Starts writing everything received from the server to client->recordFile.
+ * Called by ConnectToRFBServer() when recordFile is set.
+ * @return FALSE if the file could not be created
+ */
+extern rfbBool StartVNCRecord(rfbClient* client);
+/**
+ * Returns a pointer to the next n bytes from the server without consuming them
+ * or copying them out of the receive buffer.
+ * @param client The client to read from
+ * @param n Number of bytes, at most RFB_BUF_SIZE
+ * @return Pointer valid until the next read from the server, NULL on error
+ */
+extern const char* PeekFromRFBServer(rfbClient* client, unsigned int n);
+/**
+ * Skips n bytes returned by PeekFromRFBServer().
+ */
+extern void ConsumeFromRFBServer(rfbClient* client, unsigned int n);
+/**
+ * Reads between 1 and max bytes from the server without copying them out of
+ * the receive buffer. Meant for decoders which can consume data in pieces,
+ * e.g. zlib streams.
+ * @param client The client to read from
+ * @param max Maximum number of bytes wanted
+ * @param len Set to the number of bytes returned
+ * @return Pointer valid until the next read from the server, NULL on error
+ */
+extern const char* BorrowFromRFBServer(rfbClient* client, unsigned int max, unsigned int *len);
 extern rfbBool WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n);
 extern int FindFreeTcpPort(void);
 extern rfbSocket ListenAtTcpPort(int port);
@@ -67,6 +67,10 @@
 
 #define MAX_TEXTCHAT_SIZE 10485760 /* 10MB */
 
+/* vncviewer.c - the default GotBitmap and GotFillRect */
+extern void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h);
+extern void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour);
+
 /*
  * rfbClientLog prints a time-stamped message to the log file (stderr).
  */
@@ -180,6 +184,27 @@ static rfbBool HandleZRLE24(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE24Up(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE24Down(rfbClient* client, int rx, int ry, int rw, int rh);
 static rfbBool HandleZRLE32(rfbClient* client, int rx, int ry, int rw, int rh);
+
+/* The ZRLE decoders, one per way of packing pixels into CPIXELs. */
+enum {
+  ZRLE_DECODER_8,
+  ZRLE_DECODER_15,
+  ZRLE_DECODER_16,
+  ZRLE_DECODER_24,
+  ZRLE_DECODER_24UP,
+  ZRLE_DECODER_24DOWN,
+  ZRLE_DECODER_32
+};
+
+static rfbBool (* const zrleDecoders[])(rfbClient* client, int rx, int ry, int rw, int rh) = {
+  HandleZRLE8,
+  HandleZRLE15,
+  HandleZRLE16,
+  HandleZRLE24,
+  HandleZRLE24Up,
+  HandleZRLE24Down,
+  HandleZRLE32
+};
 #endif
 
 /*
@@ -353,6 +378,10 @@ ConnectToRFBServer(rfbClient* client,const char *hostname, int port)
   if(client->QoS_DSCP && !SetDSCP(client->sock, client->QoS_DSCP))
      return FALSE;
 
+  /* the session works without the recording, so this is not fatal */
+  if (client->recordFile)
+    StartVNCRecord(client);
+
   return TRUE;
 }
 
@@ -1197,6 +1226,49 @@ InitialiseRFBConnection(rfbClient* client)
 }
 
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+/*
+ * SelectZRLEDecoder picks the ZRLE decoder for client->format once, instead
+ * of testing the format for every rectangle.
+ */
+
+static void
+SelectZRLEDecoder(rfbClient* client)
+{
+  int decoder;
+
+  switch (client->format.bitsPerPixel) {
+  case 8:
+    decoder = ZRLE_DECODER_8;
+    break;
+  case 16:
+    decoder = client->si.format.greenMax > 0x1F ? ZRLE_DECODER_16 : ZRLE_DECODER_15;
+    break;
+  case 32:
+  {
+    uint32_t maxColor=(client->format.redMax<<client->format.redShift)|
+      (client->format.greenMax<<client->format.greenShift)|
+      (client->format.blueMax<<client->format.blueShift);
+    if ((client->format.bigEndian && (maxColor&0xff)==0) ||
+        (!client->format.bigEndian && (maxColor&0xff000000)==0))
+      decoder = ZRLE_DECODER_24;
+    else if (!client->format.bigEndian && (maxColor&0xff)==0)
+      decoder = ZRLE_DECODER_24UP;
+    else if (client->format.bigEndian && (maxColor&0xff000000)==0)
+      decoder = ZRLE_DECODER_24DOWN;
+    else
+      decoder = ZRLE_DECODER_32;
+    break;
+  }
+  default:
+    client->zrleDecoder = NULL;
+    return;
+  }
+  client->zrleDecoder = zrleDecoders[decoder];
+}
+#endif
+
+
 /*
  * SetFormatAndEncodings.
  */
@@ -1205,18 +1277,13 @@ rfbBool
 SetFormatAndEncodings(rfbClient* client)
 {
   rfbSetPixelFormatMsg spf;
-  union {
-    char bytes[sz_rfbSetEncodingsMsg + MAX_ENCODINGS*4];
-    rfbSetEncodingsMsg msg;
-  } buf;
 
-  rfbSetEncodingsMsg *se = &buf.msg;
-  uint32_t *encs = (uint32_t *)(&buf.bytes[sz_rfbSetEncodingsMsg]);
-  int len = 0;
-  rfbBool requestCompressLevel = FALSE;
-  rfbBool requestQualityLevel = FALSE;
-  rfbBool requestLastRectEncoding = FALSE;
-  rfbClientProtocolExtension* e;
+  pixconv_init(&client->pixconv, client->format.bitsPerPixel,
+               client->format.redMax, client->format.greenMax, client->format.blueMax,
+               client->format.redShift, client->format.greenShift, client->format.blueShift);
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+  SelectZRLEDecoder(client);
+#endif
 
   if (!SupportsClient2Server(client, rfbSetPixelFormat)) return TRUE;
 
@@ -1231,6 +1298,48 @@ SetFormatAndEncodings(rfbClient* client)
   if (!WriteToRFBServer(client, (char *)&spf, sz_rfbSetPixelFormatMsg))
     return FALSE;
 
+  return SetEncodings(client);
+}
+
+
+/*
+ * AddFineQualityEncodings appends the TurboVNC fine quality and subsampling
+ * pseudo-encodings. They go after the coarse quality level, which servers
+ * without TurboVNC extensions still understand and TurboVNC overrides.
+ */
+
+static int
+AddFineQualityEncodings(rfbClient* client, uint32_t *encs, int n)
+{
+  if (n < MAX_ENCODINGS &&
+      client->appData.fineQualityLevel >= 1 && client->appData.fineQualityLevel <= 100)
+    encs[n++] = rfbClientSwap32IfLE(rfbEncodingFineQualityLevel0 + client->appData.fineQualityLevel);
+  if (n < MAX_ENCODINGS &&
+      client->appData.subsampLevel >= 0 && client->appData.subsampLevel <= 5)
+    encs[n++] = rfbClientSwap32IfLE(rfbEncodingSubsamp1X + client->appData.subsampLevel);
+  return n;
+}
+
+
+/*
+ * SetEncodings.
+ */
+
+rfbBool
+SetEncodings(rfbClient* client)
+{
+  union {
+    char bytes[sz_rfbSetEncodingsMsg + MAX_ENCODINGS*4];
+    rfbSetEncodingsMsg msg;
+  } buf;
+
+  rfbSetEncodingsMsg *se = &buf.msg;
+  uint32_t *encs = (uint32_t *)(&buf.bytes[sz_rfbSetEncodingsMsg]);
+  int len = 0;
+  rfbBool requestCompressLevel = FALSE;
+  rfbBool requestQualityLevel = FALSE;
+  rfbBool requestLastRectEncoding = FALSE;
+  rfbClientProtocolExtension* e;
 
   if (!SupportsClient2Server(client, rfbSetEncodings)) return TRUE;
 
@@ -1309,6 +1418,7 @@ SetFormatAndEncodings(rfbClient* client)
         client->appData.qualityLevel = 5;
       encs[se->nEncodings++] = rfbClientSwap32IfLE(client->appData.qualityLevel +
 					  rfbEncodingQualityLevel0);
+      se->nEncodings = AddFineQualityEncodings(client, encs, se->nEncodings);
     }
   }
   else {
@@ -1359,6 +1469,7 @@ SetFormatAndEncodings(rfbClient* client)
 	client->appData.qualityLevel = 5;
       encs[se->nEncodings++] = rfbClientSwap32IfLE(client->appData.qualityLevel +
 					  rfbEncodingQualityLevel0);
+      se->nEncodings = AddFineQualityEncodings(client, encs, se->nEncodings);
     }
   }
 
@@ -1378,7 +1489,9 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingKeyboardLedState);
 
-  /* New Frame Buffer Size */
+  /* New Frame Buffer Size, servers prefer the extended one if they have it */
+  if (se->nEncodings < MAX_ENCODINGS && client->canHandleNewFBSize)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingExtDesktopSize);
   if (se->nEncodings < MAX_ENCODINGS && client->canHandleNewFBSize)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingNewFBSize);
 
@@ -1398,6 +1511,12 @@ SetFormatAndEncodings(rfbClient* client)
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingXvp);
 
+  /* Continuous updates and fences */
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingFence);
+  if (se->nEncodings < MAX_ENCODINGS)
+    encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingContinuousUpdates);
+
   if (se->nEncodings < MAX_ENCODINGS)
     encs[se->nEncodings++] = rfbClientSwap32IfLE(rfbEncodingQemuExtendedKeyEvent);
 
@@ -1454,10 +1573,170 @@ SendFramebufferUpdateRequest(rfbClient* client, int x, int y, int w, int h, rfbB
   if (!WriteToRFBServer(client, (char *)&fur, sz_rfbFramebufferUpdateRequestMsg))
     return FALSE;
 
+  client->pendingUpdateRequests++;
+  if (!client->stats.requestSent)
+    client->stats.requestSent = rfbClientMicroTime();
   return TRUE;
 }
 
 
+/*
+ * CountRect adds a decoded rect to the statistics of its encoding. The time
+ * spent waiting for the server is not counted as decoding.
+ */
+
+static void
+CountRect(rfbClient* client, uint32_t encoding, int pixels,
+	  uint64_t bytesStart, uint64_t timeStart, uint64_t readStart)
+{
+  rfbEncodingStats *e;
+
+  switch (encoding) {
+  case rfbEncodingRaw:      e = &client->stats.encoding[rfbStatsRaw]; break;
+  case rfbEncodingCopyRect: e = &client->stats.encoding[rfbStatsCopyRect]; break;
+  case rfbEncodingRRE:      e = &client->stats.encoding[rfbStatsRRE]; break;
+  case rfbEncodingCoRRE:    e = &client->stats.encoding[rfbStatsCoRRE]; break;
+  case rfbEncodingHextile:  e = &client->stats.encoding[rfbStatsHextile]; break;
+  case rfbEncodingUltra:
+  case rfbEncodingUltraZip: e = &client->stats.encoding[rfbStatsUltra]; break;
+  case rfbEncodingTRLE:     e = &client->stats.encoding[rfbStatsTRLE]; break;
+  case rfbEncodingZlib:     e = &client->stats.encoding[rfbStatsZlib]; break;
+  case rfbEncodingTight:    e = &client->stats.encoding[rfbStatsTight]; break;
+  case rfbEncodingZRLE:
+  case rfbEncodingZYWRLE:   e = &client->stats.encoding[rfbStatsZRLE]; break;
+  default:                  e = &client->stats.encoding[rfbStatsOther]; break;
+  }
+  e->rects++;
+  e->pixels += pixels;
+  e->bytes += client->stats.bytesReceived - bytesStart;
+  e->decodeUsecs += rfbClientMicroTime() - timeStart - (client->stats.readUsecs - readStart);
+}
+
+
+/*
+ * RequestNextUpdates - called as soon as the header of a FramebufferUpdate has
+ * been read, so that the server can encode the next update while we are still
+ * decoding this one. Tops up to appData.updateRequests outstanding requests,
+ * but always sends at least one: most servers merge requests which arrive
+ * while another one is pending, so our count may be too high.
+ */
+
+static rfbBool
+RequestNextUpdates(rfbClient* client)
+{
+  int n = client->appData.updateRequests - client->pendingUpdateRequests;
+
+  if (n < 1) n = 1;
+  while (n-- > 0)
+    if (!SendIncrementalFramebufferUpdateRequest(client))
+      return FALSE;
+  return TRUE;
+}
+
+
+/*
+ * SendEnableContinuousUpdates.
+ */
+
+rfbBool
+SendEnableContinuousUpdates(rfbClient* client, rfbBool enable, int x, int y, int w, int h)
+{
+  rfbEnableContinuousUpdatesMsg ecu;
+
+  if (!client->supportsContinuousUpdates) return TRUE;
+
+  ecu.type = rfbEnableContinuousUpdates;
+  ecu.enable = enable ? 1 : 0;
+  ecu.x = rfbClientSwap16IfLE(x);
+  ecu.y = rfbClientSwap16IfLE(y);
+  ecu.w = rfbClientSwap16IfLE(w);
+  ecu.h = rfbClientSwap16IfLE(h);
+
+  if (!WriteToRFBServer(client, (char *)&ecu, sz_rfbEnableContinuousUpdatesMsg))
+    return FALSE;
+
+  client->continuousUpdates = enable;
+  return TRUE;
+}
+
+
+/*
+ * SendFence.
+ */
+
+rfbBool
+SendFence(rfbClient* client, uint32_t flags, int length, const char *data)
+{
+  rfbFenceMsg f;
+
+  if (!client->supportsFence) return TRUE;
+  if (length < 0 || length > rfbFenceMaxLength) return FALSE;
+
+  f.type = rfbFence;
+  f.pad[0] = f.pad[1] = f.pad[2] = 0;
+  f.flags = rfbClientSwap32IfLE(flags);
+  f.length = length;
+
+  if (!WriteToRFBServer(client, (char *)&f, sz_rfbFenceMsg) ||
+      (length > 0 && !WriteToRFBServer(client, data, length)))
+    return FALSE;
+
+  return TRUE;
+}
+
+
+/*
+ * SendExtDesktopSize.
+ */
+
+rfbBool
+SendExtDesktopSize(rfbClient* client, int width, int height)
+{
+  rfbSetDesktopSizeMsg sdm;
+  rfbExtDesktopScreen screen;
+  char buf[sz_rfbSetDesktopSizeMsg + sz_rfbExtDesktopScreen];
+
+  if (!SupportsClient2Server(client, rfbSetDesktopSize)) return TRUE;
+
+  sdm.type = rfbSetDesktopSize;
+  sdm.pad1 = sdm.pad2 = 0;
+  sdm.width = rfbClientSwap16IfLE(width);
+  sdm.height = rfbClientSwap16IfLE(height);
+  sdm.numberOfScreens = 1;
+
+  /* keep the id, the server uses it to tell which monitor this is */
+  screen.id = client->screen.id;
+  screen.x = screen.y = 0;
+  screen.width = rfbClientSwap16IfLE(width);
+  screen.height = rfbClientSwap16IfLE(height);
+  screen.flags = client->screen.flags;
+
+  /* a single write, the server must never see the message without its screen */
+  memcpy(buf, &sdm, sz_rfbSetDesktopSizeMsg);
+  memcpy(buf + sz_rfbSetDesktopSizeMsg, &screen, sz_rfbExtDesktopScreen);
+  if (!WriteToRFBServer(client, buf, sizeof(buf)))
+    return FALSE;
+
+  client->requestedResize = TRUE;
+  return TRUE;
+}
+
+
+/*
+ * ResumeUpdates - called after the framebuffer has been resized to keep
+ * continuous updates flowing for the new size.
+ */
+
+static rfbBool
+ResumeUpdates(rfbClient* client)
+{
+  if (!client->continuousUpdates) return TRUE;
+  return SendEnableContinuousUpdates(client, TRUE,
+			client->updateRect.x, client->updateRect.y,
+			client->updateRect.w, client->updateRect.h);
+}
+
+
 /*
  * SendScaleSetting.
  */
@@ -1682,17 +1961,119 @@ SendClientCutText(rfbClient* client, char *str, int len)
 
 
 
+/*
+ * Decode jobs - Tight rects read by HandleTightBPP, decoded by the
+ * application through rfbClientDecodeJob, possibly in other threads.
+ */
+
+static rfbDecodeJob*
+NewDecodeJob(rfbClient* client, const rfbDecodeJob* header, int length)
+{
+  rfbDecodeJob* job = malloc(sizeof(rfbDecodeJob) + length);
+
+  if (job == NULL) {
+    rfbClientLog("Memory allocation error.\n");
+    return NULL;
+  }
+  *job = *header;
+  job->next = NULL;
+  job->length = length;
+  return job;
+}
+
+static rfbBool
+QueueJob(rfbClient* client, rfbDecodeJob* job)
+{
+  job->result = FALSE;
+  if (!client->QueueDecodeJob(client, job)) {
+    free(job);
+    return FALSE;
+  }
+  if (client->decodeJobs) {
+    client->decodeJobsTail->next = job;
+    if (job->x < client->decodeJobsX1) client->decodeJobsX1 = job->x;
+    if (job->y < client->decodeJobsY1) client->decodeJobsY1 = job->y;
+    if (job->x + job->w > client->decodeJobsX2) client->decodeJobsX2 = job->x + job->w;
+    if (job->y + job->h > client->decodeJobsY2) client->decodeJobsY2 = job->y + job->h;
+  } else {
+    client->decodeJobs = job;
+    client->decodeJobsX1 = job->x;
+    client->decodeJobsY1 = job->y;
+    client->decodeJobsX2 = job->x + job->w;
+    client->decodeJobsY2 = job->y + job->h;
+  }
+  client->decodeJobsTail = job;
+  client->decodeJobsQueued++;
+  return TRUE;
+}
+
+/* wait for the queued jobs, then report their rects in order */
+static rfbBool
+FinishDecodeJobs(rfbClient* client)
+{
+  rfbDecodeJob *job, *next;
+  rfbBool result = TRUE;
+
+  if (client->decodeJobs == NULL)
+    return TRUE;
+
+  client->WaitDecodeJobs(client);
+  for (job = client->decodeJobs; job; job = next) {
+    next = job->next;
+    if (job->result)
+      client->GotFrameBufferUpdate(client, job->x, job->y, job->w, job->h);
+    else
+      result = FALSE;
+    free(job);
+  }
+  client->decodeJobs = client->decodeJobsTail = NULL;
+  return result;
+}
+
+/* a rect drawn or queued on top of queued ones has to wait for them */
+static rfbBool
+FinishOverlappingDecodeJobs(rfbClient* client, int x, int y, int w, int h)
+{
+  if (client->decodeJobs == NULL ||
+      x >= client->decodeJobsX2 || x + w <= client->decodeJobsX1 ||
+      y >= client->decodeJobsY2 || y + h <= client->decodeJobsY1)
+    return TRUE;
+  return FinishDecodeJobs(client);
+}
+
+rfbBool
+rfbClientDecodeJob(rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch)
+{
+  job->result = job->decode(client, job, scratch);
+  return job->result;
+}
+
+
 /*
  * HandleRFBServerMessage.
  */
 
+static rfbBool HandleServerMessage(rfbClient* client);
+
 rfbBool
 HandleRFBServerMessage(rfbClient* client)
+{
+  if (HandleServerMessage(client))
+    return TRUE;
+  /* don't leave jobs writing to the framebuffer once the caller gives up */
+  FinishDecodeJobs(client);
+  return FALSE;
+}
+
+static rfbBool
+HandleServerMessage(rfbClient* client)
 {
   rfbServerToClientMsg msg;
 
   if (client->serverPort==-1)
     client->vncRec->readTimestamp = TRUE;
+  else if (client->vncRecord)
+    client->recordTimestamp = TRUE;
   if (!ReadFromRFBServer(client, (char *)&msg, 1))
     return FALSE;
 
@@ -1740,7 +2121,23 @@ HandleRFBServerMessage(rfbClient* client)
 
     msg.fu.nRects = rfbClientSwap16IfLE(msg.fu.nRects);
 
+    client->updatesReceived++;
+    if (client->pendingUpdateRequests > 0)
+      client->pendingUpdateRequests--;
+    if (client->stats.requestSent) {
+      client->stats.roundTripUsecs = rfbClientMicroTime() - client->stats.requestSent;
+      client->stats.requestSent = 0;
+    }
+
+    /* with continuous updates the server sends the next update unasked */
+    if (!client->continuousUpdates && !RequestNextUpdates(client))
+      return FALSE;
+
     for (i = 0; i < msg.fu.nRects; i++) {
+      uint64_t bytesStart = client->stats.bytesReceived;
+      uint64_t timeStart, readStart;
+      unsigned int jobsQueued;
+
       if (!ReadFromRFBServer(client, (char *)&rect, sz_rfbFramebufferUpdateRectHeader))
 	return FALSE;
 
@@ -1748,6 +2145,11 @@ HandleRFBServerMessage(rfbClient* client)
       if (rect.encoding == rfbEncodingLastRect)
 	break;
 
+      /* Tight rects wait for the queued ones they overlap, anything else
+	 might read or reallocate what they are decoding into */
+      if (rect.encoding != rfbEncodingTight && !FinishDecodeJobs(client))
+	return FALSE;
+
       rect.r.x = rfbClientSwap16IfLE(rect.r.x);
       rect.r.y = rfbClientSwap16IfLE(rect.r.y);
       rect.r.w = rfbClientSwap16IfLE(rect.r.w);
@@ -1782,6 +2184,64 @@ HandleRFBServerMessage(rfbClient* client)
           continue;
       }
 
+      if (rect.encoding == rfbEncodingExtDesktopSize) {
+	rfbExtDesktopSizeMsg eds;
+	rfbExtDesktopScreen screen;
+	int i;
+
+	if (!ReadFromRFBServer(client, (char *)&eds, sz_rfbExtDesktopSizeMsg))
+	  return FALSE;
+	for (i = 0; i < eds.numberOfScreens; i++) {
+	  if (!ReadFromRFBServer(client, (char *)&screen, sz_rfbExtDesktopScreen))
+	    return FALSE;
+	  /* ids and flags are only sent back, keep them as they are */
+	  if (i == 0)
+	    client->screen = screen;
+	}
+	client->supportsExtDesktopSize = TRUE;
+	SetClient2Server(client, rfbSetDesktopSize);
+
+	/* x is the reason, y the result of a change we asked for */
+	if (rect.r.x == rfbExtDesktopSize_ClientRequestedChange &&
+	    rect.r.y != rfbExtDesktopSize_Success) {
+	  rfbClientLog("Server refused desktop size %dx%d: %s\n",
+		  client->appData.desktopWidth, client->appData.desktopHeight,
+		  rect.r.y == rfbExtDesktopSize_ResizeProhibited ? "resize prohibited" :
+		  rect.r.y == rfbExtDesktopSize_OutOfResources ? "out of resources" :
+		  "invalid screen layout");
+	  continue;
+	}
+
+	/* servers repeat the current size after SetEncodings, don't clear the
+	   framebuffer for that */
+	if (rect.r.w != client->si.framebufferWidth || rect.r.h != client->si.framebufferHeight) {
+	  client->si.framebufferWidth = rect.r.w;
+	  client->si.framebufferHeight = rect.r.h;
+	  client->width = rect.r.w;
+	  client->height = rect.r.h;
+	  client->updateRect.x = client->updateRect.y = 0;
+	  client->updateRect.w = client->width;
+	  client->updateRect.h = client->height;
+	  if (!client->MallocFrameBuffer(client))
+	    return FALSE;
+	  SendFramebufferUpdateRequest(client, 0, 0, rect.r.w, rect.r.h, FALSE);
+	  if (!ResumeUpdates(client))
+	    return FALSE;
+	  rfbClientLog("Got new framebuffer size: %dx%d\n", rect.r.w, rect.r.h);
+	}
+
+	/* ask once, later changes by the server or other clients are kept */
+	if (!client->requestedResize &&
+	    client->appData.desktopWidth > 0 && client->appData.desktopHeight > 0 &&
+	    (rect.r.w != client->appData.desktopWidth || rect.r.h != client->appData.desktopHeight)) {
+	  rfbClientLog("Requesting desktop size %dx%d\n",
+		  client->appData.desktopWidth, client->appData.desktopHeight);
+	  if (!SendExtDesktopSize(client, client->appData.desktopWidth, client->appData.desktopHeight))
+	    return FALSE;
+	}
+	continue;
+      }
+
       if (rect.encoding == rfbEncodingNewFBSize) {
 	client->width = rect.r.w;
 	client->height = rect.r.h;
@@ -1791,6 +2251,8 @@ HandleRFBServerMessage(rfbClient* client)
 	if (!client->MallocFrameBuffer(client))
 	  return FALSE;
 	SendFramebufferUpdateRequest(client, 0, 0, rect.r.w, rect.r.h, FALSE);
+	if (!ResumeUpdates(client))
+	  return FALSE;
 	rfbClientLog("Got new framebuffer size: %dx%d\n", rect.r.w, rect.r.h);
 	continue;
       }
@@ -1879,6 +2341,10 @@ HandleRFBServerMessage(rfbClient* client)
         client->SoftCursorLockArea(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
       }
 
+      timeStart = rfbClientMicroTime();
+      readStart = client->stats.readUsecs;
+      jobsQueued = client->decodeJobsQueued;
+
       switch (rect.encoding) {
 
       case rfbEncodingRaw: {
@@ -1890,6 +2356,25 @@ HandleRFBServerMessage(rfbClient* client)
 	/* Regardless of cause, do not divide by zero. */
 	linesToRead = bytesPerLine ? (RFB_BUFFER_SIZE / bytesPerLine) : 0;
 
+	/* Unless the application converts the pixels in its own GotBitmap, the
+	   data is already in framebuffer format and can be read straight into
+	   place - full width rects in one go, others row by row. */
+	if (client->GotBitmap == CopyRectangle && client->frameBuffer && bytesPerLine) {
+	  int rowStride = client->width * client->format.bitsPerPixel / 8;
+	  char *dst = (char *)client->frameBuffer + y * rowStride +
+		rect.r.x * client->format.bitsPerPixel / 8;
+
+	  if (bytesPerLine == rowStride) {
+	    if (!ReadFromRFBServer(client, dst, bytesPerLine * h))
+	      return FALSE;
+	  } else {
+	    for (; h > 0; h--, dst += rowStride)
+	      if (!ReadFromRFBServer(client, dst, bytesPerLine))
+		return FALSE;
+	  }
+	  break;
+	}
+
 	while (linesToRead && h > 0) {
 	  if (linesToRead > h)
 	    linesToRead = h;
@@ -2109,43 +2594,13 @@ HandleRFBServerMessage(rfbClient* client)
 	client->appData.qualityLevel = 9;
 	/* fall through */
       case rfbEncodingZYWRLE:
-      {
-	switch (client->format.bitsPerPixel) {
-	case 8:
-	  if (!HandleZRLE8(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	    return FALSE;
-	  break;
-	case 16:
-	  if (client->si.format.greenMax > 0x1F) {
-	    if (!HandleZRLE16(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	      return FALSE;
-	  } else {
-	    if (!HandleZRLE15(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	      return FALSE;
-	  }
-	  break;
-	case 32:
-	{
-	  uint32_t maxColor=(client->format.redMax<<client->format.redShift)|
-		(client->format.greenMax<<client->format.greenShift)|
-		(client->format.blueMax<<client->format.blueShift);
-	  if ((client->format.bigEndian && (maxColor&0xff)==0) ||
-	      (!client->format.bigEndian && (maxColor&0xff000000)==0)) {
-	    if (!HandleZRLE24(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	      return FALSE;
-	  } else if (!client->format.bigEndian && (maxColor&0xff)==0) {
-	    if (!HandleZRLE24Up(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	      return FALSE;
-	  } else if (client->format.bigEndian && (maxColor&0xff000000)==0) {
-	    if (!HandleZRLE24Down(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	      return FALSE;
-	  } else if (!HandleZRLE32(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
-	    return FALSE;
-	  break;
-	}
+	if (!client->zrleDecoder) {
+	  rfbClientLog("ZRLE: unsupported bitsPerPixel %d\n", client->format.bitsPerPixel);
+	  return FALSE;
 	}
+	if (!client->zrleDecoder(client, rect.r.x,rect.r.y,rect.r.w,rect.r.h))
+	  return FALSE;
 	break;
-     }
 
 #endif
 
@@ -2170,15 +2625,23 @@ HandleRFBServerMessage(rfbClient* client)
 	 }
       }
 
+      CountRect(client, rect.encoding, rect.r.w * rect.r.h, bytesStart, timeStart, readStart);
+
       /* Now we may discard "soft cursor locks". */
       client->SoftCursorUnlockScreen(client);
 
-      client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
+      /* queued rects are reported once they are decoded */
+      if (client->decodeJobsQueued == jobsQueued)
+	client->GotFrameBufferUpdate(client, rect.r.x, rect.r.y, rect.r.w, rect.r.h);
     }
 
-    if (!SendIncrementalFramebufferUpdateRequest(client))
+    if (!FinishDecodeJobs(client))
       return FALSE;
 
+    /* count the updates after which the server had nothing more on the way */
+    if (client->buffered == 0 && WaitForMessage(client, 0) == 0)
+      client->updatePipelineDry++;
+
     if (client->FinishedFrameBufferUpdate)
       client->FinishedFrameBufferUpdate(client);
 
@@ -2299,6 +2762,8 @@ HandleRFBServerMessage(rfbClient* client)
       return FALSE;
 
     SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    if (!ResumeUpdates(client))
+      return FALSE;
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
@@ -2316,10 +2781,67 @@ HandleRFBServerMessage(rfbClient* client)
     if (!client->MallocFrameBuffer(client))
       return FALSE;
     SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE);
+    if (!ResumeUpdates(client))
+      return FALSE;
     rfbClientLog("Got new framebuffer size: %dx%d\n", client->width, client->height);
     break;
   }
 
+  case rfbEndOfContinuousUpdates:
+  {
+    /* sent once to announce support, and whenever continuous updates end */
+    if (!client->supportsContinuousUpdates) {
+      client->supportsContinuousUpdates = TRUE;
+      SetServer2Client(client, rfbEndOfContinuousUpdates);
+      SetClient2Server(client, rfbEnableContinuousUpdates);
+      rfbClientLog("Enabling continuous updates\n");
+      if (!SendEnableContinuousUpdates(client, TRUE,
+			client->updateRect.x, client->updateRect.y,
+			client->updateRect.w, client->updateRect.h))
+	return FALSE;
+    } else {
+      /* the server stopped sending updates, go back to asking for them */
+      client->continuousUpdates = FALSE;
+      if (!SendIncrementalFramebufferUpdateRequest(client))
+	return FALSE;
+    }
+    break;
+  }
+
+  case rfbFence:
+  {
+    char data[rfbFenceMaxLength];
+
+    if (!ReadFromRFBServer(client, ((char *)&msg) + 1,
+			   sz_rfbFenceMsg - 1))
+      return FALSE;
+
+    msg.f.flags = rfbClientSwap32IfLE(msg.f.flags);
+    if (msg.f.length > rfbFenceMaxLength) {
+      rfbClientErr("Fence payload too large: %d bytes\n", msg.f.length);
+      return FALSE;
+    }
+    if (msg.f.length > 0 && !ReadFromRFBServer(client, data, msg.f.length))
+      return FALSE;
+
+    if (!client->supportsFence) {
+      client->supportsFence = TRUE;
+      SetServer2Client(client, rfbFence);
+      SetClient2Server(client, rfbFence);
+    }
+
+    /* Messages are handled one after the other, so by the time we get here
+       everything sent before the fence has been decoded and drawn. Answering
+       right away thus tells the server how far the decoder has got, which is
+       what it uses to avoid flooding us with continuous updates. */
+    if (msg.f.flags & rfbFenceFlagRequest) {
+      if (!SendFence(client, msg.f.flags & rfbFenceFlagsSupported & ~rfbFenceFlagRequest,
+		     msg.f.length, data))
+	return FALSE;
+    }
+    break;
+  }
+
   default:
     {
       rfbBool handled = FALSE;
@@ -2352,6 +2874,27 @@ HandleRFBServerMessage(rfbClient* client)
 			       ((uint8_t*)&(pix))[2] = *(ptr)++, \
 			       ((uint8_t*)&(pix))[3] = *(ptr)++)
 
+/* With the default GotFillRect/GotBitmap on a 32bpp framebuffer, RRE, CoRRE
+   and Hextile fill straight into the framebuffer. The rect is checked once,
+   subrects only against the rect. */
+
+static rfbBool CanFill32(rfbClient* client, int x, int y, int w, int h)
+{
+  return client->GotFillRect == FillRectangle && client->GotBitmap == CopyRectangle &&
+    client->frameBuffer && client->format.bitsPerPixel == 32 &&
+    x + w <= client->width && y + h <= client->height;
+}
+
+static inline void Fill32(rfbClient* client, int x, int y, int w, int h, uint32_t colour)
+{
+  uint32_t *dst = (uint32_t *)client->frameBuffer + y * client->width + x;
+  int i;
+
+  for (; h > 0; h--, dst += client->width)
+    for (i = 0; i < w; i++)
+      dst[i] = colour;
+}
+
 /* CONCAT2 concatenates its two arguments.  CONCAT2E does the same but also
    expands its arguments if they are macros */
 
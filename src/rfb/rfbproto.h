@@ -401,6 +401,8 @@ typedef struct {
 /* Modif sf@2002 */
 #define rfbResizeFrameBuffer 4
 #define rfbPalmVNCReSizeFrameBuffer 0xF
+/* EndOfContinuousUpdates server -> client message */
+#define rfbEndOfContinuousUpdates 150
 
 /* client -> server */
 
@@ -428,6 +430,10 @@ typedef struct {
 #define rfbXvp 250
 /* SetDesktopSize client -> server message */
 #define rfbSetDesktopSize 251
+/* EnableContinuousUpdates client -> server message */
+#define rfbEnableContinuousUpdates 150
+/* Fence message - bidirectional */
+#define rfbFence 248
 #define rfbQemuEvent 255
 
 
@@ -509,6 +515,8 @@ typedef struct {
 #define rfbEncodingLastRect           0xFFFFFF20
 #define rfbEncodingNewFBSize          0xFFFFFF21
 #define rfbEncodingExtDesktopSize     0xFFFFFECC
+#define rfbEncodingFence              0xFFFFFEC8 /* -312 */
+#define rfbEncodingContinuousUpdates  0xFFFFFEC7 /* -313 */
 
 #define rfbEncodingQualityLevel0   0xFFFFFFE0
 #define rfbEncodingQualityLevel1   0xFFFFFFE1
@@ -1204,6 +1212,62 @@ typedef struct rfbSetDesktopSizeMsg {
 
 #define sz_rfbSetDesktopSizeMsg (8)
 
+/*-----------------------------------------------------------------------------
+ * EnableContinuousUpdates client -> server message
+ *
+ * Once the server has announced support by sending an EndOfContinuousUpdates
+ * message, the client may ask it to send updates for the given area as soon
+ * as they happen instead of waiting for FramebufferUpdateRequests. The server
+ * answers a request to disable with another EndOfContinuousUpdates message.
+ */
+
+typedef struct rfbEnableContinuousUpdatesMsg {
+    uint8_t type;                       /* always rfbEnableContinuousUpdates */
+    uint8_t enable;
+    uint16_t x;
+    uint16_t y;
+    uint16_t w;
+    uint16_t h;
+} rfbEnableContinuousUpdatesMsg;
+
+#define sz_rfbEnableContinuousUpdatesMsg (10)
+
+typedef struct rfbEndOfContinuousUpdatesMsg {
+    uint8_t type;                       /* always rfbEndOfContinuousUpdates */
+} rfbEndOfContinuousUpdatesMsg;
+
+#define sz_rfbEndOfContinuousUpdatesMsg (1)
+
+/*-----------------------------------------------------------------------------
+ * Fence message - bidirectional
+ *
+ * Used to synchronize the message streams of both sides. A fence with the
+ * Request flag set must be answered with the same data and the subset of the
+ * flags the recipient understands. Servers use this to measure how fast the
+ * client actually processes updates when continuous updates are enabled.
+ */
+
+typedef struct rfbFenceMsg {
+    uint8_t type;                       /* always rfbFence */
+    uint8_t pad[3];
+    uint32_t flags;
+    uint8_t length;
+
+    /* Followed by char data[length] */
+} rfbFenceMsg;
+
+#define sz_rfbFenceMsg (9)
+
+#define rfbFenceMaxLength 64
+
+/* flags */
+#define rfbFenceFlagBlockBefore 0x00000001
+#define rfbFenceFlagBlockAfter  0x00000002
+#define rfbFenceFlagSyncNext    0x00000004
+#define rfbFenceFlagRequest     0x80000000
+#define rfbFenceFlagsSupported  (rfbFenceFlagBlockBefore | rfbFenceFlagBlockAfter | \
+                                 rfbFenceFlagSyncNext | rfbFenceFlagRequest)
+
 
 /*-----------------------------------------------------------------------------
  * Modif sf@2002
@@ -1260,6 +1324,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbExtDesktopSizeMsg eds;
+	rfbEndOfContinuousUpdatesMsg eocu;
+	rfbFenceMsg f;
 } rfbServerToClientMsg;
 
 
@@ -1538,6 +1604,8 @@ typedef union {
 	rfbTextChatMsg tc;
 	rfbXvpMsg xvp;
 	rfbSetDesktopSizeMsg sdm;
+	rfbEnableContinuousUpdatesMsg ecu;
+	rfbFenceMsg f;
 } rfbClientToServerMsg;
 
 /* 
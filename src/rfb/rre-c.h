@@ -47,6 +47,37 @@ HandleRREBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 
   client->GotFillRect(client, rx, ry, rw, rh, pix);
 
+#if BPP==32
+  if (CanFill32(client, rx, ry, rw, rh)) {
+    const uint8_t *ptr;
+    uint32_t n;
+    int x, y, w, h;
+
+    /* parse the subrects from the receive buffer in large chunks */
+    for (; hdr.nSubrects > 0; hdr.nSubrects -= n) {
+      n = hdr.nSubrects;
+      if (n > RFB_BUF_SIZE / (4 + sz_rfbRectangle))
+	n = RFB_BUF_SIZE / (4 + sz_rfbRectangle);
+      if (!(ptr = (const uint8_t *)PeekFromRFBServer(client, n * (4 + sz_rfbRectangle))))
+	return FALSE;
+
+      for (i = 0; i < n; i++, ptr += 4 + sz_rfbRectangle) {
+	memcpy(&pix, ptr, 4);
+	x = (ptr[4] << 8) | ptr[5];
+	y = (ptr[6] << 8) | ptr[7];
+	w = (ptr[8] << 8) | ptr[9];
+	h = (ptr[10] << 8) | ptr[11];
+	if (x + w <= rw && y + h <= rh)
+	  Fill32(client, rx+x, ry+y, w, h, pix);
+	else
+	  client->GotFillRect(client, rx+x, ry+y, w, h, pix);
+      }
+      ConsumeFromRFBServer(client, n * (4 + sz_rfbRectangle));
+    }
+    return TRUE;
+  }
+#endif
+
   for (i = 0; i < hdr.nSubrects; i++) {
     if (!ReadFromRFBServer(client, (char *)&pix, sizeof(pix)))
       return FALSE;
@@ -45,6 +45,251 @@ void PrintInHex(char *buf, int len);
 
 rfbBool errorMessageOnReadFailure = TRUE;
 
+/* socket receive buffer we ask for, smaller ones are tried if refused */
+#define RFB_SOCKET_BUFFER_SIZE (256*1024)
+
+/*
+ * vncrec files store the timestamps as two 32 bit big endian words, seconds
+ * and microseconds, whatever size struct timeval has on the machine.
+ */
+
+static rfbBool
+ReadVNCRecTimestamp(FILE* file, struct timeval *tv)
+{
+  uint32_t t[2];
+
+  if (fread(t,sizeof(t),1,file) != 1)
+    return FALSE;
+  tv->tv_sec = ntohl(t[0]);
+  tv->tv_usec = ntohl(t[1]);
+  return TRUE;
+}
+
+static rfbBool
+WriteVNCRecTimestamp(FILE* file)
+{
+  struct timeval tv;
+  uint32_t t[2];
+
+  gettimeofday(&tv,NULL);
+  t[0] = htonl((uint32_t)tv.tv_sec);
+  t[1] = htonl((uint32_t)tv.tv_usec);
+  return fwrite(t,sizeof(t),1,file) == 1;
+}
+
+/*
+ * ReadFromVNCRec reads the next n bytes of a vncrec file being played back,
+ * preceded by the timestamp if a new message starts.
+ */
+
+static rfbBool
+ReadFromVNCRec(rfbClient* client, char *out, unsigned int n)
+{
+  rfbVNCRec* rec = client->vncRec;
+  struct timeval tv;
+
+  if (rec->readTimestamp) {
+    rec->readTimestamp = FALSE;
+    if (!ReadVNCRecTimestamp(rec->file, &tv))
+      return FALSE;
+
+    if (rec->tv.tv_sec!=0 && !rec->doNotSleep) {
+      struct timeval diff;
+      diff.tv_sec = tv.tv_sec - rec->tv.tv_sec;
+      diff.tv_usec = tv.tv_usec - rec->tv.tv_usec;
+      if(diff.tv_usec<0) {
+	diff.tv_sec--;
+	diff.tv_usec+=1000000;
+      }
+#ifndef WIN32
+      sleep (diff.tv_sec);
+      usleep (diff.tv_usec);
+#else
+      Sleep (diff.tv_sec * 1000 + diff.tv_usec/1000);
+#endif
+    }
+
+    rec->tv=tv;
+  }
+
+  return (fread(out,1,n,rec->file) != n ? FALSE : TRUE);
+}
+
+
+uint64_t
+rfbClientMicroTime(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv,NULL);
+  return tv.tv_sec*(uint64_t)1000000+tv.tv_usec;
+}
+
+
+/*
+ * StartVNCRecord creates client->recordFile for recording the session.
+ * ConsumedRFBData counts the data handed to the decoders and appends it to
+ * the recording. Recording what is consumed rather than what read() returns
+ * keeps every timestamp in front of the message it belongs to. A failing
+ * recording is stopped, but does not end the connection.
+ */
+
+rfbBool
+StartVNCRecord(rfbClient* client)
+{
+  const char* magic="vncLog0.0";
+
+  client->vncRecord = fopen(client->recordFile,"wb");
+  if (!client->vncRecord) {
+    rfbClientLog("Could not create %s.\n",client->recordFile);
+    return FALSE;
+  }
+  /* few large writes, the SD card is slow with small ones */
+  setvbuf(client->vncRecord,NULL,_IOFBF,RFB_BUF_SIZE);
+  if (fwrite(magic,1,strlen(magic),client->vncRecord) != strlen(magic)) {
+    rfbClientLog("Writing to %s failed.\n",client->recordFile);
+    fclose(client->vncRecord);
+    client->vncRecord = NULL;
+    return FALSE;
+  }
+  client->recordTimestamp = FALSE;
+  rfbClientLog("Recording to %s\n",client->recordFile);
+  return TRUE;
+}
+
+static void
+ConsumedRFBData(rfbClient* client, const char *data, unsigned int n)
+{
+  client->stats.bytesReceived += n;
+  if (!client->vncRecord || n == 0)
+    return;
+  if (client->recordTimestamp) {
+    client->recordTimestamp = FALSE;
+    if (!WriteVNCRecTimestamp(client->vncRecord))
+      goto failed;
+  }
+  if (fwrite(data,1,n,client->vncRecord) == n)
+    return;
+failed:
+  rfbClientLog("Writing to %s failed, recording stopped.\n",client->recordFile);
+  fclose(client->vncRecord);
+  client->vncRecord = NULL;
+}
+
+/*
+ * WaitForSocket waits until the socket is readable, regardless of what is
+ * already buffered; a read that would block has to wait for new data.
+ */
+
+static int WaitForSocket(rfbClient* client,unsigned int usecs)
+{
+  fd_set fds;
+  struct timeval timeout;
+  int num;
+
+  timeout.tv_sec=(usecs/1000000);
+  timeout.tv_usec=(usecs%1000000);
+
+  FD_ZERO(&fds);
+  FD_SET(client->sock,&fds);
+
+  num=select(client->sock+1, &fds, NULL, NULL, &timeout);
+  if(num<0) {
+#ifdef WIN32
+    errno=WSAGetLastError();
+#endif
+    rfbClientLog("Waiting for message failed: %d (%s)\n",errno,strerror(errno));
+  }
+
+  return num;
+}
+
+/*
+ * FillRFBBuffer makes sure that at least n (<= RFB_BUF_SIZE) bytes of server
+ * data are waiting in client->buf, in one piece starting at client->bufoutptr.
+ * Every read() asks for all the free space in the buffer, so that a single
+ * system call usually fetches many small messages or a large part of a rect.
+ */
+
+static rfbBool
+FillRFBBuffer(rfbClient* client, unsigned int n)
+{
+  const int USECS_WAIT_PER_RETRY = 100000;
+  int retries = 0;
+
+  if (n <= client->buffered)
+    return TRUE;
+
+  /* make room at the end, the data left over is usually just a few bytes */
+  if (client->buffered == 0)
+    client->bufoutptr = client->buf;
+  else if (client->bufoutptr + n > client->buf + RFB_BUF_SIZE) {
+    memmove(client->buf, client->bufoutptr, client->buffered);
+    client->bufoutptr = client->buf;
+  }
+
+  if (client->serverPort==-1) {
+    /* vncrec playing - never read ahead, the file interleaves timestamps */
+    if (!ReadFromVNCRec(client, client->bufoutptr + client->buffered, n - client->buffered))
+      return FALSE;
+    client->buffered = n;
+    return TRUE;
+  }
+
+  while (client->buffered < n) {
+    char *end = client->bufoutptr + client->buffered;
+    unsigned int space = client->buf + RFB_BUF_SIZE - end;
+    uint64_t start = rfbClientMicroTime();
+    int i;
+    if (client->tlsSession)
+      i = ReadFromTLS(client, end, space);
+    else
+#ifdef LIBVNCSERVER_HAVE_SASL
+    if (client->saslconn)
+      i = ReadFromSASL(client, end, space);
+    else {
+#endif /* LIBVNCSERVER_HAVE_SASL */
+      i = read(client->sock, end, space);
+#ifdef WIN32
+      if (i < 0) errno=WSAGetLastError();
+#endif
+#ifdef LIBVNCSERVER_HAVE_SASL
+    }
+#endif
+
+    if (i <= 0) {
+      if (i < 0) {
+	if (errno == EWOULDBLOCK || errno == EAGAIN) {
+	  if (client->readTimeout > 0 &&
+	      ++retries > (client->readTimeout * 1000 * 1000 / USECS_WAIT_PER_RETRY))
+	  {
+	    rfbClientLog("Connection timed out\n");
+	    return FALSE;
+	  }
+	  /* TODO:
+	     ProcessXtEvents();
+	  */
+	  WaitForSocket(client, USECS_WAIT_PER_RETRY);
+	  i = 0;
+	} else {
+	  rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
+	  return FALSE;
+	}
+      } else {
+	if (errorMessageOnReadFailure) {
+	  rfbClientLog("VNC server closed connection\n");
+	}
+	return FALSE;
+      }
+    }
+    client->buffered += i;
+    client->stats.readUsecs += rfbClientMicroTime() - start;
+  }
+
+  return TRUE;
+}
+
+
 /*
  * ReadFromRFBServer is called whenever we want to read some data from the RFB
  * server.  It is non-trivial for two reasons:
@@ -57,6 +302,9 @@ rfbBool errorMessageOnReadFailure = TRUE;
  * 2. Whenever read() would block, it invokes the Xt event dispatching
  *    mechanism to process X events.  In fact, this is the only place these
  *    events are processed, as there is no XtAppMainLoop in the program.
+ *
+ * Decoders which can work on the data in place should rather use
+ * PeekFromRFBServer() or BorrowFromRFBServer(), which save the copy.
  */
 
 rfbBool
@@ -64,6 +312,8 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 {
   const int USECS_WAIT_PER_RETRY = 100000;
   int retries = 0;
+  char *rout;
+  unsigned int rn;
 #undef DEBUG_READ_EXACT
 #ifdef DEBUG_READ_EXACT
 	char* oout=out;
@@ -77,45 +327,22 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
   if(!out)
     return FALSE;
 
-  if (client->serverPort==-1) {
-    /* vncrec playing */
-    rfbVNCRec* rec = client->vncRec;
-    struct timeval tv;
-
-    if (rec->readTimestamp) {
-      rec->readTimestamp = FALSE;
-      if (!fread(&tv,sizeof(struct timeval),1,rec->file))
-        return FALSE;
-
-      tv.tv_sec = rfbClientSwap32IfLE (tv.tv_sec);
-      tv.tv_usec = rfbClientSwap32IfLE (tv.tv_usec);
-
-      if (rec->tv.tv_sec!=0 && !rec->doNotSleep) {
-        struct timeval diff;
-        diff.tv_sec = tv.tv_sec - rec->tv.tv_sec;
-        diff.tv_usec = tv.tv_usec - rec->tv.tv_usec;
-        if(diff.tv_usec<0) {
-	  diff.tv_sec--;
-	  diff.tv_usec+=1000000;
-        }
-#ifndef WIN32
-        sleep (diff.tv_sec);
-        usleep (diff.tv_usec);
-#else
-	Sleep (diff.tv_sec * 1000 + diff.tv_usec/1000);
-#endif
-      }
+  rout = out;
+  rn = n;
 
-      rec->tv=tv;
-    }
-    
-    return (fread(out,1,n,rec->file) != n ? FALSE : TRUE);
+  if (client->serverPort==-1 && client->buffered == 0) {
+    /* vncrec playing */
+    if (!ReadFromVNCRec(client, out, n))
+      return FALSE;
+    client->stats.bytesReceived += n;
+    return TRUE;
   }
   
   if (n <= client->buffered) {
     memcpy(out, client->bufoutptr, n);
     client->bufoutptr += n;
     client->buffered -= n;
+    ConsumedRFBData(client, rout, rn);
 #ifdef DEBUG_READ_EXACT
     goto hexdump;
 #endif
@@ -132,59 +359,22 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 
   if (n <= RFB_BUF_SIZE) {
 
-    while (client->buffered < n) {
-      int i;
-      if (client->tlsSession)
-        i = ReadFromTLS(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
-      else
-#ifdef LIBVNCSERVER_HAVE_SASL
-      if (client->saslconn)
-        i = ReadFromSASL(client, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
-      else {
-#endif /* LIBVNCSERVER_HAVE_SASL */
-        i = read(client->sock, client->buf + client->buffered, RFB_BUF_SIZE - client->buffered);
-#ifdef WIN32
-	if (i < 0) errno=WSAGetLastError();
-#endif
-#ifdef LIBVNCSERVER_HAVE_SASL
-      }
-#endif
-  
-      if (i <= 0) {
-	if (i < 0) {
-	  if (errno == EWOULDBLOCK || errno == EAGAIN) {
-	    if (client->readTimeout > 0 &&
-		++retries > (client->readTimeout * 1000 * 1000 / USECS_WAIT_PER_RETRY))
-	    {
-	      rfbClientLog("Connection timed out\n");
-	      return FALSE;
-	    }
-	    /* TODO:
-	       ProcessXtEvents();
-	    */
-	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
-	    i = 0;
-	  } else {
-	    rfbClientErr("read (%d: %s)\n",errno,strerror(errno));
-	    return FALSE;
-	  }
-	} else {
-	  if (errorMessageOnReadFailure) {
-	    rfbClientLog("VNC server closed connection\n");
-	  }
-	  return FALSE;
-	}
-      }
-      client->buffered += i;
-    }
+    if (!FillRFBBuffer(client, n))
+      return FALSE;
 
     memcpy(out, client->bufoutptr, n);
     client->bufoutptr += n;
     client->buffered -= n;
 
+  } else if (client->serverPort==-1) {
+
+    if (!ReadFromVNCRec(client, out, n))
+      return FALSE;
+
   } else {
 
     while (n > 0) {
+      uint64_t start = rfbClientMicroTime();
       int i;
       if (client->tlsSession)
         i = ReadFromTLS(client, out, n);
@@ -211,7 +401,7 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
 	    /* TODO:
 	       ProcessXtEvents();
 	    */
-	    WaitForMessage(client, USECS_WAIT_PER_RETRY);
+	    WaitForSocket(client, USECS_WAIT_PER_RETRY);
 	    i = 0;
 	  } else {
 	    rfbClientErr("read (%s)\n",strerror(errno));
@@ -226,9 +416,12 @@ ReadFromRFBServer(rfbClient* client, char *out, unsigned int n)
       }
       out += i;
       n -= i;
+      client->stats.readUsecs += rfbClientMicroTime() - start;
     }
   }
 
+  ConsumedRFBData(client, rout, rn);
+
 #ifdef DEBUG_READ_EXACT
 hexdump:
   { unsigned int ii;
@@ -242,12 +435,72 @@ hexdump:
 }
 
 
+/*
+ * PeekFromRFBServer returns a pointer to the next n (<= RFB_BUF_SIZE) bytes
+ * from the server without consuming them, or NULL on error. The pointer stays
+ * valid until data is read from the server again. Use ConsumeFromRFBServer()
+ * to skip the data once done with it.
+ */
+
+const char*
+PeekFromRFBServer(rfbClient* client, unsigned int n)
+{
+  if (n > RFB_BUF_SIZE || !FillRFBBuffer(client, n))
+    return NULL;
+  return client->bufoutptr;
+}
+
+void
+ConsumeFromRFBServer(rfbClient* client, unsigned int n)
+{
+  if (n > client->buffered)
+    n = client->buffered;
+  ConsumedRFBData(client, client->bufoutptr, n);
+  client->bufoutptr += n;
+  client->buffered -= n;
+}
+
+
+/*
+ * BorrowFromRFBServer returns a pointer to between 1 and max bytes from the
+ * server, as many as are available without waiting, and stores their number
+ * in *len. The data counts as read, the pointer stays valid until data is
+ * read from the server again. Returns NULL on error.
+ */
+
+const char*
+BorrowFromRFBServer(rfbClient* client, unsigned int max, unsigned int *len)
+{
+  const char *p;
+
+  if (max == 0) {
+    *len = 0;
+    return client->bufoutptr;
+  }
+  if (client->buffered == 0) {
+    /* when playing back a vncrec file, only read what was asked for */
+    unsigned int n = 1;
+    if (client->serverPort==-1)
+      n = max < RFB_BUF_SIZE ? max : RFB_BUF_SIZE;
+    if (!FillRFBBuffer(client, n))
+      return NULL;
+  }
+
+  *len = max < client->buffered ? max : client->buffered;
+  p = client->bufoutptr;
+  ConsumedRFBData(client, p, *len);
+  client->bufoutptr += *len;
+  client->buffered -= *len;
+  return p;
+}
+
+
 /*
  * Write an exact number of bytes, and don't return until you've sent them.
  */
 
-rfbBool
-WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
+static rfbBool
+WriteToRFBServerUnlocked(rfbClient* client, const char *buf, unsigned int n)
 {
   fd_set fds;
   int i = 0;
@@ -319,6 +572,19 @@ WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
 }
 
 
+rfbBool
+WriteToRFBServer(rfbClient* client, const char *buf, unsigned int n)
+{
+  rfbBool result;
+
+  if (client->LockWriteToServer)
+    client->LockWriteToServer(client);
+  result = WriteToRFBServerUnlocked(client, buf, n);
+  if (client->UnlockWriteToServer)
+    client->UnlockWriteToServer(client);
+  return result;
+}
+
 static rfbBool WaitForConnected(int socket, unsigned int secs)
 {
   fd_set writefds;
@@ -350,6 +616,22 @@ static rfbBool WaitForConnected(int socket, unsigned int secs)
 }
 
 
+/*
+ * SetReceiveBufferSize enlarges the socket receive buffer, so that the server
+ * can keep sending while we are busy decoding. If the system refuses the
+ * size, it is halved until accepted. Has to be called before connect() for
+ * the TCP window to benefit.
+ */
+
+static void
+SetReceiveBufferSize(rfbSocket sock, int size)
+{
+  for (; size > RFB_BUF_SIZE; size /= 2)
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char *)&size, sizeof(size)) == 0)
+      return;
+}
+
+
 rfbSocket
 ConnectClientToTcpAddr(unsigned int host, int port)
 {
@@ -381,6 +663,8 @@ ConnectClientToTcpAddrWithTimeout(unsigned int host, int port, unsigned int time
     return RFB_INVALID_SOCKET;
   }
 
+  SetReceiveBufferSize(sock, RFB_SOCKET_BUFFER_SIZE);
+
   if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 #ifdef WIN32
     errno=WSAGetLastError();
@@ -444,6 +728,7 @@ ConnectClientToTcpAddr6WithTimeout(const char *hostname, int port, unsigned int
     sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
     if (sock != RFB_INVALID_SOCKET)
     {
+      SetReceiveBufferSize(sock, RFB_SOCKET_BUFFER_SIZE);
       if (SetNonBlocking(sock)) {
         if (connect(sock, res->ai_addr, res->ai_addrlen) == 0) {
           break;
@@ -901,29 +1186,15 @@ PrintInHex(char *buf, int len)
 
 int WaitForMessage(rfbClient* client,unsigned int usecs)
 {
-  fd_set fds;
-  struct timeval timeout;
-  int num;
-
   if (client->serverPort==-1)
     /* playing back vncrec file */
     return 1;
-  
-  timeout.tv_sec=(usecs/1000000);
-  timeout.tv_usec=(usecs%1000000);
 
-  FD_ZERO(&fds);
-  FD_SET(client->sock,&fds);
-
-  num=select(client->sock+1, &fds, NULL, NULL, &timeout);
-  if(num<0) {
-#ifdef WIN32
-    errno=WSAGetLastError();
-#endif
-    rfbClientLog("Waiting for message failed: %d (%s)\n",errno,strerror(errno));
-  }
+  /* the last read may have fetched more than one message */
+  if (client->buffered > 0)
+    return 1;
 
-  return num;
+  return WaitForSocket(client, usecs);
 }
 
 
@@ -38,18 +38,22 @@
 #define TIGHT_MIN_TO_COMPRESS 12
 
 #define CARDBPP CONCAT3E(uint,BPP,_t)
-#define filterPtrBPP CONCAT2E(filterPtr,BPP)
 
 #define HandleTightBPP CONCAT2E(HandleTight,BPP)
 #define InitFilterCopyBPP CONCAT2E(InitFilterCopy,BPP)
 #define InitFilterPaletteBPP CONCAT2E(InitFilterPalette,BPP)
 #define InitFilterGradientBPP CONCAT2E(InitFilterGradient,BPP)
+#define FilterBPP CONCAT2E(Filter,BPP)
 #define FilterCopyBPP CONCAT2E(FilterCopy,BPP)
 #define FilterPaletteBPP CONCAT2E(FilterPalette,BPP)
 #define FilterGradientBPP CONCAT2E(FilterGradient,BPP)
+#define InflateRowsBPP CONCAT2E(InflateRows,BPP)
+#define DecodeTightJobBPP CONCAT2E(DecodeTightJob,BPP)
 
 #if BPP != 8
 #define DecompressJpegRectBPP CONCAT2E(DecompressJpegRect,BPP)
+#define DecodeJpegBPP CONCAT2E(DecodeJpeg,BPP)
+#define DecodeJpegJobBPP CONCAT2E(DecodeJpegJob,BPP)
 #endif
 
 #ifndef RGB_TO_PIXEL
@@ -59,40 +63,36 @@
    ((CARD##bpp)(g) & client->format.greenMax) << client->format.greenShift |	\
    ((CARD##bpp)(b) & client->format.blueMax) << client->format.blueShift)
 
-#define RGB24_TO_PIXEL(bpp,r,g,b)                                       \
-   ((((CARD##bpp)(r) & 0xFF) * client->format.redMax + 127) / 255             \
-    << client->format.redShift |                                              \
-    (((CARD##bpp)(g) & 0xFF) * client->format.greenMax + 127) / 255           \
-    << client->format.greenShift |                                            \
-    (((CARD##bpp)(b) & 0xFF) * client->format.blueMax + 127) / 255            \
-    << client->format.blueShift)
-
-#define RGB24_TO_PIXEL32(r,g,b)						\
-  (((uint32_t)(r) & 0xFF) << client->format.redShift |				\
-   ((uint32_t)(g) & 0xFF) << client->format.greenShift |			\
-   ((uint32_t)(b) & 0xFF) << client->format.blueShift)
-
 #endif
 
-/* Type declarations */
-
-typedef void (*filterPtrBPP)(rfbClient* client, int, int, int);
-
 /* Prototypes */
 
-static int InitFilterCopyBPP (rfbClient* client, int rw, int rh);
-static int InitFilterPaletteBPP (rfbClient* client, int rw, int rh);
-static int InitFilterGradientBPP (rfbClient* client, int rw, int rh);
-static void FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows);
-static void FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows);
-static void FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows);
+static int InitFilterCopyBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh);
+static int InitFilterPaletteBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh);
+static int InitFilterGradientBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh);
+static void FilterBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcy, int numRows);
+static void FilterCopyBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows);
+static void FilterPaletteBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows);
+static void FilterGradientBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows);
+static rfbBool InflateRowsBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch,
+			       const char *data, unsigned int length, int *extraBytes, int *rowsProcessed);
+static rfbBool DecodeTightJobBPP (rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch);
 
 #if BPP != 8
 static rfbBool DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h);
+static rfbBool DecodeJpegBPP(rfbClient* client, const uint8_t *compressedData, int compressedLen,
+			     int x, int y, int w, int h, void **tjhnd, char *buffer);
+static rfbBool DecodeJpegJobBPP(rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch);
 #endif
 
 /* Definitions */
 
+/*
+ * The rect's filter state is kept in a decode job. It is either decoded
+ * right here with the client's buffers, or, if the application decodes in
+ * other threads, copied into a queued job together with the compressed data.
+ */
+
 static rfbBool
 HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 {
@@ -100,10 +100,13 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   CARDBPP fill_colour;
   uint8_t comp_ctl;
   uint8_t filter_id;
-  filterPtrBPP filterFn;
+  rfbDecodeJob rect, *job;
+  rfbDecodeScratch scratch;
   z_streamp zs;
   int err, stream_id, compressedLen, bitsPixel;
-  int bufferSize, rowSize, numRows, portionLen, rowsProcessed, extraBytes;
+  int bufferSize, rowSize, rowsProcessed, extraBytes;
+  unsigned int portionLen;
+  const char *portion;
   rfbBool readUncompressed = FALSE;
 
   if (client->frameBuffer == NULL)
@@ -114,9 +117,18 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     return FALSE;
   }
 
+  /* Whatever this rect turns out to be, it must not be overwritten by a
+     queued one it overlaps. */
+  if (!FinishOverlappingDecodeJobs(client, rx, ry, rw, rh))
+    return FALSE;
+
   if (!ReadFromRFBServer(client, (char *)&comp_ctl, 1))
     return FALSE;
 
+  /* Queued rects might still use the streams to be flushed. */
+  if ((comp_ctl & 0x0F) && !FinishDecodeJobs(client))
+    return FALSE;
+
   /* Flush zlib streams if we are told by the server to do so. */
   for (stream_id = 0; stream_id < 4; stream_id++) {
     if ((comp_ctl & 1) && client->zlibStreamActive[stream_id]) {
@@ -140,7 +152,7 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
 	client->format.greenMax == 0xFF && client->format.blueMax == 0xFF) {
       if (!ReadFromRFBServer(client, client->buffer, 3))
 	return FALSE;
-      fill_colour = RGB24_TO_PIXEL32(client->buffer[0], client->buffer[1], client->buffer[2]);
+      fill_colour = pixconv_rgb24_pixel(&client->pixconv, client->buffer[0], client->buffer[1], client->buffer[2]);
     } else {
       if (!ReadFromRFBServer(client, (char*)&fill_colour, sizeof(fill_colour)))
 	return FALSE;
@@ -177,44 +189,55 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
    * Data was processed with optional filter + zlib compression.
    */
 
+  memset(&rect, 0, sizeof(rect));
+  rect.x = rx;
+  rect.y = ry;
+  rect.w = rw;
+  rect.h = rh;
+  rect.stream = -1;
+
   /* First, we should identify a filter to use. */
   if ((comp_ctl & rfbTightExplicitFilter) != 0) {
     if (!ReadFromRFBServer(client, (char*)&filter_id, 1))
       return FALSE;
 
+    rect.filter = filter_id;
     switch (filter_id) {
     case rfbTightFilterCopy:
-      filterFn = FilterCopyBPP;
-      bitsPixel = InitFilterCopyBPP(client, rw, rh);
+      bitsPixel = InitFilterCopyBPP(client, &rect, rw, rh);
       break;
     case rfbTightFilterPalette:
-      filterFn = FilterPaletteBPP;
-      bitsPixel = InitFilterPaletteBPP(client, rw, rh);
+      bitsPixel = InitFilterPaletteBPP(client, &rect, rw, rh);
       break;
     case rfbTightFilterGradient:
-      filterFn = FilterGradientBPP;
-      bitsPixel = InitFilterGradientBPP(client, rw, rh);
+      bitsPixel = InitFilterGradientBPP(client, &rect, rw, rh);
       break;
     default:
       rfbClientLog("Tight encoding: unknown filter code received.\n");
       return FALSE;
     }
   } else {
-    filterFn = FilterCopyBPP;
-    bitsPixel = InitFilterCopyBPP(client, rw, rh);
+    rect.filter = rfbTightFilterCopy;
+    bitsPixel = InitFilterCopyBPP(client, &rect, rw, rh);
   }
   if (bitsPixel == 0) {
     rfbClientLog("Tight encoding: error receiving palette.\n");
     return FALSE;
   }
 
+  scratch.buffer = client->buffer;
+  scratch.prevRow = client->tightPrevRow;
+  scratch.tjhnd = NULL;
+
   /* Determine if the data should be decompressed or just copied. */
   rowSize = (rw * bitsPixel + 7) / 8;
+  rect.bitsPixel = bitsPixel;
+  rect.rowSize = rowSize;
   if (rh * rowSize < TIGHT_MIN_TO_COMPRESS) {
     if (!ReadFromRFBServer(client, (char*)client->buffer, rh * rowSize))
       return FALSE;
 
-    filterFn(client, rx, ry, rh);
+    FilterBPP(client, &rect, &scratch, ry, rh);
 
     return TRUE;
   }
@@ -229,13 +252,15 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     if (!ReadFromRFBServer(client, (char*)client->buffer, compressedLen))
       return FALSE;
 
-    filterFn(client, rx, ry, rh);
+    FilterBPP(client, &rect, &scratch, ry, rh);
 
     return TRUE;
   }
 
-  /* Now let's initialize compression stream if needed. */
+  /* Now let's initialize compression stream if needed. No job can be using
+     a stream which is not active yet. */
   stream_id = comp_ctl & 0x03;
+  rect.stream = stream_id;
   zs = &client->zlibStream[stream_id];
   if (!client->zlibStreamActive[stream_id]) {
     zs->zalloc = Z_NULL;
@@ -250,8 +275,6 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     client->zlibStreamActive[stream_id] = TRUE;
   }
 
-  /* Read, decode and draw actual pixel data in a loop. */
-
   bufferSize = RFB_BUFFER_SIZE * bitsPixel / (bitsPixel + BPP) & 0xFFFFFFFC;
   if (rowSize > bufferSize) {
     /* Should be impossible when RFB_BUFFER_SIZE >= 16384 */
@@ -259,53 +282,102 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
     return FALSE;
   }
 
+  if (client->QueueDecodeJob) {
+    if ((job = NewDecodeJob(client, &rect, compressedLen)) == NULL)
+      return FALSE;
+    if (!ReadFromRFBServer(client, (char *)job->data, compressedLen)) {
+      free(job);
+      return FALSE;
+    }
+    job->decode = DecodeTightJobBPP;
+    return QueueJob(client, job);
+  }
+
+  /* Read, decode and draw actual pixel data in a loop. */
+
   rowsProcessed = 0;
   extraBytes = 0;
 
   while (compressedLen > 0) {
-    if (compressedLen > ZLIB_BUFFER_SIZE)
-      portionLen = ZLIB_BUFFER_SIZE;
-    else
-      portionLen = compressedLen;
-
-    if (!ReadFromRFBServer(client, (char*)client->zlib_buffer, portionLen))
+    /* Inflate straight out of the receive buffer. */
+    if (!(portion = BorrowFromRFBServer(client, compressedLen, &portionLen)))
       return FALSE;
 
     compressedLen -= portionLen;
 
-    zs->next_in = (Bytef *)client->zlib_buffer;
-    zs->avail_in = portionLen;
-
-    do {
-      zs->next_out = (Bytef *)&client->buffer[extraBytes];
-      zs->avail_out = bufferSize - extraBytes;
-
-      err = inflate(zs, Z_SYNC_FLUSH);
-      if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
-	break;
-      if (err != Z_OK && err != Z_STREAM_END) {
-	if (zs->msg != NULL) {
-	  rfbClientLog("Inflate error: %s.\n", zs->msg);
-	} else {
-	  rfbClientLog("Inflate error: %d.\n", err);
-	}
-	return FALSE;
-      }
+    if (!InflateRowsBPP(client, &rect, &scratch, portion, portionLen, &extraBytes, &rowsProcessed))
+      return FALSE;
+  }
+
+  if (rowsProcessed != rh) {
+    rfbClientLog("Incorrect number of scan lines after decompression.\n");
+    return FALSE;
+  }
 
-      numRows = (bufferSize - zs->avail_out) / rowSize;
+  return TRUE;
+}
 
-      filterFn(client, rx, ry+rowsProcessed, numRows);
+/*
+ * Inflate the next portion of a rect's data on its zlib stream, filtering
+ * the rows as they are completed.
+ */
+
+static rfbBool
+InflateRowsBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch,
+		const char *data, unsigned int length, int *extraBytes, int *rowsProcessed)
+{
+  z_streamp zs = &client->zlibStream[rect->stream];
+  int bufferSize = RFB_BUFFER_SIZE * rect->bitsPixel / (rect->bitsPixel + BPP) & 0xFFFFFFFC;
+  int err, numRows;
 
-      extraBytes = bufferSize - zs->avail_out - numRows * rowSize;
-      if (extraBytes > 0) {
-	memcpy(client->buffer, &client->buffer[numRows * rowSize], extraBytes);
+  zs->next_in = (Bytef *)data;
+  zs->avail_in = length;
+
+  do {
+    zs->next_out = (Bytef *)&scratch->buffer[*extraBytes];
+    zs->avail_out = bufferSize - *extraBytes;
+
+    err = inflate(zs, Z_SYNC_FLUSH);
+    if (err == Z_BUF_ERROR)   /* Input exhausted -- no problem. */
+      break;
+    if (err != Z_OK && err != Z_STREAM_END) {
+      if (zs->msg != NULL) {
+	rfbClientLog("Inflate error: %s.\n", zs->msg);
+      } else {
+	rfbClientLog("Inflate error: %d.\n", err);
       }
-      rowsProcessed += numRows;
+      return FALSE;
+    }
+
+    numRows = (bufferSize - zs->avail_out) / rect->rowSize;
+    if (*rowsProcessed + numRows > rect->h) {
+      rfbClientLog("Incorrect number of scan lines after decompression.\n");
+      return FALSE;
     }
-    while (zs->avail_out == 0);
+
+    FilterBPP(client, rect, scratch, rect->y + *rowsProcessed, numRows);
+
+    *extraBytes = bufferSize - zs->avail_out - numRows * rect->rowSize;
+    if (*extraBytes > 0) {
+      memcpy(scratch->buffer, &scratch->buffer[numRows * rect->rowSize], *extraBytes);
+    }
+    *rowsProcessed += numRows;
   }
+  while (zs->avail_out == 0);
 
-  if (rowsProcessed != rh) {
+  return TRUE;
+}
+
+static rfbBool
+DecodeTightJobBPP (rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch)
+{
+  int rowsProcessed = 0, extraBytes = 0;
+
+  if (!InflateRowsBPP(client, job, scratch, (const char *)job->data, job->length,
+		      &extraBytes, &rowsProcessed))
+    return FALSE;
+
+  if (rowsProcessed != job->h) {
     rfbClientLog("Incorrect number of scan lines after decompression.\n");
     return FALSE;
   }
@@ -319,18 +391,34 @@ HandleTightBPP (rfbClient* client, int rx, int ry, int rw, int rh)
  *
  */
 
+static void
+FilterBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcy, int numRows)
+{
+  switch (rect->filter) {
+  case rfbTightFilterPalette:
+    FilterPaletteBPP(client, rect, scratch, rect->x, srcy, numRows);
+    break;
+  case rfbTightFilterGradient:
+    FilterGradientBPP(client, rect, scratch, rect->x, srcy, numRows);
+    break;
+  default:
+    FilterCopyBPP(client, rect, scratch, rect->x, srcy, numRows);
+    break;
+  }
+}
+
 static int
-InitFilterCopyBPP (rfbClient* client, int rw, int rh)
+InitFilterCopyBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh)
 {
-  client->rectWidth = rw;
+  rect->w = rw;
 
 #if BPP == 32
   if (client->format.depth == 24 && client->format.redMax == 0xFF &&
       client->format.greenMax == 0xFF && client->format.blueMax == 0xFF) {
-    client->cutZeros = TRUE;
+    rect->cutZeros = TRUE;
     return 24;
   } else {
-    client->cutZeros = FALSE;
+    rect->cutZeros = FALSE;
   }
 #endif
 
@@ -338,23 +426,17 @@ InitFilterCopyBPP (rfbClient* client, int rw, int rh)
 }
 
 static void
-FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
+FilterCopyBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
   int y;
 
 #if BPP == 32
-  int x;
-
-  if (client->cutZeros) {
+  if (rect->cutZeros) {
     for (y = 0; y < numRows; y++) {
-      for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] =
-	  RGB24_TO_PIXEL32(client->buffer[(y*client->rectWidth+x)*3],
-			   client->buffer[(y*client->rectWidth+x)*3+1],
-			   client->buffer[(y*client->rectWidth+x)*3+2]);
-      }
+      pixconv_rgb24(&client->pixconv, &dst[y*client->width],
+		    (uint8_t *)&scratch->buffer[y * rect->w * 3], rect->w);
     }
     return;
   }
@@ -362,29 +444,23 @@ FilterCopyBPP (rfbClient* client, int srcx, int srcy, int numRows)
 
   for (y = 0; y < numRows; y++) {
     memcpy (&dst[y*client->width],
-            &client->buffer[y * client->rectWidth * (BPP / 8)],
-            client->rectWidth * (BPP / 8));
+            &scratch->buffer[y * rect->w * (BPP / 8)],
+            rect->w * (BPP / 8));
   }
 }
 
+/* the previous row is reset when filtering the first rows of the rect, as
+   only then the buffers of the decoding thread are known */
 static int
-InitFilterGradientBPP (rfbClient* client, int rw, int rh)
+InitFilterGradientBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh)
 {
-  int bits;
-
-  bits = InitFilterCopyBPP(client, rw, rh);
-  if (client->cutZeros)
-    memset(client->tightPrevRow, 0, rw * 3);
-  else
-    memset(client->tightPrevRow, 0, rw * 3 * sizeof(uint16_t));
-
-  return bits;
+  return InitFilterCopyBPP(client, rect, rw, rh);
 }
 
 #if BPP == 32
 
 static void
-FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
+FilterGradient24 (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
@@ -397,49 +473,55 @@ FilterGradient24 (rfbClient* client, int srcx, int srcy, int numRows)
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = client->tightPrevRow[c] + client->buffer[y*client->rectWidth*3+c];
+      pix[c] = scratch->prevRow[c] + scratch->buffer[y*rect->w*3+c];
       thisRow[c] = pix[c];
     }
-    dst[y*client->width] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
+    for (x = 1; x < rect->w; x++) {
       for (c = 0; c < 3; c++) {
-	est[c] = (int)client->tightPrevRow[x*3+c] + (int)pix[c] -
-		 (int)client->tightPrevRow[(x-1)*3+c];
+	est[c] = (int)scratch->prevRow[x*3+c] + (int)pix[c] -
+		 (int)scratch->prevRow[(x-1)*3+c];
 	if (est[c] > 0xFF) {
 	  est[c] = 0xFF;
 	} else if (est[c] < 0x00) {
 	  est[c] = 0x00;
 	}
-	pix[c] = (uint8_t)est[c] + client->buffer[(y*client->rectWidth+x)*3+c];
+	pix[c] = (uint8_t)est[c] + scratch->buffer[(y*rect->w+x)*3+c];
 	thisRow[x*3+c] = pix[c];
       }
-      dst[y*client->width+x] = RGB24_TO_PIXEL32(pix[0], pix[1], pix[2]);
     }
-    memcpy(client->tightPrevRow, thisRow, client->rectWidth * 3);
+    pixconv_rgb24(&client->pixconv, &dst[y*client->width], thisRow, rect->w);
+    memcpy(scratch->prevRow, thisRow, rect->w * 3);
   }
 }
 
 #endif
 
 static void
-FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
+FilterGradientBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows)
 {
   CARDBPP *dst =
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
   int x, y, c;
-  CARDBPP *src = (CARDBPP *)client->buffer;
-  uint16_t *thatRow = (uint16_t *)client->tightPrevRow;
+  CARDBPP *src = (CARDBPP *)scratch->buffer;
+  uint16_t *thatRow = (uint16_t *)scratch->prevRow;
   uint16_t thisRow[2048*3];
   uint16_t pix[3];
   uint16_t max[3];
   int shift[3];
   int est[3];
 
+  if (srcy == rect->y) {
+    if (rect->cutZeros)
+      memset(scratch->prevRow, 0, rect->w * 3);
+    else
+      memset(scratch->prevRow, 0, rect->w * 3 * sizeof(uint16_t));
+  }
+
 #if BPP == 32
-  if (client->cutZeros) {
-    FilterGradient24(client, srcx, srcy, numRows);
+  if (rect->cutZeros) {
+    FilterGradient24(client, rect, scratch, srcx, srcy, numRows);
     return;
   }
 #endif
@@ -456,13 +538,13 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 
     /* First pixel in a row */
     for (c = 0; c < 3; c++) {
-      pix[c] = (uint16_t)(((src[y*client->rectWidth] >> shift[c]) + thatRow[c]) & max[c]);
+      pix[c] = (uint16_t)(((src[y*rect->w] >> shift[c]) + thatRow[c]) & max[c]);
       thisRow[c] = pix[c];
     }
     dst[y*client->width] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
 
     /* Remaining pixels of a row */
-    for (x = 1; x < client->rectWidth; x++) {
+    for (x = 1; x < rect->w; x++) {
       for (c = 0; c < 3; c++) {
 	est[c] = (int)thatRow[x*3+c] + (int)pix[c] - (int)thatRow[(x-1)*3+c];
 	if (est[c] > (int)max[c]) {
@@ -470,78 +552,79 @@ FilterGradientBPP (rfbClient* client, int srcx, int srcy, int numRows)
 	} else if (est[c] < 0) {
 	  est[c] = 0;
 	}
-	pix[c] = (uint16_t)(((src[y*client->rectWidth+x] >> shift[c]) + est[c]) & max[c]);
+	pix[c] = (uint16_t)(((src[y*rect->w+x] >> shift[c]) + est[c]) & max[c]);
 	thisRow[x*3+c] = pix[c];
       }
       dst[y*client->width+x] = RGB_TO_PIXEL(BPP, pix[0], pix[1], pix[2]);
     }
-    memcpy(thatRow, thisRow, client->rectWidth * 3 * sizeof(uint16_t));
+    memcpy(thatRow, thisRow, rect->w * 3 * sizeof(uint16_t));
   }
 }
 
 static int
-InitFilterPaletteBPP (rfbClient* client, int rw, int rh)
+InitFilterPaletteBPP (rfbClient* client, rfbDecodeJob* rect, int rw, int rh)
 {
   uint8_t numColors;
 #if BPP == 32
   int i;
-  CARDBPP *palette = (CARDBPP *)client->tightPalette;
+  CARDBPP *palette = (CARDBPP *)rect->palette;
 #endif
 
-  client->rectWidth = rw;
+  rect->w = rw;
 
   if (!ReadFromRFBServer(client, (char*)&numColors, 1))
     return 0;
 
-  client->rectColors = (int)numColors;
-  if (++client->rectColors < 2)
+  rect->rectColors = (int)numColors;
+  if (++rect->rectColors < 2)
     return 0;
 
 #if BPP == 32
   if (client->format.depth == 24 && client->format.redMax == 0xFF &&
       client->format.greenMax == 0xFF && client->format.blueMax == 0xFF) {
-    if (!ReadFromRFBServer(client, (char*)&client->tightPalette, client->rectColors * 3))
+    if (!ReadFromRFBServer(client, (char*)&rect->palette, rect->rectColors * 3))
       return 0;
-    for (i = client->rectColors - 1; i >= 0; i--) {
-      palette[i] = RGB24_TO_PIXEL32(client->tightPalette[i*3],
-				    client->tightPalette[i*3+1],
-				    client->tightPalette[i*3+2]);
+    for (i = rect->rectColors - 1; i >= 0; i--) {
+      palette[i] = pixconv_rgb24_pixel(&client->pixconv,
+				       rect->palette[i*3],
+				       rect->palette[i*3+1],
+				       rect->palette[i*3+2]);
     }
-    return (client->rectColors == 2) ? 1 : 8;
+    return (rect->rectColors == 2) ? 1 : 8;
   }
 #endif
 
-  if (!ReadFromRFBServer(client, (char*)&client->tightPalette, client->rectColors * (BPP / 8)))
+  if (!ReadFromRFBServer(client, (char*)&rect->palette, rect->rectColors * (BPP / 8)))
     return 0;
 
-  return (client->rectColors == 2) ? 1 : 8;
+  return (rect->rectColors == 2) ? 1 : 8;
 }
 
 static void
-FilterPaletteBPP (rfbClient* client, int srcx, int srcy, int numRows)
+FilterPaletteBPP (rfbClient* client, rfbDecodeJob* rect, rfbDecodeScratch* scratch, int srcx, int srcy, int numRows)
 {
   int x, y, b, w;
   CARDBPP *dst =
     (CARDBPP *)&client->frameBuffer[(srcy * client->width + srcx) * BPP / 8];
-  uint8_t *src = (uint8_t *)client->buffer;
-  CARDBPP *palette = (CARDBPP *)client->tightPalette;
+  uint8_t *src = (uint8_t *)scratch->buffer;
+  CARDBPP *palette = (CARDBPP *)rect->palette;
 
-  if (client->rectColors == 2) {
-    w = (client->rectWidth + 7) / 8;
+  if (rect->rectColors == 2) {
+    w = (rect->w + 7) / 8;
     for (y = 0; y < numRows; y++) {
-      for (x = 0; x < client->rectWidth / 8; x++) {
+      for (x = 0; x < rect->w / 8; x++) {
 	for (b = 7; b >= 0; b--) {
 	  dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
 	}
       }
-      for (b = 7; b >= 8 - client->rectWidth % 8; b--) {
+      for (b = 7; b >= 8 - rect->w % 8; b--) {
 	dst[y*client->width+x*8+7-b] = palette[src[y*w+x] >> b & 1];
       }
     }
   } else {
     for (y = 0; y < numRows; y++)
-      for (x = 0; x < client->rectWidth; x++) {
-	dst[y*client->width+x] = palette[(int)src[y*client->rectWidth+x]];
+      for (x = 0; x < rect->w; x++) {
+	dst[y*client->width+x] = palette[(int)src[y*rect->w+x]];
     }
   }
 }
@@ -558,8 +641,8 @@ static rfbBool
 DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
 {
   int compressedLen;
-  uint8_t *compressedData, *dst;
-  int pixelSize, pitch, flags = 0;
+  const uint8_t *compressedData;
+  rfbDecodeJob rect, *job;
 
   compressedLen = (int)ReadCompactLen(client);
   if (compressedLen <= 0) {
@@ -567,72 +650,117 @@ DecompressJpegRectBPP(rfbClient* client, int x, int y, int w, int h)
     return FALSE;
   }
 
-  compressedData = malloc(compressedLen);
-  if (compressedData == NULL) {
-    rfbClientLog("Memory allocation error.\n");
-    return FALSE;
+  /* JPEG rects share no state, so any thread can decode them - unless the
+     application wants to do that itself. */
+  if (client->QueueDecodeJob && client->GotJpeg == NULL) {
+    memset(&rect, 0, sizeof(rect));
+    rect.x = x;
+    rect.y = y;
+    rect.w = w;
+    rect.h = h;
+    rect.stream = -1;
+    if ((job = NewDecodeJob(client, &rect, compressedLen)) == NULL)
+      return FALSE;
+    if (!ReadFromRFBServer(client, (char *)job->data, compressedLen)) {
+      free(job);
+      return FALSE;
+    }
+    job->decode = DecodeJpegJobBPP;
+    return QueueJob(client, job);
   }
 
-  if (!ReadFromRFBServer(client, (char*)compressedData, compressedLen)) {
-    free(compressedData);
-    return FALSE;
+  /* Most JPEG rects fit into the receive buffer and are decoded right there,
+     larger ones go into a buffer which is kept for the following rects. */
+  if (compressedLen <= RFB_BUF_SIZE) {
+    compressedData = (const uint8_t *)PeekFromRFBServer(client, compressedLen);
+    if (compressedData == NULL)
+      return FALSE;
+    ConsumeFromRFBServer(client, compressedLen);
+  } else {
+    if (client->jpegBufferSize < compressedLen) {
+      free(client->jpegBuffer);
+      client->jpegBufferSize = 0;
+      client->jpegBuffer = malloc(compressedLen);
+      if (client->jpegBuffer == NULL) {
+        rfbClientLog("Memory allocation error.\n");
+        return FALSE;
+      }
+      client->jpegBufferSize = compressedLen;
+    }
+    if (!ReadFromRFBServer(client, (char*)client->jpegBuffer, compressedLen))
+      return FALSE;
+    compressedData = client->jpegBuffer;
   }
 
   if(client->GotJpeg != NULL)
     return client->GotJpeg(client, compressedData, compressedLen, x, y, w, h);
-  
-  if (!client->tjhnd) {
-    if ((client->tjhnd = tjInitDecompress()) == NULL) {
+
+  return DecodeJpegBPP(client, compressedData, compressedLen, x, y, w, h,
+		       &client->tjhnd, client->buffer);
+}
+
+static rfbBool
+DecodeJpegJobBPP(rfbClient* client, rfbDecodeJob* job, rfbDecodeScratch* scratch)
+{
+  return DecodeJpegBPP(client, job->data, job->length, job->x, job->y, job->w, job->h,
+		       &scratch->tjhnd, scratch->buffer);
+}
+
+static rfbBool
+DecodeJpegBPP(rfbClient* client, const uint8_t *compressedData, int compressedLen,
+	      int x, int y, int w, int h, void **tjhnd, char *buffer)
+{
+  uint8_t *dst;
+  int pixelSize, pitch, flags = 0;
+  rfbBool convert = TRUE;
+
+  if (!*tjhnd) {
+    if ((*tjhnd = tjInitDecompress()) == NULL) {
       rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
-      free(compressedData);
       return FALSE;
     }
   }
 
-#if BPP == 16
-  flags = 0;
-  pixelSize = 3;
-  pitch = w * pixelSize;
-  dst = (uint8_t *)client->buffer;
-#else
-/*
-  if (client->format.bigEndian) flags |= TJ_ALPHAFIRST;
-  if (client->format.redShift == 16 && client->format.blueShift == 0)
-    flags |= TJ_BGR;
-  if (client->format.bigEndian) flags ^= TJ_BGR;
-*/
-  flags = TJ_ALPHAFIRST | TJ_BGR;
-  pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
+#if BPP == 32
+  /* TurboJPEG writes the byte orders it knows straight into the frame
+     buffer, anything else is converted from RGB like for 16bpp */
+  convert = FALSE;
+  switch (client->pixconv.order) {
+  case PIXCONV_XBGR: flags = TJ_ALPHAFIRST | TJ_BGR; break;
+  case PIXCONV_BGRX: flags = TJ_BGR; break;
+  case PIXCONV_RGBX: flags = 0; break;
+  case PIXCONV_XRGB: flags = TJ_ALPHAFIRST; break;
+  default: convert = TRUE; break;
+  }
 #endif
 
-  if (tjDecompress(client->tjhnd, compressedData, (unsigned long)compressedLen,
+  if (convert) {
+    if (w * h * 3 > RFB_BUFFER_SIZE) {
+      rfbClientLog("JPEG rectangle too large to convert: %dx%d\n", w, h);
+      return FALSE;
+    }
+    pixelSize = 3;
+    pitch = w * pixelSize;
+    dst = (uint8_t *)buffer;
+  } else {
+    pixelSize = BPP / 8;
+    pitch = client->width * pixelSize;
+    dst = &client->frameBuffer[y * pitch + x * pixelSize];
+  }
+
+  if (tjDecompress(*tjhnd, (unsigned char *)compressedData, (unsigned long)compressedLen,
                    dst, w, pitch, h, pixelSize, flags)==-1) {
     rfbClientLog("TurboJPEG error: %s\n", tjGetErrorStr());
-    free(compressedData);
     return FALSE;
   }
 
-  free(compressedData);
-
-#if BPP == 16
-  pixelSize = BPP / 8;
-  pitch = client->width * pixelSize;
-  dst = &client->frameBuffer[y * pitch + x * pixelSize];
-  {
-    CARDBPP *dst16=(CARDBPP *)dst, *dst2;
-    char *src = client->buffer;
-    int i, j;
+  if (convert) {
+    CARDBPP *dstRow = (CARDBPP *)&client->frameBuffer[(y * client->width + x) * BPP / 8];
+    int j;
 
-    for (j = 0; j < h; j++) {
-      for (i = 0, dst2 = dst16; i < w; i++, dst2++, src += 3) {
-        *dst2 = RGB24_TO_PIXEL(BPP, src[0], src[1], src[2]);
-      }
-      dst16 += client->width;
-    }
+    for (j = 0; j < h; j++, dstRow += client->width)
+      pixconv_rgb24(&client->pixconv, dstRow, (uint8_t *)buffer + j * w * 3, w);
   }
-#endif
 
   return TRUE;
 }
@@ -92,6 +92,9 @@ typedef struct _tjinstance
 	struct jpeg_source_mgr jsrc;
 	struct my_error_mgr jerr;
 	int init;
+	/* output row pointers, kept between images of the same or smaller height */
+	JSAMPROW *rowPointers;
+	int numRowPointers;
 } tjinstance;
 
 static const int pixelsize[TJ_NUMSAMP]={3, 3, 3, 1, 3};
@@ -441,6 +444,7 @@ DLLEXPORT int DLLCALL tjDestroy(tjhandle handle)
 	if(setjmp(this->jerr.setjmp_buffer)) return -1;
 	if(this->init&COMPRESS) jpeg_destroy_compress(cinfo);
 	if(this->init&DECOMPRESS) jpeg_destroy_decompress(dinfo);
+	free(this->rowPointers);
 	free(this);
 	return 0;
 }
@@ -820,9 +824,16 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	}
 	#endif
 
-	if((row_pointer=(JSAMPROW *)malloc(sizeof(JSAMPROW)
-		*dinfo->output_height))==NULL)
-		_throw("tjDecompress2(): Memory allocation failure");
+	if(this->numRowPointers<(int)dinfo->output_height)
+	{
+		free(this->rowPointers);
+		this->numRowPointers=0;
+		if((this->rowPointers=(JSAMPROW *)malloc(sizeof(JSAMPROW)
+			*dinfo->output_height))==NULL)
+			_throw("tjDecompress2(): Memory allocation failure");
+		this->numRowPointers=dinfo->output_height;
+	}
+	row_pointer=this->rowPointers;
 	for(i=0; i<(int)dinfo->output_height; i++)
 	{
 		if(flags&TJFLAG_BOTTOMUP)
@@ -845,7 +856,6 @@ DLLEXPORT int DLLCALL tjDecompress2(tjhandle handle, unsigned char *jpegBuf,
 	#ifndef JCS_EXTENSIONS
 	if(rgbBuf) free(rgbBuf);
 	#endif
-	if(row_pointer) free(row_pointer);
 	return retval;
 }
 
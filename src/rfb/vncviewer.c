@@ -39,6 +39,11 @@
 #include <time.h>
 #include <rfb/rfbclient.h>
 #include "tls.h"
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+#include "turbojpeg.h"
+#endif
+#endif
 
 static void Dummy(rfbClient* client) {
 }
@@ -100,7 +105,7 @@ static rfbBool CheckRect(rfbClient* client, int x, int y, int w, int h) {
   return x + w <= client->width && y + h <= client->height;
 }
 
-static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
+void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_t colour) {
   int i,j;
 
   if (client->frameBuffer == NULL) {
@@ -126,7 +131,7 @@ static void FillRectangle(rfbClient* client, int x, int y, int w, int h, uint32_
   }
 }
 
-static void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
+void CopyRectangle(rfbClient* client, const uint8_t* buffer, int x, int y, int w, int h) {
   int j;
 
   if (client->frameBuffer == NULL) {
@@ -224,12 +229,17 @@ static void initAppData(AppData* data) {
 	data->requestedDepth=0;
 	data->compressLevel=3;
 	data->qualityLevel=5;
+	data->fineQualityLevel=-1;
+	data->subsampLevel=-1;
 #ifdef LIBVNCSERVER_HAVE_LIBJPEG
 	data->enableJPEG=TRUE;
 #else
 	data->enableJPEG=FALSE;
 #endif
 	data->useRemoteCursor=FALSE;
+	data->updateRequests=1;
+	data->desktopWidth=0;
+	data->desktopHeight=0;
 }
 
 rfbClient* rfbGetClient(int bitsPerSample,int samplesPerPixel,
@@ -493,6 +503,13 @@ rfbBool rfbInitClient(rfbClient* client,int* argc,char** argv) {
 void rfbClientCleanup(rfbClient* client) {
 #ifdef LIBVNCSERVER_HAVE_LIBZ
   int i;
+#endif
+
+  if (client->updatesReceived)
+    rfbClientLog("Update pipeline ran dry after %u of %u updates\n",
+		 client->updatePipelineDry, client->updatesReceived);
+
+#ifdef LIBVNCSERVER_HAVE_LIBZ
 
   for ( i = 0; i < 4; i++ ) {
     if (client->zlibStreamActive[i] == TRUE ) {
@@ -515,6 +532,14 @@ void rfbClientCleanup(rfbClient* client) {
   if (client->raw_buffer)
     free(client->raw_buffer);
 
+#ifdef LIBVNCSERVER_HAVE_LIBZ
+#ifdef LIBVNCSERVER_HAVE_LIBJPEG
+  if (client->tjhnd)
+    tjDestroy(client->tjhnd);
+  free(client->jpegBuffer);
+#endif
+#endif
+
   FreeTLS(client);
 
   while (client->clientData) {
@@ -524,6 +549,8 @@ void rfbClientCleanup(rfbClient* client) {
   }
 
   free(client->vncRec);
+  if (client->vncRecord)
+    fclose(client->vncRecord);
 
   if (client->sock != RFB_INVALID_SOCKET)
     rfbCloseSocket(client->sock);
@@ -38,7 +38,8 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   rfbZlibHeader hdr;
   int remaining;
   int inflateResult;
-  int toRead;
+  unsigned int toRead;
+  const char *in;
 
   /* First make sure we have a large enough raw buffer to hold the
    * decompressed data.  In practice, with a fixed BPP, fixed frame
@@ -96,18 +97,11 @@ HandleZlibBPP (rfbClient* client, int rx, int ry, int rw, int rh)
   while (( remaining > 0 ) &&
          ( inflateResult == Z_OK )) {
   
-    if ( remaining > RFB_BUFFER_SIZE ) {
-      toRead = RFB_BUFFER_SIZE;
-    }
-    else {
-      toRead = remaining;
-    }
-
-    /* Fill the buffer, obtaining data from the server. */
-    if (!ReadFromRFBServer(client, client->buffer,toRead))
+    /* Inflate straight out of the receive buffer. */
+    if (!(in = BorrowFromRFBServer(client, remaining, &toRead)))
       return FALSE;
 
-    client->decompStream.next_in  = ( Bytef * )client->buffer;
+    client->decompStream.next_in  = ( Bytef * )in;
     client->decompStream.avail_in = toRead;
 
     /* Need to uncompress buffer full. */
@@ -35,12 +35,21 @@
 #if !defined(UNCOMP) || UNCOMP==0
 #define HandleZRLE CONCAT2E(HandleZRLE,REALBPP)
 #define HandleZRLETile CONCAT2E(HandleZRLETile,REALBPP)
+#define ReadZRLEPixels CONCAT2E(ReadZRLEPixels,REALBPP)
+#define UnpackZRLERow CONCAT2E(UnpackZRLERow,REALBPP)
+#define FillZRLERun CONCAT2E(FillZRLERun,REALBPP)
 #elif UNCOMP>0
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Down)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Down)
+#define ReadZRLEPixels CONCAT3E(ReadZRLEPixels,REALBPP,Down)
+#define UnpackZRLERow CONCAT3E(UnpackZRLERow,REALBPP,Down)
+#define FillZRLERun CONCAT3E(FillZRLERun,REALBPP,Down)
 #else
 #define HandleZRLE CONCAT3E(HandleZRLE,REALBPP,Up)
 #define HandleZRLETile CONCAT3E(HandleZRLETile,REALBPP,Up)
+#define ReadZRLEPixels CONCAT3E(ReadZRLEPixels,REALBPP,Up)
+#define UnpackZRLERow CONCAT3E(UnpackZRLERow,REALBPP,Up)
+#define FillZRLERun CONCAT3E(FillZRLERun,REALBPP,Up)
 #endif
 #define CARDBPP CONCAT3E(uint,BPP,_t)
 #define CARDREALBPP CONCAT3E(uint,REALBPP,_t)
@@ -80,22 +89,94 @@ static int HandleZRLETile(rfbClient* client,
 	uint8_t* buffer,size_t buffer_length,
 	int x,int y,int w,int h);
 
+#ifndef ZRLE_WINDOW_SIZE
+/* ZRLE rectangles are inflated into a window of this size and decoded tile
+ * by tile, so a tile is drawn while its bytes are still in the cache and a
+ * full screen update needs no more memory than a small one.  The largest
+ * well-formed tile (plain RLE with 4 byte pixels) takes about 20 KB, the
+ * window is refilled whenever less than half of it is left.
+ */
+#define ZRLE_WINDOW_SIZE 65536
+#define ZRLE_REFILL_SIZE (ZRLE_WINDOW_SIZE / 2)
+
+/* Inflate more of the rectangle into client->raw_buffer after the first
+ * have bytes, until there are at least want bytes or the rectangle is
+ * exhausted.  Returns the number of bytes in the window, -1 on error.
+ */
+static int
+InflateZRLEWindow(rfbClient* client, int* remaining, int have, int want)
+{
+	int inflateResult;
+	unsigned int toRead;
+	const char *in;
+
+	while (have < want) {
+		/* Inflate straight out of the receive buffer. */
+		if (client->decompStream.avail_in == 0 && *remaining > 0) {
+			if (!(in = BorrowFromRFBServer(client, *remaining, &toRead)))
+				return -1;
+			client->decompStream.next_in  = ( Bytef * )in;
+			client->decompStream.avail_in = toRead;
+			*remaining -= toRead;
+		}
+
+		client->decompStream.next_out  = ( Bytef * )client->raw_buffer + have;
+		client->decompStream.avail_out = ZRLE_WINDOW_SIZE - have;
+
+		inflateResult = inflate( &client->decompStream, Z_SYNC_FLUSH );
+
+		/* No input left and nothing pending: the rectangle is done. */
+		if ( inflateResult == Z_BUF_ERROR )
+			break;
+		/* We never supply a dictionary for compression. */
+		if ( inflateResult == Z_NEED_DICT ) {
+			rfbClientLog("zlib inflate needs a dictionary!\n");
+			return -1;
+		}
+		if ( inflateResult != Z_OK ) {
+			rfbClientLog(
+					"zlib inflate returned error: %d, msg: %s\n",
+					inflateResult,
+					client->decompStream.msg);
+			return -1;
+		}
+
+		have = ZRLE_WINDOW_SIZE - client->decompStream.avail_out;
+	}
+
+	return have;
+}
+
+/* Inflate and drop the rest of the rectangle, keeping the zlib stream in
+ * step with the server.
+ */
+static rfbBool
+SkipZRLEWindow(rfbClient* client, int* remaining)
+{
+	int have;
+
+	do {
+		if ((have = InflateZRLEWindow(client, remaining, 0, ZRLE_WINDOW_SIZE)) < 0)
+			return FALSE;
+	} while (have == ZRLE_WINDOW_SIZE);
+
+	return TRUE;
+}
+#endif
+
 static rfbBool
 HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 {
 	rfbZRLEHeader header;
 	int remaining;
 	int inflateResult;
-	int toRead;
-	int min_buffer_size = rw * rh * (REALBPP / 8) * 2;
-
-	/* First make sure we have a large enough raw buffer to hold the
-	 * decompressed data.  In practice, with a fixed REALBPP, fixed frame
-	 * buffer size and the first update containing the entire frame
-	 * buffer, this buffer allocation should only happen once, on the
-	 * first update.
+	int have, pos;
+	int i,j;
+
+	/* The window is shared with the other decoders using raw_buffer,
+	 * which may have made it larger already.
 	 */
-	if ( client->raw_buffer_size < min_buffer_size) {
+	if ( client->raw_buffer_size < ZRLE_WINDOW_SIZE) {
 
 		if ( client->raw_buffer != NULL ) {
 
@@ -103,8 +184,13 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 		}
 
-		client->raw_buffer_size = min_buffer_size;
+		client->raw_buffer_size = ZRLE_WINDOW_SIZE;
 		client->raw_buffer = (char*) malloc( client->raw_buffer_size );
+		if ( client->raw_buffer == NULL ) {
+			client->raw_buffer_size = -1;
+			rfbClientLog("Out of memory allocating the ZRLE window\n");
+			return FALSE;
+		}
 
 	}
 
@@ -116,8 +202,6 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 	/* Need to initialize the decompressor state. */
 	client->decompStream.next_in   = ( Bytef * )client->buffer;
 	client->decompStream.avail_in  = 0;
-	client->decompStream.next_out  = ( Bytef * )client->raw_buffer;
-	client->decompStream.avail_out = client->raw_buffer_size;
 	client->decompStream.data_type = Z_BINARY;
 
 	/* Initialize the decompression stream structures on the first invocation. */
@@ -137,93 +221,49 @@ HandleZRLE (rfbClient* client, int rx, int ry, int rw, int rh)
 
 	}
 
-	inflateResult = Z_OK;
-
-	/* Process buffer full of data until no more to process, or
-	 * some type of inflater error, or Z_STREAM_END.
-	 */
-	while (( remaining > 0 ) &&
-			( inflateResult == Z_OK )) {
-
-		if ( remaining > RFB_BUFFER_SIZE ) {
-			toRead = RFB_BUFFER_SIZE;
-		}
-		else {
-			toRead = remaining;
-		}
+	have = pos = 0;
 
-		/* Fill the buffer, obtaining data from the server. */
-		if (!ReadFromRFBServer(client, client->buffer,toRead))
-			return FALSE;
-
-		client->decompStream.next_in  = ( Bytef * )client->buffer;
-		client->decompStream.avail_in = toRead;
-
-		/* Need to uncompress buffer full. */
-		inflateResult = inflate( &client->decompStream, Z_SYNC_FLUSH );
+	for(j=0; j<rh; j+=rfbZRLETileHeight)
+		for(i=0; i<rw; i+=rfbZRLETileWidth) {
+			int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
+			int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
+			int result;
 
-		/* We never supply a dictionary for compression. */
-		if ( inflateResult == Z_NEED_DICT ) {
-			rfbClientLog("zlib inflate needs a dictionary!\n");
-			return FALSE;
-		}
-		if ( inflateResult < 0 ) {
-			rfbClientLog(
-					"zlib inflate returned error: %d, msg: %s\n",
-					inflateResult,
-					client->decompStream.msg);
-			return FALSE;
-		}
-
-		/* Result buffer allocated to be at least large enough.  We should
-		 * never run out of space!
-		 */
-		if (( client->decompStream.avail_in > 0 ) &&
-				( client->decompStream.avail_out <= 0 )) {
-			rfbClientLog("zlib inflate ran out of space!\n");
-			return FALSE;
-		}
-
-		remaining -= toRead;
-
-	} /* while ( remaining > 0 ) */
-
-	if ( inflateResult == Z_OK ) {
-		char* buf=client->raw_buffer;
-		int i,j;
-
-		remaining = client->raw_buffer_size-client->decompStream.avail_out;
-
-		for(j=0; j<rh; j+=rfbZRLETileHeight)
-			for(i=0; i<rw; i+=rfbZRLETileWidth) {
-				int subWidth=(i+rfbZRLETileWidth>rw)?rw-i:rfbZRLETileWidth;
-				int subHeight=(j+rfbZRLETileHeight>rh)?rh-j:rfbZRLETileHeight;
-				int result=HandleZRLETile(client,(uint8_t *)buf,remaining,rx+i,ry+j,subWidth,subHeight);
-
-				if(result<0) {
-					rfbClientLog("ZRLE decoding failed (%d)\n",result);
-return TRUE;
+			/* Move the undecoded tail to the front and inflate behind it. */
+			if (have-pos < ZRLE_REFILL_SIZE) {
+				memmove(client->raw_buffer, client->raw_buffer+pos, have-pos);
+				have = InflateZRLEWindow(client, &remaining, have-pos, ZRLE_WINDOW_SIZE);
+				pos = 0;
+				if (have < 0)
 					return FALSE;
-				}
-
-				buf+=result;
-				remaining-=result;
 			}
-	}
-	else {
 
-		rfbClientLog(
-				"zlib inflate returned error: %d, msg: %s\n",
-				inflateResult,
-				client->decompStream.msg);
-		return FALSE;
+			result=HandleZRLETile(client,(uint8_t *)client->raw_buffer+pos,have-pos,rx+i,ry+j,subWidth,subHeight);
 
-	}
+			if(result<0) {
+				/* Tolerate a broken tile, but stay in sync with the server. */
+				rfbClientLog("ZRLE decoding failed (%d)\n",result);
+				return SkipZRLEWindow(client, &remaining);
+			}
 
-	return TRUE;
+			pos+=result;
+		}
+
+	return SkipZRLEWindow(client, &remaining);
 }
 
-#if REALBPP!=BPP && defined(UNCOMP) && UNCOMP!=0
+#if REALBPP==24 && BPP==32 && (!defined(UNCOMP) || UNCOMP<=0)
+/* The CPIXEL bytes, least significant first, moved into the used bytes of
+ * the pixel.  Unlike a word read this never picks up the next pixel, and
+ * ReadZRLEPixels() can expand whole words of them at once.
+ */
+#if defined(UNCOMP) && UNCOMP<0
+#define ZRLE_EXPAND24(v) ((uint32_t)(v)<<(-(UNCOMP)))
+#else
+#define ZRLE_EXPAND24(v) ((uint32_t)(v)&0xffffff)
+#endif
+#define UncompressCPixel(pointer) ZRLE_EXPAND24((pointer)[0]|(pointer)[1]<<8|(uint32_t)(pointer)[2]<<16)
+#elif REALBPP!=BPP && defined(UNCOMP) && UNCOMP!=0
 #if UNCOMP>0
 #define UncompressCPixel(pointer) ((*(CARDBPP*)pointer)>>UNCOMP)
 #else
@@ -233,11 +273,72 @@ return TRUE;
 #define UncompressCPixel(pointer) (*(CARDBPP*)pointer)
 #endif
 
+/* Read n CPIXELs from s into d. */
+static void
+ReadZRLEPixels(CARDBPP* d, uint8_t* s, int n)
+{
+#ifdef ZRLE_EXPAND24
+	/* four pixels out of three little endian words */
+	for (; n >= 4; n -= 4, s += 12, d += 4) {
+		uint32_t w0, w1, w2;
+
+		memcpy(&w0, s, 4);
+		memcpy(&w1, s + 4, 4);
+		memcpy(&w2, s + 8, 4);
+		d[0] = ZRLE_EXPAND24(w0);
+		d[1] = ZRLE_EXPAND24(w0 >> 24 | w1 << 8);
+		d[2] = ZRLE_EXPAND24(w1 >> 16 | w2 << 16);
+		d[3] = ZRLE_EXPAND24(w2 >> 8);
+	}
+#endif
+	for (; n > 0; n--, s += REALBPP/8)
+		*d++ = UncompressCPixel(s);
+}
+
+/* Unpack a row of w palette indices, looking up the ppn pixels of each
+ * nibble in lut.  Returns the byte after the row.
+ */
+static inline __attribute__((always_inline)) uint8_t*
+UnpackZRLERow(CARDBPP* d, uint8_t* s, CARDBPP lut[16][4], int w, int ppn)
+{
+	int k;
+
+	for (; w >= 2 * ppn; w -= 2 * ppn, d += 2 * ppn, s++) {
+		const CARDBPP *hi = lut[*s >> 4], *lo = lut[*s & 15];
+
+		for (k = 0; k < ppn; k++) {
+			d[k] = hi[k];
+			d[ppn + k] = lo[k];
+		}
+	}
+	/* rows are padded to whole bytes */
+	if (w > 0) {
+		for (k = 0; k < w; k++)
+			d[k] = k < ppn ? lut[*s >> 4][k] : lut[*s & 15][k - ppn];
+		s++;
+	}
+	return s;
+}
+
+/* Fill a run of n pixels. */
+static inline void
+FillZRLERun(CARDBPP* d, CARDBPP c, int n)
+{
+#if BPP == 32
+	/* four at a time, which becomes a store multiple */
+	for (; n >= 4; n -= 4, d += 4)
+		d[0] = d[1] = d[2] = d[3] = c;
+#endif
+	for (; n > 0; n--)
+		*d++ = c;
+}
+
 static int HandleZRLETile(rfbClient* client,
 		uint8_t* buffer,size_t buffer_length,
 		int x,int y,int w,int h) {
 	uint8_t* buffer_copy = buffer;
 	uint8_t* buffer_end = buffer+buffer_length;
+	CARDBPP* row = (CARDBPP*)client->frameBuffer + y*client->width + x;
 	uint8_t type;
 #if BPP!=8
 	uint8_t zywrle_level = (client->appData.qualityLevel & 0x80) ?
@@ -267,16 +368,15 @@ static int HandleZRLETile(rfbClient* client,
 #endif
 		{
 #if REALBPP!=BPP
-			int i,j;
+			int j;
 
 			if(1+w*h*REALBPP/8>buffer_length) {
 				rfbClientLog("expected %d bytes, got only %d (%dx%d)\n",1+w*h*REALBPP/8,buffer_length,w,h);
 				return -3;
 			}
 
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width)
-				for(i=x; i<x+w; i++,buffer+=REALBPP/8)
-					((CARDBPP*)client->frameBuffer)[j+i] = UncompressCPixel(buffer);
+			for(j=0; j<h; j++,row+=client->width,buffer+=w*REALBPP/8)
+				ReadZRLEPixels(row, buffer, w);
 #else
 			client->GotBitmap(client, buffer, x, y, w, h);
 			buffer+=w*h*REALBPP/8;
@@ -284,21 +384,23 @@ static int HandleZRLETile(rfbClient* client,
 		}
 		else if( type == 1 ) /* solid */
 		{
-			CARDBPP color = UncompressCPixel(buffer);
+			CARDBPP color;
 
 			if(1+REALBPP/8>buffer_length)
 				return -4;
-				
+
+			color = UncompressCPixel(buffer);
 			client->GotFillRect(client, x, y, w, h, color);
 
 			buffer+=REALBPP/8;
 
 		}
-		else if( type <= 127 ) /* packed Palette */
+		else if( type <= 16 ) /* packed Palette */
 		{
-			CARDBPP palette[16];
-			int i,j,shift,
-				bpp=(type>4?(type>16?8:4):(type>2?2:1)),
+			CARDBPP palette[16] = {0}, lut[16][4];
+			int i,j,k,
+				bpp=(type>4?4:(type>2?2:1)),
+				ppn=4/bpp,
 				mask=(1<<bpp)-1,
 				divider=(8/bpp);
 
@@ -306,30 +408,34 @@ static int HandleZRLETile(rfbClient* client,
 				return -5;
 
 			/* read palette */
-			for(i=0; i<type; i++,buffer+=REALBPP/8)
-				palette[i] = UncompressCPixel(buffer);
+			ReadZRLEPixels(palette, buffer, type);
+			buffer+=type*REALBPP/8;
+
+			/* the pixels of every nibble value, most significant first */
+			for(i=0; i<16; i++)
+				for(k=0; k<ppn; k++)
+					lut[i][k] = palette[(i>>(4-bpp*(k+1)))&mask];
 
 			/* read palettized pixels */
-			for(j=y*client->width; j<(y+h)*client->width; j+=client->width) {
-				for(i=x,shift=8-bpp; i<x+w; i++) {
-					((CARDBPP*)client->frameBuffer)[j+i] = palette[((*buffer)>>shift)&mask];
-					shift-=bpp;
-					if(shift<0) {
-						shift=8-bpp;
-						buffer++;
-					}
+			for(j=0; j<h; j++,row+=client->width) {
+				switch(bpp) {
+				case 1: buffer = UnpackZRLERow(row, buffer, lut, w, 4); break;
+				case 2: buffer = UnpackZRLERow(row, buffer, lut, w, 2); break;
+				default: buffer = UnpackZRLERow(row, buffer, lut, w, 1); break;
 				}
-				if(shift<8-bpp)
-					buffer++;
 			}
 
 		}
-		/* case 17 ... 127: not used, but valid */
+		else if( type <= 127 ) /* unused, and larger than the palette */
+		{
+			return -6;
+		}
 		else if( type == 128 ) /* plain RLE */
 		{
 			int i=0,j=0;
 			while(j<h) {
-				int color,length;
+				CARDBPP color;
+				int length;
 				/* read color */
 				if(buffer+REALBPP/8+1>buffer_end)
 					return -7;
@@ -345,13 +451,16 @@ static int HandleZRLETile(rfbClient* client,
 				}
 				length+=*buffer;
 				buffer++;
+				/* fill the run up to the end of each row */
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
+					int n=(w-i<length)?w-i:length;
+					FillZRLERun(row+i, color, n);
+					length-=n;
+					i+=n;
 					if(i>=w) {
 						i=0;
 						j++;
+						row+=client->width;
 					}
 				}
 				if(length>0)
@@ -372,12 +481,13 @@ static int HandleZRLETile(rfbClient* client,
 				return -9;
 
 			/* read palette */
-			for(i=0; i<type-128; i++,buffer+=REALBPP/8)
-				palette[i] = UncompressCPixel(buffer);
+			ReadZRLEPixels(palette, buffer, type-128);
+			buffer+=(type-128)*REALBPP/8;
 			/* read palettized pixels */
 			i=j=0;
 			while(j<h) {
-				int color,length;
+				CARDBPP color;
+				int length;
 				/* read color */
 				if(buffer>=buffer_end)
 					return -10;
@@ -397,13 +507,16 @@ static int HandleZRLETile(rfbClient* client,
 					length+=*buffer;
 				}
 				buffer++;
+				/* fill the run up to the end of each row */
 				while(j<h && length>0) {
-					((CARDBPP*)client->frameBuffer)[(y+j)*client->width+x+i] = color;
-					length--;
-					i++;
+					int n=(w-i<length)?w-i:length;
+					FillZRLERun(row+i, color, n);
+					length-=n;
+					i+=n;
 					if(i>=w) {
 						i=0;
 						j++;
+						row+=client->width;
 					}
 				}
 				if(length>0)
@@ -419,7 +532,11 @@ static int HandleZRLETile(rfbClient* client,
 #undef CARDREALBPP
 #undef HandleZRLE
 #undef HandleZRLETile
+#undef ReadZRLEPixels
+#undef UnpackZRLERow
+#undef FillZRLERun
 #undef UncompressCPixel
+#undef ZRLE_EXPAND24
 
 #endif
 
@@ -0,0 +1,139 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * scaler.c - downscale 32bpp framebuffers
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include "scaler.h"
+
+#define ALPHA 0x000000ff
+#define LANES 0x00ff00ff	// two channels per word, 16 bits each
+
+// average of each byte, rounded down
+static inline u32 hadd8(u32 a, u32 b)
+{
+#ifdef __ARM_FEATURE_SIMD32
+	u32 r;
+	__asm__ ("uhadd8 %0, %1, %2" : "=r" (r) : "r" (a), "r" (b));
+	return r;
+#else
+	return (a & b) + (((a ^ b) & 0xfefefefe) >> 1);
+#endif
+}
+
+static void box2(u32 *dst, int dst_pitch, const u32 *src, int dst_width, int dst_height, int src_pitch)
+{
+	int i, j;
+
+	for (j = 0; j < dst_height; ++j) {
+		const u32 *s0 = src;
+		const u32 *s1 = src + src_pitch;
+		for (i = 0; i < dst_width; ++i, s0 += 2, s1 += 2)
+			dst[i] = hadd8(hadd8(s0[0], s0[1]), hadd8(s1[0], s1[1])) | ALPHA;
+		dst += dst_pitch;
+		src += src_pitch * 2;
+	}
+}
+
+// Sum the block in two words, one holding the even and one the odd bytes of
+// all pixels. Every 16 bit lane can take up to 256 pixels, so this works up
+// to factor 16. Dividing by factor^2 is done by a reciprocal multiplication;
+// the compiler turns it into shifts for 2, 4, 8 and 16.
+static inline __attribute__((always_inline))
+void boxn(u32 *dst, int dst_pitch, const u32 *src, int dst_width, int dst_height, int src_pitch, int factor)
+{
+	const u32 mul = (65536 + factor * factor - 1) / (factor * factor);
+	int i, j, x, y;
+
+	for (j = 0; j < dst_height; ++j) {
+		const u32 *s = src;
+		for (i = 0; i < dst_width; ++i, s += factor) {
+			const u32 *row = s;
+			u32 even = 0, odd = 0;
+			for (y = 0; y < factor; ++y, row += src_pitch) {
+				for (x = 0; x < factor; ++x) {
+					even += row[x] & LANES;
+					odd += (row[x] >> 8) & LANES;
+				}
+			}
+			dst[i] =
+				((((odd >> 16) * mul) >> 16) << 24) |
+				((((even >> 16) * mul) >> 16) << 16) |
+				((((odd & 0xffff) * mul) >> 16) << 8) | ALPHA;
+		}
+		dst += dst_pitch;
+		src += src_pitch * factor;
+	}
+}
+
+static void box3(u32 *dst, int dst_pitch, const u32 *src, int dst_width, int dst_height, int src_pitch)
+{
+	boxn(dst, dst_pitch, src, dst_width, dst_height, src_pitch, 3);
+}
+
+static void box4(u32 *dst, int dst_pitch, const u32 *src, int dst_width, int dst_height, int src_pitch)
+{
+	boxn(dst, dst_pitch, src, dst_width, dst_height, src_pitch, 4);
+}
+
+// one channel at a time, for factors beyond what fits into the 16 bit lanes
+static void box_bytes(u8 *dst, int dst_pitch, const u8 *src, int dst_width, int dst_height, int src_pitch, int factor)
+{
+	int i, j, x, y, c;
+
+	for (j = 0; j < dst_height; ++j) {
+		for (i = 0; i < dst_width; ++i) {
+			const u8 *s = src + j * factor * src_pitch + i * factor * 4;
+			u8 *d = dst + j * dst_pitch + i * 4;
+			d[0] = 255;
+			for (c = 1; c < 4; ++c) {
+				u32 sum = 0;
+				for (y = 0; y < factor; ++y)
+					for (x = 0; x < factor; ++x)
+						sum += s[y * src_pitch + x * 4 + c];
+				d[c] = sum / (factor * factor);
+			}
+		}
+	}
+}
+
+int scale_box(u8 *dst, int dst_pitch, const u8 *src, int src_width, int src_height, int src_pitch, int factor)
+{
+	if (factor < 2) return -1;
+
+	int dst_width = src_width / factor;
+	int dst_height = src_height / factor;
+	if (dst_width <= 0 || dst_height <= 0) return -1;
+
+	switch (factor) {
+	case 2:
+		box2((u32 *)dst, dst_pitch / 4, (const u32 *)src, dst_width, dst_height, src_pitch / 4);
+		break;
+	case 3:
+		box3((u32 *)dst, dst_pitch / 4, (const u32 *)src, dst_width, dst_height, src_pitch / 4);
+		break;
+	case 4:
+		box4((u32 *)dst, dst_pitch / 4, (const u32 *)src, dst_width, dst_height, src_pitch / 4);
+		break;
+	default:
+		if (factor <= 16)
+			boxn((u32 *)dst, dst_pitch / 4, (const u32 *)src, dst_width, dst_height, src_pitch / 4, factor);
+		else
+			box_bytes(dst, dst_pitch, src, dst_width, dst_height, src_pitch, factor);
+		break;
+	}
+	return 0;
+}
+
+int scale_fit_factor(int width, int height, int screen_w, int screen_h)
+{
+	// fitting scales by min(screen_w / width, screen_h / height), so
+	// anything up to the inverse keeps every displayed pixel
+	int fx = width / screen_w;
+	int fy = height / screen_h;
+	int f = fx > fy ? fx : fy;
+	return f < 1 ? 1 : f;
+}
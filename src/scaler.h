@@ -0,0 +1,27 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * scaler.h - downscale 32bpp framebuffers
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+#ifndef _SCALER_H
+#define _SCALER_H
+
+#include <3ds.h>
+
+// The scaler works on 32bpp pixels with the alpha channel in the lowest byte
+// (the format used by the SDL surfaces and the bottom screen texture). The
+// alpha channel of the destination is always set to 255.
+
+// shrink src_width x src_height pixels by an integer factor, averaging
+// factor x factor blocks; the destination gets src_width / factor x
+// src_height / factor pixels
+extern int scale_box(u8 *dst, int dst_pitch, const u8 *src, int src_width, int src_height, int src_pitch, int factor);
+
+// the largest integer factor a width x height desktop can be shrunk by
+// without getting smaller than it is shown when fitted to a screen_w x
+// screen_h screen, at least 1
+extern int scale_fit_factor(int width, int height, int screen_w, int screen_h);
+
+#endif // _SCALER_H
@@ -15,6 +15,7 @@
 #include <rfb/rfbclient.h> // only for logging functions
 #include "httpstatuscodes_c.h"
 #include "streamclient.h"
+#include "reactor.h"
 #include "decoder.h"
 #include "mp3decoder.h"
 //#include "opusdecoder.h"
@@ -245,6 +246,31 @@ void stop_stream()
 	}
 }
 
+void stream_poll_fds(struct reactor *r, int source)
+{
+	fd_set rd, wr, ex;
+	int maxfd = -1, fd;
+	long timeout = -1;
+	short events;
+
+	// while paused curl does not read, the stream is serviced every frame
+	if (curl_paused || still_running <= 0) return;
+
+	FD_ZERO(&rd);
+	FD_ZERO(&wr);
+	FD_ZERO(&ex);
+	if (curl_multi_fdset(mcurl, &rd, &wr, &ex, &maxfd) != CURLM_OK) return;
+	for (fd = 0; fd <= maxfd; ++fd) {
+		events = 0;
+		if (FD_ISSET(fd, &rd)) events |= POLLIN;
+		if (FD_ISSET(fd, &wr)) events |= POLLOUT;
+		if (FD_ISSET(fd, &ex)) events |= POLLPRI;
+		if (events) reactor_add_fd(r, fd, events, source);
+	}
+	if (curl_multi_timeout(mcurl, &timeout) == CURLM_OK)
+		reactor_deadline(r, (int)timeout);
+}
+
 int run_stream()
 {
 	if (curl_paused) {
@@ -9,3 +9,7 @@
 int start_stream(char *url, char *username, char *password);
 void stop_stream();
 int run_stream();
+
+struct reactor;
+// let the main loop wake up as soon as the stream has data
+void stream_poll_fds(struct reactor *r, int source);
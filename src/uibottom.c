@@ -15,6 +15,9 @@
 #include <errno.h>
 #include "uibottom.h"
 #include "utilities.h"
+#include "scaler.h"
+#include "pixconv.h"
+#include "turbojpeg.h"
 
 #define ENTER //log_citra("enter %s",__func__);
 #define DEF_TXT_COL COL_WHITE
@@ -144,11 +147,13 @@ static DS3_Image qmenu_spr;
 static DS3_Image whitepixel_spr;
 static DS3_Image blackpixel_spr;
 static DS3_Image uibvnc_spr;
+static DS3_Image stats_spr;
 
 // SDL Surfaces
 SDL_Surface *menu_img=NULL;
 SDL_Surface *chars_img=NULL;
 static SDL_Surface *message_img=NULL;
+static SDL_Surface *stats_img=NULL;
 
 // globals
 int uibvnc_w=320;
@@ -162,6 +167,11 @@ static u8* uibvnc_buffer = NULL;
 static int uibvnc_pitch = 0;
 static u8* uibvnc_buffer_big = NULL;
 static int scaling_factor_bot=1;
+static struct jpegscale uibvnc_jpeg;
+// dirty tracking of uibvnc_buffer, the VNC thread may report changes while we transfer
+static u32 uibvnc_dirty[SDL_N3DS_MAX_BANDS / 32];
+static int uibvnc_tex_valid = 0; // uibvnc_spr.tex matches uibvnc_buffer
+static int uibvnc_jpeg_scaled = 0; // the last rect went straight to uibvnc_buffer
 
 static Handle repaintRequired;
 static int uib_isinit=0;
@@ -178,11 +188,14 @@ static int top_scrollbars = 0;
 static int sb_pos_hx, sb_pos_hw, sb_pos_vy, sb_pos_vh;
 static int bottom_lcd_on=1;
 static int uibvnc_scaling=1;
+static int uibvnc_server_scaling=0;
 static u32 messagetime=0;
+static int stats_visible=0;
 
 // sprite handling funtions
 extern C3D_RenderTarget* VideoSurface2;
 extern void SDL_RequestCall(void(*callback)(void*), void *param);
+extern void SDL_RequestRedraw();
 
 #define CLEAR_COLOR 0x000000FF
 // Used to convert textures to 3DS tiled format
@@ -197,6 +210,8 @@ extern void SDL_RequestCall(void(*callback)(void*), void *param);
 #define QMENU_WIDTH 256
 #define QMENU_HEIGHT 128
 
+#define STATS_LINES 16
+
 // key repeat functions for the simulated key repeat
 static int keydown = 0;
 static u32 key_ts = 0;
@@ -371,21 +386,8 @@ static void makeImage(DS3_Image *img, const u8 *pixels, unsigned w, unsigned h,
 		// GX_DisplayTransfer needs input buffer in linear RAM
 		u8 *gpusrc = (u8*)linearAlloc(hh*hw*4);
 		// copy to linear buffer, convert from RGBA to ABGR
-		const u8* src=pixels; u8 *dst;
-		for(unsigned y = 0; y < h; y++) {
-			dst=gpusrc+y*hw*4;
-			for (unsigned x=0; x<w; x++) {
-				int r = *src++;
-				int g = *src++;
-				int b = *src++;
-				int a = *src++;
-
-				*dst++ = a;
-				*dst++ = b;
-				*dst++ = g;
-				*dst++ = r;
-			}
-		}
+		for(unsigned y = 0; y < h; y++)
+			pixconv_bswap32((u32 *)(gpusrc+y*hw*4), (const u32 *)(pixels+y*w*4), w);
 		makeTexture(&(img->tex), gpusrc, hw, hh);
 		linearFree(gpusrc);
 	}
@@ -430,6 +432,7 @@ static int loadImage(DS3_Image *img, char *fname) {
 // =========================
 static inline void requestRepaint() {
 	svcSignalEvent(repaintRequired);
+	SDL_RequestRedraw();
 }
 
 static void uib_repaint(void *param) {
@@ -445,9 +448,10 @@ static void uib_repaint(void *param) {
 
 	// paint message
 	if (messagetime) {
-		if (SDL_GetTicks() < messagetime)
+		if (SDL_GetTicks() < messagetime) {
 			drawImage(&message_spr,0,228,320,12,0);
-		else
+			SDL_RequestRedraw(); // keep presenting until the message expires
+		} else
 			messagetime = 0;
 	}
 	
@@ -495,6 +499,9 @@ static void uib_repaint(void *param) {
 			drawImage(&(keymask_spr),k->x,k->y+kb_y_pos,k->w,k->h,0);
 		}
 	}
+
+	if (stats_visible)
+		drawImage(&stats_spr, 0, 0, 0, 0, 0);
 }
 
 // shutdown bottom
@@ -724,6 +731,32 @@ void uib_show_message(u32 ms_time, char *format, ... ) {
     } else {
         messagetime = 0;
     }
+    SDL_RequestRedraw();
+}
+
+// show up to STATS_LINES lines of text (separated by '\n') over the bottom screen, NULL hides them
+void uib_show_stats(const char *text) {
+	int y, n;
+
+	if (!text) {
+		if (stats_visible) {
+			stats_visible = 0;
+			requestRepaint();
+		}
+		return;
+	}
+	if (!stats_img)
+		stats_img = SDL_CreateRGBSurface(SDL_SWSURFACE,320,STATS_LINES*8+4,32,0x000000ff,0x0000ff00,0x00ff0000,0xff000000);
+	SDL_FillRect(stats_img, NULL, SDL_MapRGBA(stats_img->format,0,0,0,160));
+	for (y = 0; *text && y < STATS_LINES; ++y) {
+		n = strcspn(text, "\n");
+		if (n) uib_printstring(stats_img, text, 2, 2+y*8, n, ALIGN_LEFT, (SDL_Color){0xff,0xff,0xff,0}, (SDL_Color){0,0,0,160});
+		text += n;
+		if (*text) ++text;
+	}
+	makeImage(&stats_spr, stats_img->pixels, stats_img->w, stats_img->h, 0);
+	stats_visible = 1;
+	requestRepaint();
 }
 
 void uib_set_position(int x, int y) {
@@ -863,7 +896,15 @@ void uib_update(int what)
 			makeImage(&menu_spr, menu_img->pixels, menu_img->w, menu_img->h, 1);
 		}
 		if (uib_must_redraw & UIB_RECALC_VNC) {
-			makeImage(&uibvnc_spr, uibvnc_buffer, uibvnc_spr.w, uibvnc_spr.h, 1);
+			if (!uibvnc_tex_valid) {
+				// new buffer, transfer everything
+				memset(uibvnc_dirty, 0, sizeof(uibvnc_dirty));
+				makeImage(&uibvnc_spr, uibvnc_buffer, uibvnc_spr.w, uibvnc_spr.h, 1);
+				uibvnc_tex_valid = 1;
+			} else {
+				SDL_N3DSTransferDirtyBands(uibvnc_dirty, uibvnc_spr.tex.height / SDL_N3DS_BAND_HEIGHT,
+					uibvnc_buffer, uibvnc_spr.tex.data, uibvnc_spr.tex.width, uibvnc_spr.tex.height, 4, TEXTURE_TRANSFER_FLAGS);
+			}
 		}
 		uib_must_redraw = UIB_NO;
 		requestRepaint();
@@ -923,6 +964,8 @@ static int get_timeout(enum TapState s)
 
 int tap_lastx=0;
 int tap_lasty=0;
+static Uint32 tap_timeout = 0;
+static int tap_status2 = 0;
 
 static void set_tap_state(enum TapState s, SDL_Event *e)
 {
@@ -965,26 +1008,34 @@ static void set_tap_state(enum TapState s, SDL_Event *e)
 
 #define SETSTATE(x)								\
     {status = x;								\
-	timeout = get_timeout(x);					\
-	if (timeout) timeout += SDL_GetTicks();		\
+	tap_timeout = get_timeout(x);				\
+	if (tap_timeout) tap_timeout += SDL_GetTicks();	\
 	set_tap_state(x,e);							\
 	is_timeout=0;}
 
+// milliseconds until uib_handle_tap_processing(NULL) has work to do, -1 if idle
+int uib_tap_deadline() {
+	Uint32 now;
+
+	if (tap_status2) return 0;
+	if (!tap_timeout) return -1;
+	now = SDL_GetTicks();
+	return tap_timeout > now ? tap_timeout - now : 0;
+}
+
 int uib_handle_tap_processing(SDL_Event *e) {
-	static Uint32 timeout = 0;
 	static enum TapState status = TS_START;
-	static int status2 = 0;
 	int is_timeout = 0;
 
 	if (!e) {
-		switch (status2) {
+		switch (tap_status2) {
 		case 2:
 			set_tap_state(TS_MOUSEDOWN, NULL);
-			--status2;
+			--tap_status2;
 			break;
 		case 1:
 			set_tap_state(TS_MOUSEUP, NULL);
-			--status2;
+			--tap_status2;
 			break;
 		}
 	} else {
@@ -992,9 +1043,9 @@ int uib_handle_tap_processing(SDL_Event *e) {
 		tap_lasty = e->type == SDL_MOUSEMOTION ? e->motion.y : e->button.y;
 	}
 
-	if (timeout && SDL_GetTicks()>=timeout) {
+	if (tap_timeout && SDL_GetTicks()>=tap_timeout) {
 		is_timeout = 1;
-		timeout = 0;
+		tap_timeout = 0;
 	}
 	if (!e && !is_timeout) return 1;
 
@@ -1030,7 +1081,7 @@ int uib_handle_tap_processing(SDL_Event *e) {
         }
         else if (is_timeout) {
             SETSTATE(TS_START)
-            status2=2;
+            tap_status2=2;
         }
         break;
     case TS_SINGLETAP: // After timeout after first release 
@@ -1241,6 +1292,13 @@ void uibvnc_cleanup() {
 		free(uibvnc_buffer_big);
 		uibvnc_buffer_big=NULL;
 	}
+	jpegscale_free(&uibvnc_jpeg);
+	uibvnc_jpeg_scaled = 0;
+	uibvnc_tex_valid = 0;
+}
+
+static void uibvnc_setDirty(int y, int h) {
+	SDL_N3DSSetDirtyBands(uibvnc_dirty, SDL_N3DS_MAX_BANDS, y, h);
 }
 
 static void uibvnc_handleFrameBufferUpdate_mask (struct _rfbClient *client, int x, int y, int w, int h)
@@ -1254,6 +1312,27 @@ static void uibvnc_handleFrameBufferUpdate_mask (struct _rfbClient *client, int
 		}, w);
 		buffer += skip;
 	}, h);
+	uibvnc_setDirty(y, h);
+}
+
+// decode Tight JPEG rects at the scaled size instead of scaling them afterwards
+static rfbBool uibvnc_handleJpeg(struct _rfbClient *client, const uint8_t *buffer, int length, int x, int y, int w, int h)
+{
+	int f = scaling_factor_bot;
+	int xa = x / f;
+	int ya = y / f;
+
+	// the scaled IDCT only lines up with the scaled buffer at block boundaries
+	if (x % f || y % f) f = 1;
+	if (jpegscale(&uibvnc_jpeg, buffer, length, w, h, f,
+		uibvnc_buffer + xa * 4 + ya * uibvnc_pitch, uibvnc_pitch, uibvnc_spr.w - xa, uibvnc_spr.h - ya,
+		uibvnc_buffer_big + x * 4 + y * client->updateRect.w * 4, client->updateRect.w * 4))
+	{
+		rfbClientLog("TurboJPEG error: %s", tjGetErrorStr());
+		return FALSE;
+	}
+	uibvnc_jpeg_scaled = (f > 1);
+	return TRUE;
 }
 
 static void uibvnc_handleFrameBufferUpdate_scale (struct _rfbClient *client, int x, int y, int w, int h)
@@ -1263,9 +1342,12 @@ static void uibvnc_handleFrameBufferUpdate_scale (struct _rfbClient *client, int
 		int ya = y / scaling_factor_bot;
 		int wa = (w + scaling_factor_bot - 1) / scaling_factor_bot;
 		int ha = (h + scaling_factor_bot - 1) / scaling_factor_bot;
-		if (xa + wa > client->updateRect.w) wa = client->updateRect.w - xa;
-		if (ya + ha > client->updateRect.w) ha = client->updateRect.w - ya;
-		fastscale(
+		if (xa + wa > uibvnc_spr.w) wa = uibvnc_spr.w - xa;
+		if (ya + ha > uibvnc_spr.h) ha = uibvnc_spr.h - ya;
+		uibvnc_setDirty(ya, ha);
+		if (uibvnc_jpeg_scaled)
+			uibvnc_jpeg_scaled = 0;
+		else scale_box(
 			uibvnc_buffer + xa * 4 + ya * uibvnc_pitch,
 			uibvnc_pitch,
 			uibvnc_buffer_big + xa * scaling_factor_bot * 4 + ya * scaling_factor_bot * client->updateRect.w * 4,
@@ -1276,40 +1358,63 @@ static void uibvnc_handleFrameBufferUpdate_scale (struct _rfbClient *client, int
 	}
 }
 
+// Ask the server to shrink the desktop. Beyond 1024px it has to, so that it
+// fits into a texture; with fit set it goes as far as the screen allows when
+// the desktop is fitted to it, so no pixels are sent that can't be shown.
+// The server answers with a new framebuffer size, which calls the resize
+// handler again with client->width/height already shrunk by the factor.
+rfbBool uibvnc_server_scale(rfbClient* client, int screen_w, int screen_h, int fit) {
+	int scale = MAX(client->appData.scaleSetting, 1);
+	int width = client->width * scale;
+	int height = client->height * scale;
+	int wanted = 1;
+
+	if (!SupportsClient2Server(client, rfbSetScale) && !SupportsClient2Server(client, rfbPalmVNCSetScaleFactor))
+		return TRUE;
+	if (width > 1024 || height > 1024)
+		wanted = (MAX(width, height) + 1024) / 1024;
+	if (fit)
+		wanted = MAX(wanted, scale_fit_factor(width, height, screen_w, screen_h));
+	if (wanted == scale)
+		return TRUE;
+	if (!SendScaleSetting(client, wanted))
+	{
+		rfbClientErr("%s: SendScaleSetting failed", __func__);
+		return FALSE;
+	}
+	client->appData.scaleSetting = wanted;
+	rfbClientLog("desktop %dx%d, set server scale 1/%d", width, height, wanted);
+	return TRUE;
+}
+
 rfbBool uibvnc_resize(rfbClient* client) {
 
 //log_citra("enter %s, %p, %d, %d",__func__, client, client->width, client->height);
 	uibvnc_cleanup();
 
-	client->appData.scaleSetting = scaling_factor_bot = 1;
+	scaling_factor_bot = 1;
 	client->GotFrameBufferUpdate = uibvnc_handleFrameBufferUpdate_mask;
-	if (client->width > 1024 || client->height > 1024) {
-		if (SupportsClient2Server(client, rfbSetScale) || SupportsClient2Server(client, rfbPalmVNCSetScaleFactor)) {
-			// set server side scaling
-			client->appData.scaleSetting = (MAX(client->width,client->height) + 1024) / 1024;
-			if (!SendScaleSetting(client, client->appData.scaleSetting))
-			{
-				rfbClientErr("%s: SendScaleSetting failed", __func__);
-				return FALSE;
-			}
-			rfbClientLog("bot size >1024px, set server scale 1/%d", client->appData.scaleSetting);
-		} else {
-			// set client side scaling
-			scaling_factor_bot = (MAX(client->width,client->height) + 1024) / 1024;
-			if ((uibvnc_buffer_big = calloc(client->width*client->height,4)) == NULL)
-			{
-				rfbClientErr("%s: calloc %s", __func__, strerror(errno));
-				return FALSE;
-			}
-			client->GotFrameBufferUpdate = uibvnc_handleFrameBufferUpdate_scale;
-			rfbClientLog("bot size >1024px, set client scale 1/%d", scaling_factor_bot);
+	client->GotJpeg = NULL;
+	if (!uibvnc_server_scale(client, 320, 240, uibvnc_scaling && uibvnc_server_scaling))
+		return FALSE;
+	if (client->appData.scaleSetting > 1) {
+		// until the new size arrives, stay within the texture size
+		client->width = MIN(client->width, 1024);
+		client->height = MIN(client->height, 1024);
+	} else if (client->width > 1024 || client->height > 1024) {
+		// set client side scaling
+		scaling_factor_bot = (MAX(client->width,client->height) + 1024) / 1024;
+		if ((uibvnc_buffer_big = calloc(client->width*client->height,4)) == NULL)
+		{
+			rfbClientErr("%s: calloc %s", __func__, strerror(errno));
+			return FALSE;
 		}
-		if (!SendFramebufferUpdateRequest(client,
-			client->updateRect.x / client->appData.scaleSetting,
-			client->updateRect.y / client->appData.scaleSetting,
-			client->updateRect.w / client->appData.scaleSetting,
-			client->updateRect.h / client->appData.scaleSetting,
-			FALSE))
+		client->GotFrameBufferUpdate = uibvnc_handleFrameBufferUpdate_scale;
+		// libjpeg can only scale by 1/2, 1/4 and 1/8 while decoding
+		if ((scaling_factor_bot & (scaling_factor_bot - 1)) == 0 && scaling_factor_bot <= 8)
+			client->GotJpeg = uibvnc_handleJpeg;
+		rfbClientLog("bot size >1024px, set client scale 1/%d", scaling_factor_bot);
+		if (!SendFramebufferUpdateRequest(client, 0, 0, client->width, client->height, FALSE))
 		{
 			rfbClientErr("%s: SendFramebufferUpdateRequest failed", __func__);
 			return FALSE;
@@ -1369,8 +1474,9 @@ rfbBool uibvnc_resize(rfbClient* client) {
 	return TRUE;
 }
 
-void uibvnc_setScaling(int scaling) {
+void uibvnc_setScaling(int scaling, int server_scaling) {
 	uibvnc_scaling=scaling;
+	uibvnc_server_scaling=server_scaling;
 }
 
 void uib_qmenu_show() {
@@ -1398,6 +1504,7 @@ void uib_qmenu_show() {
 		"\x0C \xFD\xFE\xFF " "Toggle Bottom Backlight " " \x0C\n"
 		"\x0C \xF0   "       "Toggle Keys to VNC      " " \x0C\n"
 		"\x0C \xF1   "       "Toggle Mouse to VNC     " " \x0C\n"
+		"\x0C \xFA\xFB\xFC " "Toggle Statistics       " " \x0C\n"
 		"\x0C \xF3   "       "Exit Menu               " " \x0C\n"
 		"\x0F" "\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
 		"\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B\x0B"
@@ -62,9 +62,11 @@ extern void uib_update(int what);
 extern int uib_handle_event(SDL_Event *, int taphandling);
 extern void uib_init();
 extern int uib_handle_tap_processing(SDL_Event *e);
+extern int uib_tap_deadline();
 extern void uib_enable_keyboard(int enable);
 extern void uib_enable_log(int enable);
 extern void uib_show_scrollbars(int x, int y, int w, int h);
+extern void uib_show_stats(const char *text);
 #define SCROLLBAR_WIDTH 2
 extern int uib_getBacklight();
 extern void uib_setBacklight (int on);
@@ -72,7 +74,8 @@ extern void toggle_keyboard();
 
 extern rfbBool uibvnc_resize(rfbClient*);
 extern void uibvnc_cleanup();
-extern void uibvnc_setScaling(int);
+extern rfbBool uibvnc_server_scale(rfbClient*, int screen_w, int screen_h, int fit);
+extern void uibvnc_setScaling(int scaling, int server_scaling);
 extern void uib_qmenu_show();
 
 // exposed variables
@@ -12,50 +12,64 @@
 #include <stdarg.h>
 #include <string.h>
 #include "utilities.h"
+#include "turbojpeg.h"
 
-int fastscale(unsigned char *dst, int dst_pitch, unsigned char *src, int src_width, int src_height, int src_pitch, int factor)
+int jpegscale(struct jpegscale *js, const unsigned char *jpeg, int jpeg_size, int w, int h, int factor,
+	unsigned char *d, int dst_pitch, int dst_width, int dst_height, unsigned char *big, int big_pitch)
 {
-	if (factor < 2) return -1;
-
-	int temp_r, temp_g, temp_b;
-	int i1,i2;
-
-	int dst_width = src_width / factor;
-	int dst_height = src_height / factor;
-	if (!dst_height || !dst_width) return -1;
-	int factor_pow2 = factor * factor;
-	int factor_mul4 = factor << 2;
-	int src_skip1 = src_pitch - factor_mul4;
-	int src_skip2 = factor_mul4 - factor * src_pitch;
-	int src_skip3 = src_pitch * factor - dst_width * factor_mul4;
-	int dst_skip = dst_pitch - (dst_width << 2);
-
-	for (i1 = 0; i1 < dst_height; ++i1)
-	{
-		for (i2 = 0; i2 < dst_width; ++i2)
-		{
-			temp_r = temp_g = temp_b = 0;
-			DUFFS_LOOP ({
-				DUFFS_LOOP ({
-					src++; // alpha
-					temp_r += *(src++);
-					temp_g += *(src++);
-					temp_b += *(src++);
-				}, factor);
-				src += src_skip1;
-			}, factor);
-			*(dst++) = 255; // alpha
-			*(dst++) = temp_r / factor_pow2;
-			*(dst++) = temp_g / factor_pow2;
-			*(dst++) = temp_b / factor_pow2;
-			src += src_skip2;
+	if (factor != 1 && factor != 2 && factor != 4 && factor != 8) return -1;
+
+	if (!js->tjhnd && !(js->tjhnd = tjInitDecompress())) return -1;
+	// unscaled, straight into the full size framebuffer
+	if (factor == 1)
+		return tjDecompress(js->tjhnd, (unsigned char *)jpeg, jpeg_size, big,
+			w, big_pitch, h, 4, TJ_ALPHAFIRST | TJ_BGR) == -1 ? -1 : 0;
+
+	int sw = (w + factor - 1) / factor;
+	int sh = (h + factor - 1) / factor;
+	int i, j, k;
+
+	if (js->buf_size < sw * sh * 4) {
+		free(js->buf);
+		js->buf_size = 0;
+		if (!(js->buf = malloc(sw * sh * 4))) return -1;
+		js->buf_size = sw * sh * 4;
+	}
+	// tjDecompress picks the largest scaling factor that fits into sw x sh
+	if (tjDecompress(js->tjhnd, (unsigned char *)jpeg, jpeg_size, js->buf,
+		sw, sw * 4, sh, 4, TJ_ALPHAFIRST | TJ_BGR) == -1)
+		return -1;
+
+	// copy to the scaled framebuffer
+	if (dst_width > 0) {
+		for (j = 0; j < MIN(sh, dst_height); ++j)
+			memcpy(d + j * dst_pitch, js->buf + j * sw * 4, MIN(sw, dst_width) * 4);
+	}
+
+	// blow up into the full size framebuffer
+	if (big) {
+		for (j = 0; j < h; ++j) {
+			u32 *dp = (u32 *)(big + j * big_pitch);
+			if (j % factor) {
+				memcpy(dp, dp - big_pitch / 4, w * 4);
+				continue;
+			}
+			u32 *sp = (u32 *)(js->buf + (j / factor) * sw * 4);
+			for (i = 0; i < w; ++sp)
+				for (k = 0; k < factor && i < w; ++k)
+					dp[i++] = *sp;
 		}
-		dst += dst_skip;
-		src += src_skip3;
 	}
 	return 0;
 }
 
+void jpegscale_free(struct jpegscale *js)
+{
+	if (js->tjhnd) tjDestroy(js->tjhnd);
+	free(js->buf);
+	memset(js, 0, sizeof(*js));
+}
+
 u64 getmicrotime() {
     struct timeval tv;
     gettimeofday(&tv,NULL);
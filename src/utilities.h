@@ -43,6 +43,20 @@
 extern u64 getmicrotime();
 extern void printBits(size_t const size, void const * const ptr);
 extern void hex_dump(char *data, int size, char *caption);
-extern int fastscale(unsigned char *d, int dst_pitch, unsigned char *s, int src_width, int src_height, int src_pitch, int factor);
+
+// state for decoding JPEG rects at reduced size, one per VNC connection
+struct jpegscale {
+	void *tjhnd;			// TurboJPEG decompressor
+	unsigned char *buf;		// the scaled image before it is copied into place
+	int buf_size;
+};
+
+// decode a w x h JPEG rect at 1/factor (2, 4 or 8) using libjpeg's scaled IDCT
+// into d (clipped to dst_width x dst_height). If big is given, the result is
+// also blown up into the full size framebuffer so that CopyRect keeps working.
+// With factor 1 the rect is only decoded into big.
+extern int jpegscale(struct jpegscale *js, const unsigned char *jpeg, int jpeg_size, int w, int h, int factor,
+	unsigned char *d, int dst_pitch, int dst_width, int dst_height, unsigned char *big, int big_pitch);
+extern void jpegscale_free(struct jpegscale *js);
 
 #endif // _UTILITIES_H
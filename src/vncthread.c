@@ -0,0 +1,139 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * vncthread.c - receive and decode VNC server messages in a separate thread
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#include <3ds.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <rfb/rfbclient.h>
+#include "vncthread.h"
+
+#define STACKSIZE (128 * 1024)
+#define WAIT_USECS 100000
+
+static void *vnc_thread_tag = &vnc_thread_tag;
+
+static void lockWriteToServer(rfbClient *client) {
+	struct vnc_thread *t = rfbClientGetClientData(client, vnc_thread_tag);
+	LightLock_Lock(&t->sendLock);
+}
+
+static void unlockWriteToServer(rfbClient *client) {
+	struct vnc_thread *t = rfbClientGetClientData(client, vnc_thread_tag);
+	LightLock_Unlock(&t->sendLock);
+}
+
+// resizing touches the SDL and citro3d state, so the thread hands it over to
+// the main thread and waits for the result
+static rfbBool mallocFrameBuffer(rfbClient *client) {
+	struct vnc_thread *t = rfbClientGetClientData(client, vnc_thread_tag);
+	if (threadGetCurrent() != t->thread)
+		return t->mallocFrameBuffer(client);
+	__atomic_store_n(&t->callPending, 1, __ATOMIC_RELEASE);
+	svcSignalEvent(t->event);
+	LightEvent_Wait(&t->callDone);
+	return t->callResult;
+}
+
+static void runPendingCall(struct vnc_thread *t) {
+	if (__atomic_load_n(&t->callPending, __ATOMIC_ACQUIRE)) {
+		t->callResult = t->mallocFrameBuffer(t->client);
+		t->callPending = 0;
+		LightEvent_Signal(&t->callDone);
+	}
+}
+
+static void vnc_thread_main(void *arg) {
+	struct vnc_thread *t = (struct vnc_thread *)arg;
+	int i;
+
+	while (!t->stop) {
+		i = WaitForMessage(t->client, WAIT_USECS);
+		if (i == 0) continue;
+		LightLock_Lock(&t->decodeLock);
+		if (i < 0 || !HandleRFBServerMessage(t->client))
+			t->error = 1;
+		LightLock_Unlock(&t->decodeLock);
+		svcSignalEvent(t->event);
+		if (t->error) break;
+	}
+}
+
+int vnc_thread_start(struct vnc_thread *t, rfbClient *client) {
+	s32 prio = 0x30;
+	bool isNew3DS = false;
+
+	memset(t, 0, sizeof(*t));
+	t->client = client;
+	LightLock_Init(&t->sendLock);
+	LightLock_Init(&t->decodeLock);
+	LightEvent_Init(&t->callDone, RESET_ONESHOT);
+	if (svcCreateEvent(&t->event, RESET_ONESHOT)) return -1;
+
+	rfbClientSetClientData(client, vnc_thread_tag, t);
+	t->mallocFrameBuffer = client->MallocFrameBuffer;
+	client->MallocFrameBuffer = mallocFrameBuffer;
+	client->LockWriteToServer = lockWriteToServer;
+	client->UnlockWriteToServer = unlockWriteToServer;
+
+	// use the extra core of the New 3DS, otherwise run below the main thread
+	// so that input handling is not starved by heavy updates
+	svcGetThreadPriority(&prio, CUR_THREAD_HANDLE);
+	APT_CheckNew3DS(&isNew3DS);
+	if (isNew3DS)
+		t->thread = threadCreate(vnc_thread_main, t, STACKSIZE, prio, 2, false);
+	if (!t->thread)
+		t->thread = threadCreate(vnc_thread_main, t, STACKSIZE, prio < 0x3F ? prio + 1 : prio, -2, false);
+	if (!t->thread) {
+		client->MallocFrameBuffer = t->mallocFrameBuffer;
+		client->LockWriteToServer = NULL;
+		client->UnlockWriteToServer = NULL;
+		svcCloseHandle(t->event);
+		return -1;
+	}
+	return 0;
+}
+
+int vnc_thread_wait(struct vnc_thread *t, unsigned int usecs) {
+	// a timeout is not an error code, only 0 means signalled
+	return vnc_thread_check(t, svcWaitSynchronization(t->event, usecs * 1000LL) == 0);
+}
+
+int vnc_thread_check(struct vnc_thread *t, int signalled) {
+	runPendingCall(t);
+	return t->error ? -1 : (signalled ? 1 : 0);
+}
+
+void vnc_thread_lock(struct vnc_thread *t) {
+	if (!t->thread) return;
+	// the thread might be waiting for us to run a call while holding the lock
+	while (LightLock_TryLock(&t->decodeLock)) {
+		runPendingCall(t);
+		svcSleepThread(1000000LL);
+	}
+}
+
+void vnc_thread_unlock(struct vnc_thread *t) {
+	if (!t->thread) return;
+	LightLock_Unlock(&t->decodeLock);
+}
+
+void vnc_thread_stop(struct vnc_thread *t) {
+	if (!t->thread) return;
+	t->stop = 1;
+	// wake up the thread if it is waiting for data from the server
+	shutdown(t->client->sock, SHUT_RDWR);
+	while (threadJoin(t->thread, 10000000LL) != 0)
+		runPendingCall(t);
+	threadFree(t->thread);
+	t->thread = NULL;
+	svcCloseHandle(t->event);
+
+	t->client->MallocFrameBuffer = t->mallocFrameBuffer;
+	t->client->LockWriteToServer = NULL;
+	t->client->UnlockWriteToServer = NULL;
+}
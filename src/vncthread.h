@@ -0,0 +1,41 @@
+/*
+ * TinyVNC - A VNC client for Nintendo 3DS
+ *
+ * vncthread.h - receive and decode VNC server messages in a separate thread
+ *
+ * Copyright 2020 Sebastian Weber
+ */
+
+#ifndef _VNCTHREAD_H
+#define _VNCTHREAD_H
+
+#include <3ds.h>
+#include <rfb/rfbclient.h>
+
+struct vnc_thread {
+	rfbClient *client;
+	Thread thread;
+	volatile int stop;		// set by the main thread to end the thread
+	volatile int error;		// set by the thread if the connection failed
+	Handle event;			// signalled by the thread after every handled server message
+	LightLock sendLock;		// serializes messages sent by the main thread and the thread
+	LightLock decodeLock;	// held by the thread while handling a server message
+	// calls which must be run on the main thread (e.g. MallocFrameBuffer)
+	MallocFrameBufferProc mallocFrameBuffer;
+	volatile int callPending;
+	rfbBool callResult;
+	LightEvent callDone;
+};
+
+extern int vnc_thread_start(struct vnc_thread *t, rfbClient *client);
+// call from the main thread instead of WaitForMessage/HandleRFBServerMessage,
+// returns 1 if a server message was handled, 0 on timeout, -1 on error
+extern int vnc_thread_wait(struct vnc_thread *t, unsigned int usecs);
+// same as vnc_thread_wait, for callers which waited for t->event themselves
+extern int vnc_thread_check(struct vnc_thread *t, int signalled);
+// keep the thread from touching the framebuffer, e.g. while resizing it
+extern void vnc_thread_lock(struct vnc_thread *t);
+extern void vnc_thread_unlock(struct vnc_thread *t);
+extern void vnc_thread_stop(struct vnc_thread *t);
+
+#endif // _VNCTHREAD_H